@@ -816,6 +816,9 @@ struct nvsp_message {
 #define RNDIS_MAX_PKT_DEFAULT 8
 #define RNDIS_PKT_ALIGN_DEFAULT 8
 
+/* Longest a packet waits for a successor guessed from the qdisc backlog */
+#define NETVSC_TX_FLUSH_NS	(20 * NSEC_PER_USEC)
+
 struct multi_send_data {
 	struct sk_buff *skb; /* skb containing the pkt */
 	struct hv_netvsc_packet *pkt; /* netvsc pkt pending */
@@ -939,6 +942,7 @@ struct netvsc_channel {
 	struct multi_send_data msd;
 	struct multi_recv_comp mrc;
 	atomic_t queue_sends;
+	struct tasklet_hrtimer flush_timer;
 
 	struct netvsc_stats tx_stats;
 	struct netvsc_stats rx_stats;
@@ -572,6 +572,9 @@ void netvsc_device_remove(struct hv_device *device)
 	for (i = 0; i < net_device->num_chn; i++)
 		netif_napi_del(&net_device->chan_table[i].napi);
 
+	for (i = 0; i < VRSS_CHANNEL_MAX; i++)
+		tasklet_hrtimer_cancel(&net_device->chan_table[i].flush_timer);
+
 	/*
 	 * At this point, no one should be accessing net_device
 	 * except in here
@@ -894,6 +897,11 @@ int netvsc_send(struct net_device_context *ndev_ctx,
 		}
 	}
 
+	/* A stopped queue hands nothing over until it is woken */
+	if (netif_tx_queue_stopped(netdev_get_tx_queue(hv_get_drvdata(device),
+						       packet->q_idx)))
+		packet->xmit_more = false;
+
 	if (section_index != NETVSC_INVALID_INDEX) {
 		netvsc_copy_to_send_buf(net_device,
 					section_index, msd_len,
@@ -950,6 +958,13 @@ send_now:
 	if (ret != 0 && section_index != NETVSC_INVALID_INDEX)
 		netvsc_free_send_slot(net_device, section_index);
 
+	/* Don't let a guessed xmit_more strand the pending packet */
+	if (skb && nvchan->msd.pkt &&
+	    !hrtimer_active(&nvchan->flush_timer.timer))
+		tasklet_hrtimer_start(&nvchan->flush_timer,
+				      ns_to_ktime(NETVSC_TX_FLUSH_NS),
+				      HRTIMER_MODE_REL);
+
 	return ret;
 }
 
@@ -1225,6 +1240,53 @@ static struct hv_device *netvsc_channel_to_device(struct vmbus_channel *channel)
 	return primary ? primary->device_obj : channel->device_obj;
 }
 
+/*
+ * netvsc_start_xmit() guesses xmit_more from the qdisc backlog. When the
+ * qdisc stops handing packets over after all, the flush timer sends the
+ * packet left in its send section. If the ring is full the packet stays
+ * pending and the timer tries again.
+ */
+static enum hrtimer_restart netvsc_xmit_flush_timer(struct hrtimer *timer)
+{
+	struct netvsc_channel *nvchan
+		= container_of(timer, struct netvsc_channel, flush_timer.timer);
+	struct netvsc_device *net_device = nvchan->net_device;
+	struct hv_device *device = netvsc_channel_to_device(nvchan->channel);
+	struct net_device *ndev = hv_get_drvdata(device);
+	struct netdev_queue *txq
+		= netdev_get_tx_queue(ndev, nvchan - net_device->chan_table);
+	struct multi_send_data *msdp = &nvchan->msd;
+	struct hv_netvsc_packet *packet;
+	struct sk_buff *skb;
+	u32 count;
+	int ret;
+
+	__netif_tx_lock(txq, smp_processor_id());
+
+	if (msdp->pkt) {
+		count = msdp->count;
+		move_pkt_msd(&packet, &skb, msdp);
+		ret = netvsc_send_pkt(device, packet, net_device, NULL, skb);
+		if (ret == -EAGAIN || ret == -ENOSPC) {
+			msdp->skb = skb;
+			msdp->pkt = packet;
+			msdp->count = count;
+			if (!net_device->destroy)
+				tasklet_hrtimer_start(&nvchan->flush_timer,
+					ns_to_ktime(NETVSC_TX_FLUSH_NS),
+					HRTIMER_MODE_REL);
+		} else if (ret != 0) {
+			netvsc_free_send_slot(net_device,
+					      packet->send_buf_index);
+			dev_kfree_skb_any(skb);
+			ndev->stats.tx_dropped++;
+		}
+	}
+
+	__netif_tx_unlock(txq);
+	return HRTIMER_NORESTART;
+}
+
 /* Network processing softirq
  * Process data in incoming ring buffer from host
  * Stops when ring is empty or budget is met or exceeded.
@@ -1326,6 +1388,9 @@ struct netvsc_device *netvsc_device_add(struct hv_device *device,
 
 		nvchan->channel = device->channel;
 		nvchan->net_device = net_device;
+		tasklet_hrtimer_init(&nvchan->flush_timer,
+				     netvsc_xmit_flush_timer,
+				     CLOCK_MONOTONIC, HRTIMER_MODE_REL);
 	}
 
 	/* Enable NAPI handler before init callbacks */
@@ -1046,6 +1046,26 @@ static u32 net_checksum_info(struct sk_buff *skb)
 	return TRANSPORT_INFO_NOT_IP;
 }
 
+/*
+ * skb->next is cleared before the driver is called, so it hardly ever
+ * says more is coming. Packets still backlogged in this queue's qdisc are
+ * handed over right after this one though, unless the queue gets stopped
+ * or the qdisc run yields the CPU first; netvsc_send() arms a flush timer
+ * in case they are not.
+ */
+static bool netvsc_xmit_more(struct net_device *net, struct sk_buff *skb)
+{
+	struct netdev_queue *txq
+		= netdev_get_tx_queue(net, skb_get_queue_mapping(skb));
+	struct Qdisc *q = rcu_dereference_bh(txq->qdisc);
+
+	if (q && qdisc_qlen(q) > 0 && !netif_tx_queue_stopped(txq) &&
+	    !need_resched())
+		return true;
+
+	return skb->next != NULL;
+}
+
 static int netvsc_start_xmit(struct sk_buff *skb, struct net_device *net)
 {
 	struct net_device_context *net_device_ctx = netdev_priv(net);
@@ -1106,11 +1126,7 @@ static int netvsc_start_xmit(struct sk_buff *skb, struct net_device *net)
 			FIELD_SIZEOF(struct sk_buff, cb));
 	packet = (struct hv_netvsc_packet *)skb->cb;
 
-	/* TODO: This will likely evaluate to false, since RH7 and
-	 * below kernels will set next pointer to NULL before calling
-	 * into here. Should find another way to set this flag.
-	 */
-	packet->xmit_more = (skb->next != NULL);
+	packet->xmit_more = netvsc_xmit_more(net, skb);
 
 	packet->q_idx = skb_get_queue_mapping(skb);
 
@@ -88,10 +88,18 @@ int vmbus_open(struct vmbus_channel *newchannel, u32 send_ringbuffer_size,
 {
 	struct vmbus_channel_open_channel *open_msg;
 	struct vmbus_channel_msginfo *open_info = NULL;
+	struct vmbus_channel *primary = newchannel->primary_channel ?
+					newchannel->primary_channel : newchannel;
 	unsigned long flags;
 	int ret, err = 0;
 	struct page *page;
 
+	/* Sizes chosen through sysfs win, see ring_size_store() */
+	if (READ_ONCE(primary->ring_size_out))
+		send_ringbuffer_size = READ_ONCE(primary->ring_size_out);
+	if (READ_ONCE(primary->ring_size_in))
+		recv_ringbuffer_size = READ_ONCE(primary->ring_size_in);
+
 	if (send_ringbuffer_size % PAGE_SIZE ||
 	    recv_ringbuffer_size % PAGE_SIZE)
 		return -EINVAL;
@@ -267,6 +275,28 @@ int vmbus_send_tl_connect_request(const uuid_le *shv_guest_servie_id,
 }
 EXPORT_SYMBOL_GPL(vmbus_send_tl_connect_request);
 
+/*
+ * Ask the host to deliver the channel's interrupts to target_vp.
+ *
+ * The host does not acknowledge the message, so interrupts may keep
+ * arriving on the old CPU for a short while after this returns.
+ */
+int vmbus_send_modifychannel(u32 child_relid, u32 target_vp)
+{
+	struct vmbus_channel_modifychannel conn_msg;
+	int ret;
+
+	memset(&conn_msg, 0, sizeof(conn_msg));
+	conn_msg.header.msgtype = CHANNELMSG_MODIFYCHANNEL;
+	conn_msg.child_relid = child_relid;
+	conn_msg.target_vp = target_vp;
+
+	ret = vmbus_post_msg(&conn_msg, sizeof(conn_msg), true);
+	trace_vmbus_send_modifychannel(&conn_msg, ret);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(vmbus_send_modifychannel);
+
 /*
  * create_gpadl_header - Creates a gpadl for the specified buffer
  */
@@ -570,15 +600,10 @@ post_msg_err:
 }
 EXPORT_SYMBOL_GPL(vmbus_teardown_gpadl);
 
-static void reset_channel_cb(void *arg)
-{
-	struct vmbus_channel *channel = arg;
-
-	channel->onchannel_callback = NULL;
-}
-
 void vmbus_reset_channel_cb(struct vmbus_channel *channel)
 {
+	unsigned long flags;
+
 	/*
 	 * vmbus_on_event(), running in the per-channel tasklet, can race
 	 * with vmbus_close_internal() in the case of SMP guest, e.g., when
@@ -591,15 +616,14 @@ void vmbus_reset_channel_cb(struct vmbus_channel *channel)
 
 	channel->sc_creation_callback = NULL;
 
-	/* Stop the callback asap */
-	if (channel->target_cpu != get_cpu()) {
-		put_cpu();
-		smp_call_function_single(channel->target_cpu, reset_channel_cb,
-					 channel, true);
-	} else {
-		reset_channel_cb(channel);
-		put_cpu();
-	}
+	/*
+	 * Stop the callback asap. ISR callbacks run under sched_lock on
+	 * whichever CPU the interrupt arrives, which is not necessarily
+	 * target_cpu while the channel is being moved.
+	 */
+	spin_lock_irqsave(&channel->sched_lock, flags);
+	channel->onchannel_callback = NULL;
+	spin_unlock_irqrestore(&channel->sched_lock, flags);
 
 	/* Re-enable tasklet for use on re-open */
 	tasklet_enable(&channel->callback_event);
@@ -855,6 +879,89 @@ int vmbus_sendpacket_mpb_desc(struct vmbus_channel *channel,
 }
 EXPORT_SYMBOL_GPL(vmbus_sendpacket_mpb_desc);
 
+/**
+ * vmbus_sendpacket_batch() - Send several packets with one ring update
+ * @channel: Pointer to vmbus_channel structure.
+ * @pkts: Packets to send; see struct vmbus_batch_packet.
+ * @count: Number of packets in @pkts.
+ * @sent: Returns the number of packets placed in the ring.
+ *
+ * The packets are laid out exactly as vmbus_sendpacket() and
+ * vmbus_sendpacket_pagebuffer() would lay them out, but they are copied
+ * into the ring under one reservation, the write index is updated once and
+ * the host is signaled at most once for the whole batch.
+ *
+ * Returns 0 if every packet was sent. If the ring fills up, the leading
+ * *@sent packets are sent and -EAGAIN is returned.
+ */
+int vmbus_sendpacket_batch(struct vmbus_channel *channel,
+			   struct vmbus_batch_packet *pkts, u32 count,
+			   u32 *sent)
+{
+	static const u64 aligned_data;
+	struct vmbus_batch_packet *pkt;
+	u32 descsize, packetlen, packetlen_aligned;
+	u32 i;
+
+	*sent = 0;
+
+	for (i = 0; i < count; i++) {
+		pkt = &pkts[i];
+
+		if (pkt->pagecount > MAX_PAGE_BUFFER_COUNT)
+			return -EINVAL;
+
+		if (pkt->pagecount) {
+			/* struct hv_page_buffer has the GPA range layout */
+			descsize = sizeof(pkt->desc.gpa_direct) +
+				pkt->pagecount * sizeof(struct hv_page_buffer);
+			packetlen = descsize + pkt->bufferlen;
+			packetlen_aligned = ALIGN(packetlen, sizeof(u64));
+
+			pkt->desc.gpa_direct.type =
+				VM_PKT_DATA_USING_GPA_DIRECT;
+			pkt->desc.gpa_direct.flags =
+				VMBUS_DATA_PACKET_FLAG_COMPLETION_REQUESTED;
+			pkt->desc.gpa_direct.dataoffset8 = descsize >> 3;
+			pkt->desc.gpa_direct.length8 =
+				(u16)(packetlen_aligned >> 3);
+			pkt->desc.gpa_direct.transactionid = pkt->requestid;
+			pkt->desc.gpa_direct.reserved = 0;
+			pkt->desc.gpa_direct.rangecount = pkt->pagecount;
+
+			pkt->kv[0].iov_base = &pkt->desc.gpa_direct;
+			pkt->kv[0].iov_len = sizeof(pkt->desc.gpa_direct);
+			pkt->kv[1].iov_base = pkt->pagebuffers;
+			pkt->kv[1].iov_len = descsize - pkt->kv[0].iov_len;
+			pkt->kv_count = 2;
+		} else {
+			descsize = sizeof(struct vmpacket_descriptor);
+			packetlen = descsize + pkt->bufferlen;
+			packetlen_aligned = ALIGN(packetlen, sizeof(u64));
+
+			pkt->desc.inband.type = pkt->type;
+			pkt->desc.inband.flags = pkt->flags;
+			pkt->desc.inband.offset8 = descsize >> 3;
+			pkt->desc.inband.len8 = (u16)(packetlen_aligned >> 3);
+			pkt->desc.inband.trans_id = pkt->requestid;
+
+			pkt->kv[0].iov_base = &pkt->desc.inband;
+			pkt->kv[0].iov_len = descsize;
+			pkt->kv_count = 1;
+		}
+
+		pkt->kv[pkt->kv_count].iov_base = pkt->buffer;
+		pkt->kv[pkt->kv_count].iov_len = pkt->bufferlen;
+		pkt->kv_count++;
+		pkt->kv[pkt->kv_count].iov_base = (void *)&aligned_data;
+		pkt->kv[pkt->kv_count].iov_len = packetlen_aligned - packetlen;
+		pkt->kv_count++;
+	}
+
+	return hv_ringbuffer_write_batch(channel, pkts, count, sent);
+}
+EXPORT_SYMBOL_GPL(vmbus_sendpacket_batch);
+
 /**
  * vmbus_recvpacket() - Retrieve the user packet on the specified channel
  * @channel: Pointer to vmbus_channel structure.
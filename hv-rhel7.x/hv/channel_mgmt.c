@@ -31,6 +31,8 @@
 #include <linux/completion.h>
 #include <linux/topology.h>
 #include <linux/delay.h>
+#include <linux/cpu.h>
+#include <linux/workqueue.h>
 #include "include/linux/hyperv.h"
 #include <lis/asm/mshyperv.h>
 
@@ -340,11 +342,20 @@ static struct vmbus_channel *alloc_channel(void)
 	if (!channel)
 		return NULL;
 
+	channel->stats = alloc_percpu(struct vmbus_channel_stats);
+	if (!channel->stats) {
+		kfree(channel);
+		return NULL;
+	}
+
 	spin_lock_init(&channel->lock);
+	spin_lock_init(&channel->sched_lock);
 	init_completion(&channel->rescind_event);
 
 	INIT_LIST_HEAD(&channel->sc_list);
-	INIT_LIST_HEAD(&channel->percpu_list);
+
+	channel->poll_enter_rate = VMBUS_POLL_ENTER_RATE;
+	channel->poll_idle_us = VMBUS_POLL_IDLE_US;
 
 	tasklet_init(&channel->callback_event,
 		     vmbus_on_event, (unsigned long)channel);
@@ -362,22 +373,6 @@ static void free_channel(struct vmbus_channel *channel)
 	kobject_put(&channel->kobj);
 }
 
-static void percpu_channel_enq(void *arg)
-{
-	struct vmbus_channel *channel = arg;
-	struct hv_per_cpu_context *hv_cpu
-		= this_cpu_ptr(hv_context.cpu_context);
-
-	list_add_tail_rcu(&channel->percpu_list, &hv_cpu->chan_list);
-}
-
-static void percpu_channel_deq(void *arg)
-{
-	struct vmbus_channel *channel = arg;
-
-	list_del_rcu(&channel->percpu_list);
-}
-
 static void vmbus_release_relid(u32 relid)
 {
 	struct vmbus_channel_relid_released msg;
@@ -408,15 +403,7 @@ void hv_process_channel_removal(u32 relid)
 		return;
 
 	BUG_ON(!channel->rescind);
-	if (channel->target_cpu != get_cpu()) {
-		put_cpu();
-		smp_call_function_single(channel->target_cpu,
-					 percpu_channel_deq, channel, true);
-	} else {
-		percpu_channel_deq(channel);
-		put_cpu();
-	}
-
+	vmbus_channel_unmap_relid(channel);
 
 	if (channel->primary_channel == NULL) {
 		list_del(&channel->listentry);
@@ -470,17 +457,6 @@ static void vmbus_add_channel_work(struct work_struct *work)
 
 	init_vp_index(newchannel, dev_type);
 
-	if (newchannel->target_cpu != get_cpu()) {
-		put_cpu();
-		smp_call_function_single(newchannel->target_cpu,
-					 percpu_channel_enq,
-					 newchannel, true);
-	} else {
-		percpu_channel_enq(newchannel);
-		put_cpu();
-
-	}
-
 	/*
 	 * This state is used to indicate a successful open
 	 * so that when we do close the channel normally, we
@@ -539,6 +515,8 @@ err_deq_chan:
 	 */
 	newchannel->probe_done = true;
 
+	vmbus_channel_unmap_relid(newchannel);
+
 	if (primary_channel == NULL) {
 		list_del(&newchannel->listentry);
 	} else {
@@ -549,16 +527,6 @@ err_deq_chan:
 
 	mutex_unlock(&vmbus_connection.channel_mutex);
 
-	if (newchannel->target_cpu != get_cpu()) {
-		put_cpu();
-		smp_call_function_single(newchannel->target_cpu,
-					 percpu_channel_deq,
-					 newchannel, true);
-	} else {
-		percpu_channel_deq(newchannel);
-		put_cpu();
-	}
-
 	vmbus_release_relid(newchannel->offermsg.child_relid);
 
 	free_channel(newchannel);
@@ -606,6 +574,7 @@ static void vmbus_process_offer(struct vmbus_channel *newchannel)
 			 * Don't call free_channel(), because newchannel->kobj
 			 * is not initialized yet.
 			 */
+			free_percpu(newchannel->stats);
 			kfree(newchannel);
 			WARN_ON_ONCE(1);
 			return;
@@ -619,6 +588,8 @@ static void vmbus_process_offer(struct vmbus_channel *newchannel)
 		spin_unlock_irqrestore(&channel->lock, flags);
 	}
 
+	vmbus_channel_map_relid(newchannel);
+
 	mutex_unlock(&vmbus_connection.channel_mutex);
 
 	/*
@@ -823,6 +794,231 @@ static void init_vp_index(struct vmbus_channel *channel, u16 dev_type)
 #endif
 }
 
+/*
+ * Move the interrupts of an open channel to another CPU of its NUMA node.
+ *
+ * Called with the CPU hotplug lock and channel_mutex held. The host may
+ * keep delivering interrupts on the old CPU for a short while; that is
+ * harmless since vmbus_chan_sched() looks the channel up by relid and
+ * runs its callback or schedules its tasklet on whichever CPU the
+ * interrupt arrived.
+ */
+int vmbus_channel_retarget(struct vmbus_channel *channel, u32 target_cpu)
+{
+	struct vmbus_channel *primary = channel->primary_channel;
+	u32 origin_cpu = channel->target_cpu;
+	int ret;
+
+	lockdep_assert_held(&vmbus_connection.channel_mutex);
+
+	/* CHANNELMSG_MODIFYCHANNEL needs protocol 4.1 or later */
+	if (vmbus_proto_version < VERSION_WIN10_V5)
+		return -EOPNOTSUPP;
+
+	if (target_cpu >= nr_cpu_ids || !cpu_online(target_cpu))
+		return -EINVAL;
+
+	/*
+	 * The ring buffer pages were allocated on the channel's node, and
+	 * init_vp_index() keeps the sub-channels of a localized device
+	 * on one node, so channels only move within their node.
+	 */
+	if (cpu_to_node(target_cpu) != cpu_to_node(origin_cpu))
+		return -EINVAL;
+
+	/* The host ignores MODIFYCHANNEL for channels that are not open */
+	if (channel->state != CHANNEL_OPENED_STATE || channel->rescind)
+		return -EIO;
+
+	if (target_cpu == origin_cpu)
+		return 0;
+
+	ret = vmbus_send_modifychannel(channel->offermsg.child_relid,
+				       hv_cpu_number_to_vp_number(target_cpu));
+	if (ret)
+		return ret;
+
+	spin_lock(&bind_channel_to_cpu_lock);
+
+	channel->target_cpu = target_cpu;
+	channel->target_vp = hv_cpu_number_to_vp_number(target_cpu);
+
+	/* See hv_process_channel_removal() */
+	if (primary && channel->affinity_policy == HV_LOCALIZED) {
+		cpumask_clear_cpu(origin_cpu, &primary->alloced_cpus_in_node);
+		cpumask_set_cpu(target_cpu, &primary->alloced_cpus_in_node);
+	}
+
+	spin_unlock(&bind_channel_to_cpu_lock);
+
+	if (channel->change_target_cpu_callback)
+		channel->change_target_cpu_callback(channel, origin_cpu,
+						    target_cpu);
+
+	return 0;
+}
+
+/*
+ * Dynamic channel rebinding
+ *
+ * init_vp_index() spreads the channels over the CPUs once, when they are
+ * offered, without knowing how busy each of them is going to be. When
+ * rebalance_interval_ms is set, a periodic pass counts the interrupts every
+ * channel took over the last interval and, within each NUMA node, moves one
+ * performance critical channel from the busiest CPU to the least busy one
+ * if that narrows the gap between the two.
+ */
+#define VMBUS_REBALANCE_MIN_RATE	1000	/* interrupts per second */
+
+static bool rebalance_running;
+static bool rebalance_primed;
+
+static void vmbus_rebalance_work(struct work_struct *work);
+static DECLARE_DELAYED_WORK(rebalance_work, vmbus_rebalance_work);
+
+static void vmbus_rebalance_account(struct vmbus_channel *channel,
+				    u64 *cpu_load)
+{
+	u64 interrupts = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		interrupts += per_cpu_ptr(channel->stats, cpu)->interrupts;
+
+	channel->rebalance_load = interrupts - channel->rebalance_interrupts;
+	channel->rebalance_interrupts = interrupts;
+	cpu_load[channel->target_cpu] += channel->rebalance_load;
+}
+
+static bool vmbus_rebalance_movable(const struct vmbus_channel *channel)
+{
+	return vmbus_devs[hv_get_dev_type(channel)].perf_device &&
+	       channel->state == CHANNEL_OPENED_STATE && !channel->rescind;
+}
+
+/*
+ * Moving a channel with load l from the busiest to the idlest CPU turns
+ * their loads (max, min) into (max - l, min + l). Pick the channel that
+ * brings the two closest together.
+ */
+static void vmbus_rebalance_pick(struct vmbus_channel *channel, u32 busiest,
+				 u64 gap, struct vmbus_channel **best,
+				 u64 *best_dist)
+{
+	u64 load = channel->rebalance_load, dist;
+
+	if (channel->target_cpu != busiest || load == 0 || load >= gap ||
+	    !vmbus_rebalance_movable(channel))
+		return;
+
+	dist = abs64((s64)(2 * load) - (s64)gap);
+	if (*best == NULL || dist < *best_dist) {
+		*best = channel;
+		*best_dist = dist;
+	}
+}
+
+static void vmbus_rebalance_node(int node, const u64 *cpu_load, u64 min_load)
+{
+	struct vmbus_channel *channel, *sc, *best = NULL;
+	int cpu, busiest = -1, idlest = -1;
+	u64 gap, best_dist = 0;
+
+	for_each_cpu_and(cpu, cpumask_of_node(node), cpu_online_mask) {
+		if (busiest < 0 || cpu_load[cpu] > cpu_load[busiest])
+			busiest = cpu;
+		if (idlest < 0 || cpu_load[cpu] < cpu_load[idlest])
+			idlest = cpu;
+	}
+
+	if (busiest < 0 || busiest == idlest)
+		return;
+
+	/* Leave quiet CPUs and small imbalances alone */
+	gap = cpu_load[busiest] - cpu_load[idlest];
+	if (cpu_load[busiest] < min_load || gap * 4 < cpu_load[busiest])
+		return;
+
+	list_for_each_entry(channel, &vmbus_connection.chn_list, listentry) {
+		vmbus_rebalance_pick(channel, busiest, gap, &best, &best_dist);
+		list_for_each_entry(sc, &channel->sc_list, sc_list)
+			vmbus_rebalance_pick(sc, busiest, gap, &best,
+					     &best_dist);
+	}
+
+	if (best && vmbus_channel_retarget(best, idlest) == 0)
+		pr_debug("rebalance: relid %u from cpu %d to %d\n",
+			 best->offermsg.child_relid, busiest, idlest);
+}
+
+static void vmbus_rebalance_work(struct work_struct *work)
+{
+	unsigned int interval = READ_ONCE(rebalance_interval_ms);
+	struct vmbus_channel *channel, *sc;
+	u64 *cpu_load, min_load;
+	int node;
+
+	if (!interval || vmbus_proto_version < VERSION_WIN10_V5)
+		return;
+
+	cpu_load = kcalloc(nr_cpu_ids, sizeof(*cpu_load), GFP_KERNEL);
+	if (!cpu_load)
+		goto out;
+
+	get_online_cpus();
+	mutex_lock(&vmbus_connection.channel_mutex);
+
+	list_for_each_entry(channel, &vmbus_connection.chn_list, listentry) {
+		vmbus_rebalance_account(channel, cpu_load);
+		list_for_each_entry(sc, &channel->sc_list, sc_list)
+			vmbus_rebalance_account(sc, cpu_load);
+	}
+
+	/* The first pass after (re)arming only takes the baseline */
+	if (rebalance_primed) {
+		min_load = (u64)VMBUS_REBALANCE_MIN_RATE * interval /
+			   MSEC_PER_SEC;
+		for_each_online_node(node)
+			vmbus_rebalance_node(node, cpu_load, min_load);
+	}
+	rebalance_primed = true;
+
+	mutex_unlock(&vmbus_connection.channel_mutex);
+	put_online_cpus();
+
+	kfree(cpu_load);
+out:
+	if (READ_ONCE(rebalance_running))
+		schedule_delayed_work(&rebalance_work,
+				      msecs_to_jiffies(interval));
+}
+
+/* (Re)arm the rebalancer after rebalance_interval_ms changed */
+void vmbus_rebalance_update(void)
+{
+	unsigned int interval = READ_ONCE(rebalance_interval_ms);
+
+	if (!READ_ONCE(rebalance_running))
+		return;
+
+	rebalance_primed = false;
+	if (interval)
+		mod_delayed_work(system_wq, &rebalance_work,
+				 msecs_to_jiffies(interval));
+}
+
+void vmbus_rebalance_start(void)
+{
+	WRITE_ONCE(rebalance_running, true);
+	vmbus_rebalance_update();
+}
+
+void vmbus_rebalance_stop(void)
+{
+	WRITE_ONCE(rebalance_running, false);
+	cancel_delayed_work_sync(&rebalance_work);
+}
+
 static void vmbus_wait_for_unload(void)
 {
 	int cpu;
@@ -1296,6 +1492,7 @@ channel_message_table[CHANNELMSG_COUNT] = {
 	{ CHANNELMSG_19,			0, NULL },
 	{ CHANNELMSG_20,			0, NULL },
 	{ CHANNELMSG_TL_CONNECT_REQUEST,	0, NULL },
+	{ CHANNELMSG_MODIFYCHANNEL,		0, NULL },
 };
 
 /*
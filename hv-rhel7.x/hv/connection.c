@@ -209,6 +209,14 @@ int vmbus_connect(void)
 	INIT_LIST_HEAD(&vmbus_connection.chn_list);
 	mutex_init(&vmbus_connection.channel_mutex);
 
+	vmbus_connection.channels = kcalloc(MAX_CHANNEL_RELIDS,
+					    sizeof(struct vmbus_channel *),
+					    GFP_KERNEL);
+	if (vmbus_connection.channels == NULL) {
+		ret = -ENOMEM;
+		goto cleanup;
+	}
+
 	/*
 	 * Setup the vmbus event connection for channel interrupt
 	 * abstraction stuff
@@ -312,41 +320,114 @@ void vmbus_disconnect(void)
 	free_pages((unsigned long)vmbus_connection.monitor_pages[1], 0);
 	vmbus_connection.monitor_pages[0] = NULL;
 	vmbus_connection.monitor_pages[1] = NULL;
+
+	kfree(vmbus_connection.channels);
+	vmbus_connection.channels = NULL;
 }
 
 /*
  * relid2channel - Get the channel object given its
  * child relative id (ie channel id)
+ *
+ * Called with either channel_mutex or the RCU read lock held.
  */
 struct vmbus_channel *relid2channel(u32 relid)
 {
-	struct vmbus_channel *channel;
-	struct vmbus_channel *found_channel  = NULL;
-	struct list_head *cur, *tmp;
-	struct vmbus_channel *cur_sc;
+	if (unlikely(relid >= MAX_CHANNEL_RELIDS))
+		return NULL;
+
+	return rcu_dereference_check(vmbus_connection.channels[relid],
+			lockdep_is_held(&vmbus_connection.channel_mutex));
+}
+
+/*
+ * vmbus_channel_map_relid - Make a channel visible to relid2channel()
+ *
+ * The channel must be fully initialized: the interrupt path may find it
+ * as soon as it is published.
+ */
+void vmbus_channel_map_relid(struct vmbus_channel *channel)
+{
+	u32 relid = channel->offermsg.child_relid;
 
 	BUG_ON(!mutex_is_locked(&vmbus_connection.channel_mutex));
 
-	list_for_each_entry(channel, &vmbus_connection.chn_list, listentry) {
-		if (channel->offermsg.child_relid == relid) {
-			found_channel = channel;
-			break;
-		} else if (!list_empty(&channel->sc_list)) {
-			/*
-			 * Deal with sub-channels.
-			 */
-			list_for_each_safe(cur, tmp, &channel->sc_list) {
-				cur_sc = list_entry(cur, struct vmbus_channel,
-							sc_list);
-				if (cur_sc->offermsg.child_relid == relid) {
-					found_channel = cur_sc;
-					break;
-				}
-			}
+	if (WARN_ON(relid >= MAX_CHANNEL_RELIDS))
+		return;
+
+	rcu_assign_pointer(vmbus_connection.channels[relid], channel);
+}
+
+/*
+ * vmbus_channel_unmap_relid - Hide a channel from relid2channel()
+ *
+ * Readers under RCU may still see the channel until a grace period has
+ * elapsed, which the kfree_rcu() in vmbus_chan_release() waits for.
+ */
+void vmbus_channel_unmap_relid(struct vmbus_channel *channel)
+{
+	u32 relid = channel->offermsg.child_relid;
+
+	BUG_ON(!mutex_is_locked(&vmbus_connection.channel_mutex));
+
+	if (WARN_ON(relid >= MAX_CHANNEL_RELIDS))
+		return;
+
+	RCU_INIT_POINTER(vmbus_connection.channels[relid], NULL);
+}
+
+/*
+ * Adaptive channels are handled like batched ones until the host signals
+ * them poll_enter_rate times within a millisecond. From then on the host
+ * interrupt stays masked and the tasklet reschedules itself to poll the
+ * ring, until the ring has been empty for poll_idle_us.
+ *
+ * Returns true if the event was handled in polling mode.
+ */
+static bool vmbus_poll_channel(struct vmbus_channel *channel,
+			       void (*callback_fn)(void *))
+{
+	struct hv_ring_buffer_info *rbi = &channel->inbound;
+	u64 now = local_clock();
+	u32 enter_rate;
+
+	if (!channel->polling) {
+		enter_rate = READ_ONCE(channel->poll_enter_rate);
+		if (enter_rate == 0)
+			return false;
+
+		if (now - channel->poll_window_start > NSEC_PER_MSEC) {
+			channel->poll_window_start = now;
+			channel->poll_window_events = 0;
 		}
+
+		if (++channel->poll_window_events < enter_rate)
+			return false;
+
+		channel->polling = true;
+		channel->poll_last_busy = now;
 	}
 
-	return found_channel;
+	vmbus_chan_stat_inc(channel, polls);
+
+	if (hv_get_bytes_to_read(rbi) != 0) {
+		(*callback_fn)(channel->channel_callback_context);
+		channel->poll_last_busy = now;
+	} else if (now - channel->poll_last_busy >
+		   (u64)READ_ONCE(channel->poll_idle_us) * NSEC_PER_USEC) {
+		/* Idle: back to interrupts, unless data raced in */
+		if (hv_end_read(rbi) == 0) {
+			channel->polling = false;
+			channel->poll_window_events = 0;
+			return true;
+		}
+
+		hv_begin_read(rbi);
+		channel->poll_last_busy = now;
+	}
+
+	tasklet_schedule(&channel->callback_event);
+	return true;
 }
 
 /*
@@ -370,6 +451,8 @@ void vmbus_on_event(unsigned long data)
 
 	trace_vmbus_on_event(channel);
 
+	vmbus_chan_stat_inc(channel, callbacks);
+
 	do {
 		void (*callback_fn)(void *);
 
@@ -382,9 +465,18 @@ void vmbus_on_event(unsigned long data)
 		if (unlikely(callback_fn == NULL))
 			return;
 
+		if (READ_ONCE(channel->callback_mode) == HV_CALL_ADAPTIVE) {
+			if (vmbus_poll_channel(channel, callback_fn))
+				return;
+		} else {
+			/* Switched away from adaptive while polling */
+			channel->polling = false;
+		}
+
 		(*callback_fn)(channel->channel_callback_context);
 
-		if (channel->callback_mode != HV_CALL_BATCHED)
+		if (channel->callback_mode != HV_CALL_BATCHED &&
+		    channel->callback_mode != HV_CALL_ADAPTIVE)
 			return;
 
 		if (likely(hv_end_read(&channel->inbound) == 0))
@@ -503,7 +503,6 @@ enum hv_dm_state {
 };
 
 
-static __u8 recv_buffer[PAGE_SIZE];
 static __u8 *send_buffer;
 #define PAGES_IN_2M	512
 #define HA_CHUNK (32 * 1024)
@@ -1481,8 +1480,8 @@ static void cap_resp(struct hv_dynmem_device *dm,
 static void balloon_onchannelcallback(void *context)
 {
 	struct hv_device *dev = context;
+	struct vmpacket_descriptor *desc;
 	u32 recvlen;
-	u64 requestid;
 	struct dm_message *dm_msg;
 	struct dm_header *dm_hdr;
 	struct hv_dynmem_device *dm = hv_get_drvdata(dev);
@@ -1491,14 +1490,21 @@ static void balloon_onchannelcallback(void *context)
 	union dm_mem_page_range *ha_pg_range;
 	union dm_mem_page_range *ha_region;
 
-	memset(recv_buffer, 0, sizeof(recv_buffer));
-	vmbus_recvpacket(dev->channel, recv_buffer,
-			 PAGE_SIZE, &recvlen, &requestid);
+	/*
+	 * The message is parsed in place in the ring. Everything that
+	 * outlives this callback is copied into dm before it is released.
+	 */
+	desc = vmbus_borrow_packet(dev->channel);
+	if (!desc)
+		return;
 
-	if (recvlen > 0) {
-		dm_msg = (struct dm_message *)recv_buffer;
-		dm_hdr = &dm_msg->hdr;
+	dm_msg = hv_pkt_data(desc);
+	dm_hdr = &dm_msg->hdr;
+	recvlen = hv_pkt_datalen(desc);
 
+	if (recvlen < sizeof(struct dm_header) || dm_hdr->size > recvlen) {
+		pr_warn("Malformed message: len %u\n", recvlen);
+	} else {
 		switch (dm_hdr->type) {
 		case DM_VERSION_RESPONSE:
 			version_resp(dm,
@@ -1513,7 +1519,7 @@ static void balloon_onchannelcallback(void *context)
 		case DM_BALLOON_REQUEST:
 			if (dm->state == DM_BALLOON_UP)
 				pr_warn("Currently ballooning\n");
-			bal_msg = (struct dm_balloon *)recv_buffer;
+			bal_msg = (struct dm_balloon *)dm_msg;
 			dm->state = DM_BALLOON_UP;
 			dm_device.balloon_wrk.num_pages = bal_msg->num_pages;
 			schedule_work(&dm_device.balloon_wrk.wrk);
@@ -1522,14 +1528,14 @@ static void balloon_onchannelcallback(void *context)
 		case DM_UNBALLOON_REQUEST:
 			dm->state = DM_BALLOON_DOWN;
 			balloon_down(dm,
-				 (struct dm_unballoon_request *)recv_buffer);
+				 (struct dm_unballoon_request *)dm_msg);
 			break;
 
 		case DM_MEM_HOT_ADD_REQUEST:
 			if (dm->state == DM_HOT_ADD)
 				pr_warn("Currently hot-adding\n");
 			dm->state = DM_HOT_ADD;
-			ha_msg = (struct dm_hot_add *)recv_buffer;
+			ha_msg = (struct dm_hot_add *)dm_msg;
 			if (ha_msg->hdr.size == sizeof(struct dm_hot_add)) {
 				/*
 				 * This is a normal hot-add request specifying
@@ -1564,6 +1570,7 @@ static void balloon_onchannelcallback(void *context)
 		}
 	}
 
+	vmbus_release_packet(dev->channel, desc);
 }
 
 static int balloon_probe(struct hv_device *dev,
@@ -296,6 +296,25 @@ TRACE_EVENT(vmbus_send_tl_connect_request,
 		    )
 	);
 
+TRACE_EVENT(vmbus_send_modifychannel,
+	    TP_PROTO(const struct vmbus_channel_modifychannel *msg,
+		     int ret),
+	    TP_ARGS(msg, ret),
+	    TP_STRUCT__entry(
+		    __field(u32, child_relid)
+		    __field(u32, target_vp)
+		    __field(int, ret)
+		    ),
+	    TP_fast_assign(
+		    __entry->child_relid = msg->child_relid;
+		    __entry->target_vp = msg->target_vp;
+		    __entry->ret = ret;
+		    ),
+	    TP_printk("binding child_relid 0x%x to target_vp 0x%x, ret %d",
+		      __entry->child_relid, __entry->target_vp, __entry->ret
+		    )
+	);
+
 DECLARE_EVENT_CLASS(vmbus_channel,
 	TP_PROTO(const struct vmbus_channel *channel),
 	TP_ARGS(channel),
@@ -319,6 +338,84 @@ DEFINE_EVENT(vmbus_channel, vmbus_on_event,
 	    TP_ARGS(channel)
 );
 
+/*
+ * Ring buffer data path events. Latencies are derived from the trace
+ * timestamps by pairing these with vmbus_chan_sched, see
+ * tools/hv_ring_hist.
+ */
+TRACE_EVENT(vmbus_ringbuffer_write,
+	    TP_PROTO(const struct vmbus_channel *channel, u32 packets,
+		     u32 bytes, u32 used, int ret),
+	    TP_ARGS(channel, packets, bytes, used, ret),
+	    TP_STRUCT__entry(
+		    __field(u32, relid)
+		    __field(u32, packets)
+		    __field(u32, bytes)
+		    __field(u32, used)
+		    __field(u32, size)
+		    __field(int, ret)
+		    ),
+	    TP_fast_assign(
+		    __entry->relid = channel->offermsg.child_relid;
+		    __entry->packets = packets;
+		    __entry->bytes = bytes;
+		    __entry->used = used;
+		    __entry->size = channel->outbound.ring_datasize;
+		    __entry->ret = ret;
+		    ),
+	    TP_printk("relid 0x%x packets %u bytes %u used %u size %u ret %d",
+		      __entry->relid, __entry->packets, __entry->bytes,
+		      __entry->used, __entry->size, __entry->ret
+		    )
+	);
+
+TRACE_EVENT(vmbus_pkt_iter_begin,
+	    TP_PROTO(const struct vmbus_channel *channel),
+	    TP_ARGS(channel),
+	    TP_STRUCT__entry(
+		    __field(u32, relid)
+		    __field(u32, used)
+		    __field(u32, size)
+		    ),
+	    TP_fast_assign(
+		    __entry->relid = channel->offermsg.child_relid;
+		    __entry->used = hv_get_bytes_to_read(&channel->inbound);
+		    __entry->size = channel->inbound.ring_datasize;
+		    ),
+	    TP_printk("relid 0x%x used %u size %u",
+		      __entry->relid, __entry->used, __entry->size
+		    )
+	);
+
+TRACE_EVENT(vmbus_pkt_iter_close,
+	    TP_PROTO(const struct vmbus_channel *channel, u32 orig_read_index,
+		     bool signal),
+	    TP_ARGS(channel, orig_read_index, signal),
+	    TP_STRUCT__entry(
+		    __field(u32, relid)
+		    __field(u32, bytes)
+		    __field(u32, used)
+		    __field(u32, size)
+		    __field(bool, signal)
+		    ),
+	    TP_fast_assign(
+		    const struct hv_ring_buffer_info *rbi = &channel->inbound;
+		    u32 read_index = rbi->ring_buffer->read_index;
+
+		    __entry->relid = channel->offermsg.child_relid;
+		    __entry->bytes = read_index >= orig_read_index ?
+			    read_index - orig_read_index :
+			    rbi->ring_datasize - (orig_read_index - read_index);
+		    __entry->used = hv_get_bytes_to_read(rbi);
+		    __entry->size = rbi->ring_datasize;
+		    __entry->signal = signal;
+		    ),
+	    TP_printk("relid 0x%x bytes %u used %u size %u signal %d",
+		      __entry->relid, __entry->bytes, __entry->used,
+		      __entry->size, __entry->signal
+		    )
+	);
+
 #undef TRACE_INCLUDE_PATH
 #define TRACE_INCLUDE_PATH .
 #undef TRACE_INCLUDE_FILE
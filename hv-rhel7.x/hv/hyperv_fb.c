@@ -223,7 +223,6 @@ struct hvfb_par {
 
 	u32 pseudo_palette[16];
 	u8 init_buf[MAX_VMBUS_PKT_SIZE];
-	u8 recv_buf[MAX_VMBUS_PKT_SIZE];
 
 	/* If true, the VSC notifies the VSP on every framebuffer change */
 	bool synchronous_fb;
@@ -349,22 +348,22 @@ static int synthvid_update(struct fb_info *info)
  * Complete the wait event.
  * Or, reply with screen and cursor info.
  */
-static void synthvid_recv_sub(struct hv_device *hdev)
+static void synthvid_recv_sub(struct hv_device *hdev,
+			      const struct synthvid_msg *msg, u32 len)
 {
 	struct fb_info *info = hv_get_drvdata(hdev);
 	struct hvfb_par *par;
-	struct synthvid_msg *msg;
 
 	if (!info)
 		return;
 
 	par = info->par;
-	msg = (struct synthvid_msg *)par->recv_buf;
 
 	/* Complete the wait event */
 	if (msg->vid_hdr.type == SYNTHVID_VERSION_RESPONSE ||
 	    msg->vid_hdr.type == SYNTHVID_VRAM_LOCATION_ACK) {
-		memcpy(par->init_buf, msg, MAX_VMBUS_PKT_SIZE);
+		memcpy(par->init_buf, msg,
+		       min_t(u32, len, MAX_VMBUS_PKT_SIZE));
 		complete(&par->wait);
 		return;
 	}
@@ -387,26 +386,22 @@ static void synthvid_receive(void *ctx)
 {
 	struct hv_device *hdev = ctx;
 	struct fb_info *info = hv_get_drvdata(hdev);
-	struct hvfb_par *par;
-	struct synthvid_msg *recv_buf;
-	u32 bytes_recvd;
-	u64 req_id;
-	int ret;
+	const struct vmpacket_descriptor *desc;
+	const struct synthvid_msg *msg;
+	u32 len;
 
 	if (!info)
 		return;
 
-	par = info->par;
-	recv_buf = (struct synthvid_msg *)par->recv_buf;
-
-	do {
-		ret = vmbus_recvpacket(hdev->channel, recv_buf,
-				       MAX_VMBUS_PKT_SIZE,
-				       &bytes_recvd, &req_id);
-		if (bytes_recvd > 0 &&
-		    recv_buf->pipe_hdr.type == PIPE_MSG_DATA)
-			synthvid_recv_sub(hdev);
-	} while (bytes_recvd > 0 && ret == 0);
+	/* Messages are read in place; only handshake replies are copied */
+	foreach_vmbus_pkt(desc, hdev->channel) {
+		msg = hv_pkt_data(desc);
+		len = hv_pkt_datalen(desc);
+		if (len >= sizeof(struct pipe_msg_hdr) +
+			   sizeof(struct synthvid_msg_hdr) &&
+		    msg->pipe_hdr.type == PIPE_MSG_DATA)
+			synthvid_recv_sub(hdev, msg, len);
+	}
 }
 
 /* Check synthetic video protocol version with the host */
@@ -29,6 +29,11 @@
 #include "include/linux/rndis.h"
 
 #include "netvsc_compat.h"
+#include "netvsc_hash.h"
+
+#if (RHEL_RELEASE_CODE >= RHEL_RELEASE_VERSION(7,6))
+#include <net/xdp.h>
+#endif
 
 /* RSS related */
 #define OID_GEN_RECEIVE_SCALE_CAPABILITIES 0x00010203  /* query only */
@@ -193,6 +198,7 @@ struct netvsc_device;
 struct net_device_context;
 
 extern u32 netvsc_ring_bytes;
+void netvsc_set_tx_hash_key(struct net_device *ndev, const u8 *key);
 
 #if (RHEL_RELEASE_CODE == RHEL_RELEASE_VERSION(7,0))
 extern u32 netvsc_ring_reciprocal;
@@ -201,21 +207,31 @@ extern u32 netvsc_ring_reciprocal;
 struct netvsc_device *netvsc_device_add(struct hv_device *device,
 					const struct netvsc_device_info *info);
 int netvsc_alloc_recv_comp_ring(struct netvsc_device *net_device, u32 q_idx);
+void netvsc_alloc_tx_batch(struct netvsc_device *net_device, u32 q_idx);
 void netvsc_device_remove(struct hv_device *device);
 int netvsc_send(struct net_device *net,
 		struct hv_netvsc_packet *packet,
 		struct rndis_message *rndis_msg,
 		struct hv_page_buffer *page_buffer,
 		struct sk_buff *skb);
+void netvsc_send_flush(struct net_device *net, u16 q_idx);
 void netvsc_linkstatus_callback(struct net_device *net,
 				struct rndis_message *resp);
+struct netvsc_channel;
+struct netvsc_rsc;
 int netvsc_recv_callback(struct net_device *net,
 			 struct netvsc_device *nvdev,
 			 struct vmbus_channel *channel,
 			 void  *data, u32 len,
 			 const struct ndis_tcp_ip_checksum_info *csum_info,
 			 const struct ndis_pkt_8021q_info *vlan);
+void netvsc_lro_flush(struct netvsc_channel *nvchan);
+int netvsc_recv_rsc(struct net_device *net,
+		    struct netvsc_device *nvdev,
+		    struct vmbus_channel *channel,
+		    const struct netvsc_rsc *rsc);
 void netvsc_channel_cb(void *context);
+void netvsc_change_target_cpu(struct vmbus_channel *channel, u32 old, u32 new);
 int netvsc_poll(struct napi_struct *napi, int budget);
 
 int rndis_set_subchannel(struct net_device *ndev, struct netvsc_device *nvdev);
@@ -228,6 +244,10 @@ void rndis_filter_device_remove(struct hv_device *dev,
 				struct netvsc_device *nvdev);
 int rndis_filter_set_rss_param(struct rndis_device *rdev,
 			       const u8 *key);
+struct ndis_offload_params;
+int rndis_filter_set_offload_params(struct net_device *ndev,
+				    struct netvsc_device *nvdev,
+				    struct ndis_offload_params *req_offloads);
 int rndis_filter_receive(struct net_device *ndev,
 			 struct netvsc_device *net_dev,
 			 struct vmbus_channel *channel,
@@ -238,6 +258,15 @@ int rndis_filter_set_device_mac(struct netvsc_device *ndev,
 
 void netvsc_switch_datapath(struct net_device *nv_dev, bool vf);
 
+#if (RHEL_RELEASE_CODE >= RHEL_RELEASE_VERSION(7,6))
+bool netvsc_run_xdp(struct net_device *ndev, struct netvsc_channel *nvchan,
+		    void **data, u32 *len);
+int netvsc_vf_setxdp(struct net_device *vf_netdev, struct bpf_prog *prog);
+int netvsc_xdp_set(struct net_device *ndev, struct bpf_prog *prog,
+		   struct netlink_ext_ack *extack);
+int netvsc_bpf(struct net_device *ndev, struct netdev_bpf *bpf);
+#endif
+
 #define NVSP_INVALID_PROTOCOL_VERSION	((u32)0xFFFFFFFF)
 
 #define NVSP_PROTOCOL_VERSION_1		2
@@ -532,6 +561,8 @@ struct nvsp_2_vsc_capability {
 			u64 ieee8021q:1;
 			u64 correlation_id:1;
 			u64 teaming:1;
+			u64 vsubnetid:1;
+			u64 rsc:1;
 		};
 	};
 } __packed;
@@ -835,7 +866,7 @@ struct nvsp_message {
 
 #define NETVSC_SUPPORTED_HW_FEATURES (NETIF_F_RXCSUM | NETIF_F_IP_CSUM | \
 				      NETIF_F_TSO | NETIF_F_IPV6_CSUM | \
-				      NETIF_F_TSO6)
+				      NETIF_F_TSO6 | NETIF_F_LRO)
 
 #define VRSS_SEND_TAB_SIZE 16  /* must be power of 2 */
 #define VRSS_CHANNEL_MAX 64
@@ -850,15 +881,123 @@ struct multi_send_data {
 	u32 count; /* counter of batched packets */
 };
 
+/* Data packets deferred while the stack signals xmit_more */
+#define NETVSC_TX_BATCH_MAX 8
+
+/* Bounds on the receive interrupt moderation interval */
+#define NETVSC_RX_USECS_MAX		1000
+#define NETVSC_RX_USECS_ADAPT_MIN	8
+#define NETVSC_RX_USECS_ADAPT_MAX	128
+
+/* Longest a packet waits for a successor guessed from the qdisc backlog */
+#define NETVSC_TX_FLUSH_NS	(20 * NSEC_PER_USEC)
+
+struct netvsc_tx_batch_slot {
+	struct nvsp_message nvmsg;
+	struct hv_page_buffer pb[MAX_PAGE_BUFFER_COUNT];
+	struct sk_buff *skb;
+};
+
+struct netvsc_tx_batch {
+	u32 count;	/* number of deferred packets */
+	struct netvsc_tx_batch_slot slot[NETVSC_TX_BATCH_MAX];
+	struct vmbus_batch_packet pkts[NETVSC_TX_BATCH_MAX];
+};
+
 struct recv_comp_data {
 	u64 tid; /* transaction id */
 	u32 status;
 };
 
+/* Run of recv_buf pages attached to skbs as fragments */
+struct recv_comp_span {
+	u32 first;
+	u32 last;
+};
+
+/* Page runs one deferred completion can track; frames past that are copied */
+#define NETVSC_RX_ZC_SPANS	16
+
+/*
+ * Receive completion held back until the stack has dropped its references
+ * to the recv_buf pages the frames were attached to as fragments. Only
+ * pages a frame fills completely are attached, so each of them belongs to
+ * this completion alone.
+ */
+struct recv_comp_deferred {
+	u64 tid; /* transaction id */
+	u64 queued_ns;	/* when it was held back */
+	u32 status;
+	u32 sections;	/* receive sections it keeps from the host */
+	u32 nspans;
+	struct recv_comp_span span[NETVSC_RX_ZC_SPANS];
+};
+
+/* Transfer page packets per queue whose completion may be deferred */
+#define NETVSC_RX_DEFER_MAX	64
+
+/* Part of its share of the receive sections a queue may keep deferred */
+#define NETVSC_RX_ZC_SHARE	8
+
+/*
+ * How long a queue keeps receiving in place while completions are held
+ * back; past that it copies until the stack lets go of them.
+ */
+#define NETVSC_RX_ZC_HOLD_NS	(10 * NSEC_PER_MSEC)
+
+/* First delay before a quiet queue checks whether the stack let go */
+#define NETVSC_RX_DEFER_NS	(100 * NSEC_PER_USEC)
+
+/* Bytes copied into the skb head when a frame is received in place */
+#define NETVSC_RX_PULL		128
+
+/* Receive completions put on the ring with one write */
+#define NETVSC_RX_COMP_BATCH	32
+
+/* Bounds on completions held back for coalescing across busy polls */
+#define NETVSC_RX_COMP_MAX	256
+#define NETVSC_RX_COMP_NS	(50 * NSEC_PER_USEC)
+
+struct recv_comp_msg {
+	struct nvsp_message_header hdr;
+	u32 status;
+} __packed;
+
+struct recv_comp_batch {
+	struct recv_comp_msg msg[NETVSC_RX_COMP_BATCH];
+	struct vmbus_batch_packet pkts[NETVSC_RX_COMP_BATCH];
+};
+
+/* Most receive sections a coalesced frame can be spread over */
+#define NVSP_RSC_MAX		562
+
+/* Pieces of a coalesced frame collected from one transfer page packet */
+struct netvsc_rsc {
+	const struct ndis_pkt_8021q_info *vlan;
+	const struct ndis_tcp_ip_checksum_info *csum_info;
+	u32 cnt;	/* pieces collected so far */
+	u32 pktlen;	/* their total length */
+	void *data[NVSP_RSC_MAX];
+	u32 len[NVSP_RSC_MAX];
+};
+
 struct multi_recv_comp {
 	struct recv_comp_data *slots;
 	u32 first;	/* first data entry */
 	u32 next;	/* next entry for writing */
+
+	struct recv_comp_deferred *deferred;
+	u32 deferred_cnt;
+	u32 deferred_sections;	/* receive sections they keep */
+	u64 deferred_ns;	/* when the oldest one was held back */
+	u32 defer_poll_ns;	/* next delay for checking a quiet queue */
+
+	struct recv_comp_batch *batch;
+	u32 budget;	/* completions that may be held back */
+	u64 first_ns;	/* when the oldest held completion was queued */
+
+	/* Deferred completion of the packet being received, if allowed */
+	struct recv_comp_deferred *zc;
 };
 
 struct netvsc_stats {
@@ -877,7 +1016,9 @@ struct netvsc_ethtool_stats {
 	unsigned long tx_busy;
 	unsigned long tx_send_full;
 	unsigned long rx_comp_busy;
+	unsigned long rx_comp_writes;
 	unsigned long rx_no_memory;
+	unsigned long rx_zc_full;
 	unsigned long stop_queue;
 	unsigned long wake_queue;
 };
@@ -931,12 +1072,20 @@ struct net_device_context {
 	u32 tx_checksum_mask;
 
 	u32 tx_table[VRSS_SEND_TAB_SIZE];
+	/* Toeplitz table for the RSS key, NULL while it is the default */
+	struct netvsc_toeplitz __rcu *tx_hash;
+#if (RHEL_RELEASE_CODE >= RHEL_RELEASE_VERSION(7,6))
+	struct bpf_prog __rcu *xdp_prog;
+#endif
 
 	/* Ethtool settings */
 	bool udp4_l4_hash;
 	bool udp6_l4_hash;
 	u8 duplex;
 	u32 speed;
+	u32 rx_coalesce_usecs;
+	u32 rx_coalesce_frames;
+	bool rx_coalesce_adaptive;
 	struct netvsc_ethtool_stats eth_stats;
 
 	/* State to manage the associated VF interface. */
@@ -951,6 +1100,34 @@ struct net_device_context {
 };
 
 /* Per channel data */
+/*
+ * Free send buffer sections owned by one queue. The free sections form a
+ * stack linked through netvsc_device.send_section_next[], so taking and
+ * returning a section is O(1) and only touches the queue's own pool. A
+ * queue whose pool runs dry takes over another queue's free sections.
+ * The locks are taken with interrupts off since netpoll transmits with
+ * interrupts disabled.
+ */
+struct netvsc_send_pool {
+	spinlock_t lock;
+	u32 head;
+	u32 tail;	/* last section, valid while count > 0 */
+	u32 count;
+} ____cacheline_aligned_in_smp;
+
+/*
+ * Consecutive segments of one TCP flow found in a transfer page packet,
+ * merged into skb before they are handed to GRO.
+ */
+struct netvsc_rx_lro {
+	struct sk_buff *skb;	/* first segment, or NULL */
+	struct sk_buff *last;	/* tail of skb's frag_list */
+	u32 next_seq;		/* sequence number expected next */
+	u16 nhlen;		/* network header length */
+	u16 mss;		/* payload of the first segment */
+	u16 segs;
+};
+
 struct netvsc_channel {
 	struct vmbus_channel *channel;
 	struct netvsc_device *net_device;
@@ -958,7 +1135,22 @@ struct netvsc_channel {
 	struct napi_struct napi;
 	struct multi_send_data msd;
 	struct multi_recv_comp mrc;
+	struct netvsc_tx_batch *txb;
+	struct netvsc_send_pool send_pool;
+	struct netvsc_rx_lro lro;
+	struct netvsc_rsc *rsc;
+
+	/* Re-polls the channel while host interrupts stay masked */
+	struct hrtimer coal_timer;
+	u32 coal_usecs;		/* current adaptive interval */
+	bool coal_moved;	/* channel retargeted since the last poll */
 	atomic_t queue_sends;
+#if (RHEL_RELEASE_CODE >= RHEL_RELEASE_VERSION(7,6))
+	struct xdp_rxq_info xdp_rxq;
+#endif
+#if (RHEL_RELEASE_CODE <= RHEL_RELEASE_VERSION(7,1))
+	struct tasklet_hrtimer flush_timer;
+#endif
 
 	struct netvsc_stats tx_stats;
 	struct netvsc_stats rx_stats;
@@ -970,9 +1162,11 @@ struct netvsc_device {
 
 	wait_queue_head_t wait_drain;
 	bool destroy;
+	bool rsc_offload;	/* host can coalesce receive segments */
 
 	/* Receive buffer allocated by us but manages by NetVSP */
 	void *recv_buf;
+	struct page **recv_buf_pages; /* set if interleaved over nodes */
 	u32 recv_buf_size; /* allocated bytes */
 	u32 recv_buf_gpadl_handle;
 	u32 recv_section_cnt;
@@ -981,10 +1175,12 @@ struct netvsc_device {
 
 	/* Send buffer allocated by us */
 	void *send_buf;
+	struct page **send_buf_pages;
+	u32 send_buf_size;
 	u32 send_buf_gpadl_handle;
 	u32 send_section_cnt;
 	u32 send_section_size;
-	unsigned long *send_section_map;
+	u32 *send_section_next;
 
 	/* Used for NetVSP initialization protocol */
 	struct completion channel_init_wait;
@@ -1007,6 +1203,7 @@ struct netvsc_device {
 	struct netvsc_channel chan_table[VRSS_CHANNEL_MAX];
 
 	struct rcu_head rcu;
+	struct work_struct free_work;
 };
 
 /* NdisInitialize message */
@@ -1140,7 +1337,8 @@ struct rndis_oobd {
 /* Packet extension field contents associated with a Data message. */
 struct rndis_per_packet_info {
 	u32 size;
-	u32 type;
+	u32 type:31;
+	u32 internal:1;
 	u32 ppi_offset;
 };
 
@@ -1161,6 +1359,23 @@ enum ndis_per_pkt_info_type {
 	MAX_PER_PKT_INFO
 };
 
+/* Per packet info types with the internal bit set */
+enum rndis_per_pkt_info_internal_type {
+	RNDIS_PKTINFO_ID = 1,
+	RNDIS_PKTINFO_MAX
+};
+
+#define RNDIS_PKTINFO_SUBALLOC	BIT(0)
+#define RNDIS_PKTINFO_1ST_FRAG	BIT(1)
+#define RNDIS_PKTINFO_LAST_FRAG	BIT(2)
+
+/* Marks the pieces of a frame the host split over several sections */
+struct rndis_pktinfo_id {
+	u8 ver;
+	u8 flag;
+	u16 pkt_id;
+};
+
 struct ndis_pkt_8021q_info {
 	union {
 		struct {
@@ -212,12 +212,6 @@ struct hv_per_cpu_context {
 	 * basis.
 	 */
 	struct tasklet_struct msg_dpc;
-
-	/*
-	 * To optimize the mapping of relid to channel, maintain
-	 * per-cpu list of the channels based on their CPU affinity.
-	 */
-	struct list_head chan_list;
 };
 
 struct hv_context {
@@ -244,6 +238,7 @@ struct hv_context {
 extern struct hv_context hv_context;
 
 extern int affinity_mode;
+extern unsigned int rebalance_interval_ms;
 
 /* Hv Interface */
 
@@ -286,6 +281,10 @@ void hv_ringbuffer_cleanup(struct hv_ring_buffer_info *ring_info);
 int hv_ringbuffer_write(struct vmbus_channel *channel,
 			const struct kvec *kv_list, u32 kv_count);
 
+int hv_ringbuffer_write_batch(struct vmbus_channel *channel,
+			      struct vmbus_batch_packet *pkts, u32 count,
+			      u32 *written);
+
 void hv_get_ringbuffer_available_space(struct hv_ring_buffer_info *inring_info,
 				       u32 *bytes_avail_toread,
 				       u32 *bytes_avail_towrite);
@@ -305,6 +304,10 @@ int hv_ringbuffer_read(struct vmbus_channel *channel,
 /* TODO: Need to make this configurable */
 #define MAX_NUM_CHANNELS_SUPPORTED	256
 
+/* Highest relid + 1 that can be signaled, for any protocol version */
+#define MAX_CHANNEL_RELIDS					\
+	max_t(size_t, MAX_NUM_CHANNELS_SUPPORTED, HV_EVENT_FLAGS_COUNT)
+
 
 enum vmbus_connect_state {
 	DISCONNECTED,
@@ -353,6 +356,13 @@ struct vmbus_connection {
 	struct list_head chn_list;
 	struct mutex channel_mutex;
 
+	/*
+	 * Channels indexed by relid, primary and sub-channels alike.
+	 * Updated under channel_mutex, read under RCU from the interrupt
+	 * path; channels are freed with kfree_rcu().
+	 */
+	struct vmbus_channel __rcu **channels;
+
 	/*
 	 * An offer message is handled first on the work_queue, and then
 	 * is further handled on handle_primary_chan_wq or
@@ -410,6 +420,13 @@ int vmbus_add_channel_kobj(struct hv_device *device_obj,
 			   struct vmbus_channel *channel);
 
 struct vmbus_channel *relid2channel(u32 relid);
+void vmbus_channel_map_relid(struct vmbus_channel *channel);
+void vmbus_channel_unmap_relid(struct vmbus_channel *channel);
+
+int vmbus_channel_retarget(struct vmbus_channel *channel, u32 target_cpu);
+void vmbus_rebalance_update(void);
+void vmbus_rebalance_start(void);
+void vmbus_rebalance_stop(void);
 
 void vmbus_free_channels(void);
 
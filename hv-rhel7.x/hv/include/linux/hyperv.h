@@ -36,6 +36,7 @@
 #include <linux/device.h>
 #include <linux/mod_devicetable.h>
 #include <linux/interrupt.h>
+#include <linux/uio.h>
 #if (RHEL_RELEASE_CODE > RHEL_RELEASE_VERSION(7, 0))
 #include <linux/reciprocal_div.h>
 #endif
@@ -148,6 +149,11 @@ struct hv_ring_buffer_info {
 
 	u32 ring_datasize;		/* < ring_size */
 	u32 priv_read_index;
+	/*
+	 * Outbound ring only: end of the space reserved by writers. It runs
+	 * ahead of write_index while packets are being copied in.
+	 */
+	u32 priv_write_index;
 };
 
 
@@ -436,6 +442,7 @@ enum vmbus_channel_message_type {
 	CHANNELMSG_19				= 19,
 	CHANNELMSG_20				= 20,
 	CHANNELMSG_TL_CONNECT_REQUEST		= 21,
+	CHANNELMSG_MODIFYCHANNEL		= 22,
 	CHANNELMSG_COUNT
 };
 
@@ -627,6 +634,13 @@ struct vmbus_channel_tl_connect_request {
 	uuid_le host_service_id;
 } __packed;
 
+/* Modify Channel parameters, cf. vmbus_send_modifychannel() */
+struct vmbus_channel_modifychannel {
+	struct vmbus_channel_message_header header;
+	u32 child_relid;
+	u32 target_vp;
+} __packed;
+
 struct vmbus_channel_version_response {
 	struct vmbus_channel_message_header header;
 	u8 version_supported;
@@ -737,6 +751,33 @@ struct vmbus_device {
 	bool perf_device;
 };
 
+/* Defaults for the HV_CALL_ADAPTIVE tunables */
+#define VMBUS_POLL_ENTER_RATE	32
+#define VMBUS_POLL_IDLE_US	100
+
+/* Ring occupancy histogram: bucket i counts samples in [i/8, (i+1)/8) full */
+#define VMBUS_OCCUPANCY_BUCKETS	8
+
+/*
+ * Per-CPU hot path counters of a channel, summed up in the channel's
+ * sysfs directory.
+ */
+struct vmbus_channel_stats {
+	u64 interrupts;		/* host signals for this channel */
+	u64 callbacks;		/* tasklet or ISR runs */
+	u64 polls;		/* adaptive mode or NAPI poll rounds */
+	u64 in_packets;
+	u64 in_bytes;
+	u64 out_packets;
+	u64 out_bytes;
+	u64 signals;		/* guest->host signals on write */
+	u64 signals_suppressed;	/* writes that did not need one */
+	u64 ring_full;		/* writes failed with -EAGAIN */
+	u64 pending_send_wakeups; /* host woken up via pending_send_sz */
+	u64 in_occupancy[VMBUS_OCCUPANCY_BUCKETS];	/* on interrupt */
+	u64 out_occupancy[VMBUS_OCCUPANCY_BUCKETS];	/* after write */
+};
+
 struct vmbus_channel {
 
 	struct list_head listentry;
@@ -771,8 +812,11 @@ struct vmbus_channel {
 	void (*onchannel_callback)(void *context);
 	void *channel_callback_context;
 
+	/* Held around ISR callbacks, see vmbus_reset_channel_cb() */
+	spinlock_t sched_lock;
+
 	/*
-	 * A channel can be marked for one of three modes of reading:
+	 * A channel can be marked for one of four modes of reading:
 	 *   BATCHED - callback called from taslket and should read
 	 *            channel until empty. Interrupts from the host
 	 *            are masked while read is in process (default).
@@ -781,13 +825,30 @@ struct vmbus_channel {
 	 *         invoke its own deferred processing.
 	 *         Host interrupts are disabled and must be re-enabled
 	 *         when ring is empty.
+	 *   ADAPTIVE - like BATCHED, but once the host signals faster
+	 *         than poll_enter_rate the interrupts stay masked and
+	 *         the tasklet polls the ring until it has been empty
+	 *         for poll_idle_us.
 	 */
 	enum hv_callback_mode {
 		HV_CALL_BATCHED,
 		HV_CALL_DIRECT,
-		HV_CALL_ISR
+		HV_CALL_ISR,
+		HV_CALL_ADAPTIVE
 	} callback_mode;
 
+	/* HV_CALL_ADAPTIVE state, only touched by the channel tasklet */
+	bool polling;
+	u32 poll_window_events;
+	u64 poll_window_start;
+	u64 poll_last_busy;
+
+	/* HV_CALL_ADAPTIVE tunables, see the channel's sysfs directory */
+	u32 poll_enter_rate;	/* host signals per ms, 0 never polls */
+	u32 poll_idle_us;
+
+	struct vmbus_channel_stats __percpu *stats;
+
 	bool is_dedicated_interrupt;
 	u64 sig_event;
 
@@ -855,11 +916,6 @@ struct vmbus_channel {
 	 * Support per-channel state for use by vmbus drivers.
 	 */
 	void *per_channel_state;
-	/*
-	 * To support per-cpu lookup mapping of relid to channel,
-	 * link up channels based on their CPU affinity.
-	 */
-	struct list_head percpu_list;
 
 	/*
 	 * Defer freeing channel until after all cpu's have
@@ -919,6 +975,26 @@ struct vmbus_channel {
 	 * vmbus_connection.work_queue and hang: see vmbus_process_offer().
 	 */
 	struct work_struct add_channel_work;
+
+	/*
+	 * Called with channel_mutex held after the channel's interrupts
+	 * have been moved from CPU old to CPU new, see
+	 * vmbus_channel_retarget().
+	 */
+	void (*change_target_cpu_callback)(struct vmbus_channel *channel,
+					   u32 old, u32 new);
+
+	/* Interrupt load seen by the channel rebalancer */
+	u64 rebalance_interrupts;
+	u64 rebalance_load;
+
+	/*
+	 * Ring buffer sizes set through sysfs, used by vmbus_open() instead
+	 * of the driver's; 0 keeps the driver's. Only set on primary
+	 * channels, the sub-channels follow their primary.
+	 */
+	u32 ring_size_out;
+	u32 ring_size_in;
 };
 
 static inline bool is_hvsock_channel(const struct vmbus_channel *c)
@@ -939,6 +1015,22 @@ static inline void set_channel_read_mode(struct vmbus_channel *c,
 	c->callback_mode = mode;
 }
 
+#define vmbus_chan_stat_inc(c, field)	this_cpu_inc((c)->stats->field)
+#define vmbus_chan_stat_add(c, field, v) this_cpu_add((c)->stats->field, (v))
+
+/* Histogram bucket for a ring holding used bytes */
+static inline u32 hv_ring_occupancy_bucket(const struct hv_ring_buffer_info *rbi,
+					   u32 used)
+{
+	u32 bucket;
+
+	if (unlikely(!rbi->ring_datasize))
+		return 0;
+
+	bucket = (u64)used * VMBUS_OCCUPANCY_BUCKETS / rbi->ring_datasize;
+	return min_t(u32, bucket, VMBUS_OCCUPANCY_BUCKETS - 1);
+}
+
 static inline void set_per_channel_state(struct vmbus_channel *c, void *s)
 {
 	c->per_channel_state = s;
@@ -1060,6 +1152,46 @@ extern int vmbus_sendpacket_mpb_desc(struct vmbus_channel *channel,
 				     u32 bufferlen,
 				     u64 requestid);
 
+/*
+ * One packet of a batch sent with vmbus_sendpacket_batch(). A packet with a
+ * pagecount of 0 is sent like vmbus_sendpacket() does, otherwise like
+ * vmbus_sendpacket_pagebuffer(). The fields after pagecount are scratch
+ * space for building the VMBus descriptor, so that sending a batch needs
+ * no memory beyond the caller's array.
+ */
+#define VMBUS_BATCH_KVEC_MAX	4
+
+struct vmbus_batch_packet {
+	void *buffer;
+	u32 bufferlen;
+	u64 requestid;
+	enum vmbus_packet_type type;	/* in-band packets only */
+	u32 flags;			/* in-band packets only */
+	struct hv_page_buffer *pagebuffers;
+	u32 pagecount;
+
+	/* Private to the VMBus driver */
+	union {
+		struct vmpacket_descriptor inband;
+		struct {
+			u16 type;
+			u16 dataoffset8;
+			u16 length8;
+			u16 flags;
+			u64 transactionid;
+			u32 reserved;
+			u32 rangecount;
+		} __packed gpa_direct;
+	} desc;
+	struct kvec kv[VMBUS_BATCH_KVEC_MAX];
+	u32 kv_count;
+	u32 ring_len;
+};
+
+extern int vmbus_sendpacket_batch(struct vmbus_channel *channel,
+				  struct vmbus_batch_packet *pkts,
+				  u32 count, u32 *sent);
+
 extern int vmbus_establish_gpadl(struct vmbus_channel *channel,
 				      void *kbuffer,
 				      u32 size,
@@ -1118,6 +1250,13 @@ struct hv_driver {
 	int (*remove)(struct hv_device *);
 	void (*shutdown)(struct hv_device *);
 
+	/*
+	 * Optional: close and reopen the device's channels, keeping the
+	 * upper layer device. Used to apply new ring buffer sizes; without
+	 * it the device is unbound and probed again.
+	 */
+	int (*reopen)(struct hv_device *);
+
 };
 
 /* Base device object */
@@ -1633,6 +1772,7 @@ extern __u32 vmbus_proto_version;
 
 int vmbus_send_tl_connect_request(const uuid_le *shv_guest_servie_id,
 				  const uuid_le *shv_host_servie_id);
+int vmbus_send_modifychannel(u32 child_relid, u32 target_vp);
 
 void vmbus_set_event(struct vmbus_channel *channel);
 
@@ -1698,6 +1838,12 @@ __hv_pkt_iter_next(struct vmbus_channel *channel,
 
 void hv_pkt_iter_close(struct vmbus_channel *channel);
 
+struct vmpacket_descriptor *
+vmbus_borrow_packet(struct vmbus_channel *channel);
+
+void vmbus_release_packet(struct vmbus_channel *channel,
+			  const struct vmpacket_descriptor *desc);
+
 /*
  * Get next packet descriptor from iterator
  * If at end of list, return NULL and update host.
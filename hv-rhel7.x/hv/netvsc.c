@@ -26,6 +26,7 @@
 #include <linux/delay.h>
 #include <linux/io.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/netdevice.h>
 #include <linux/if_ether.h>
 #include <asm/sync_bitops.h>
@@ -104,9 +105,97 @@ static void netvsc_subchan_work(struct work_struct *w)
 	rtnl_unlock();
 }
 
+/* Push a free section on a send pool, called with the pool lock held */
+static void netvsc_send_pool_push(struct netvsc_device *net_device,
+				  struct netvsc_send_pool *pool, u32 index)
+{
+	if (!pool->count)
+		pool->tail = index;
+	net_device->send_section_next[index] = pool->head;
+	pool->head = index;
+	pool->count++;
+}
+
+/* Pop a free section off a send pool, called with the pool lock held */
+static u32 netvsc_send_pool_pop(struct netvsc_device *net_device,
+				struct netvsc_send_pool *pool)
+{
+	u32 index = pool->head;
+
+	if (index != NETVSC_INVALID_INDEX) {
+		pool->head = net_device->send_section_next[index];
+		pool->count--;
+	}
+
+	return index;
+}
+
+/*
+ * The host takes a single receive and a single send buffer per device and
+ * hands their sections to whichever channel it likes, so the buffers cannot
+ * be split by node. On NUMA guests spread them page by page over the online
+ * nodes, like MPOL_INTERLEAVE, so channels on every node get the same mix of
+ * local and remote pages instead of everything living on the node that ran
+ * probe. *pagesp is left NULL when the buffer comes from plain vzalloc().
+ */
+static void *netvsc_alloc_buf(u32 size, struct page ***pagesp)
+{
+	unsigned int i, npages = size >> PAGE_SHIFT;
+	int nid = first_online_node;
+	struct page **pages;
+	void *buf;
+
+	*pagesp = NULL;
+	if (num_online_nodes() <= 1)
+		return vzalloc(size);
+
+	pages = vzalloc(npages * sizeof(struct page *));
+	if (!pages)
+		return vzalloc(size);
+
+	for (i = 0; i < npages; i++) {
+		pages[i] = alloc_pages_node(nid, GFP_KERNEL | __GFP_ZERO, 0);
+		if (!pages[i])
+			goto fallback;
+
+		nid = next_online_node(nid);
+		if (nid == MAX_NUMNODES)
+			nid = first_online_node;
+	}
+
+	buf = vmap(pages, npages, VM_MAP, PAGE_KERNEL);
+	if (!buf)
+		goto fallback;
+
+	*pagesp = pages;
+	return buf;
+
+fallback:
+	while (i--)
+		__free_page(pages[i]);
+	vfree(pages);
+	return vzalloc(size);
+}
+
+static void netvsc_free_buf(void *buf, struct page **pages, u32 size)
+{
+	unsigned int i;
+
+	if (!pages) {
+		vfree(buf);
+		return;
+	}
+
+	vunmap(buf);
+	for (i = 0; i < size >> PAGE_SHIFT; i++)
+		__free_page(pages[i]);
+	vfree(pages);
+}
+
 static struct netvsc_device *alloc_net_device(void)
 {
 	struct netvsc_device *net_device;
+	int i;
 
 	net_device = kzalloc(sizeof(struct netvsc_device), GFP_KERNEL);
 	if (!net_device)
@@ -122,26 +211,64 @@ static struct netvsc_device *alloc_net_device(void)
 	init_waitqueue_head(&net_device->subchan_open);
 	INIT_WORK(&net_device->subchan_work, netvsc_subchan_work);
 
+	for (i = 0; i < VRSS_CHANNEL_MAX; i++) {
+		struct netvsc_send_pool *pool = &net_device->chan_table[i].send_pool;
+
+		spin_lock_init(&pool->lock);
+		pool->head = NETVSC_INVALID_INDEX;
+	}
+
 	return net_device;
 }
 
-static void free_netvsc_device(struct rcu_head *head)
+static void __free_netvsc_device(struct netvsc_device *nvdev)
 {
-	struct netvsc_device *nvdev
-		= container_of(head, struct netvsc_device, rcu);
 	int i;
 
 	kfree(nvdev->extension);
-	vfree(nvdev->recv_buf);
-	vfree(nvdev->send_buf);
-	kfree(nvdev->send_section_map);
+	netvsc_free_buf(nvdev->recv_buf, nvdev->recv_buf_pages,
+			nvdev->recv_buf_size);
+	netvsc_free_buf(nvdev->send_buf, nvdev->send_buf_pages,
+			nvdev->send_buf_size);
+	kfree(nvdev->send_section_next);
+
+	for (i = 0; i < VRSS_CHANNEL_MAX; i++) {
+		struct netvsc_tx_batch *txb = nvdev->chan_table[i].txb;
+		u32 j;
 
-	for (i = 0; i < VRSS_CHANNEL_MAX; i++)
 		vfree(nvdev->chan_table[i].mrc.slots);
+		vfree(nvdev->chan_table[i].rsc);
+#if (RHEL_RELEASE_CODE >= RHEL_RELEASE_VERSION(7,6))
+		xdp_rxq_info_unreg(&nvdev->chan_table[i].xdp_rxq);
+#endif
+		if (!txb)
+			continue;
+
+		/* Packets still waiting for a flush never reached the host */
+		for (j = 0; j < txb->count; j++)
+			dev_kfree_skb_any(txb->slot[j].skb);
+		vfree(txb);
+	}
 
 	kfree(nvdev);
 }
 
+static void free_netvsc_device_work(struct work_struct *w)
+{
+	__free_netvsc_device(container_of(w, struct netvsc_device,
+					  free_work));
+}
+
+/* vunmap() may sleep, so the buffers are released from process context */
+static void free_netvsc_device(struct rcu_head *head)
+{
+	struct netvsc_device *nvdev
+		= container_of(head, struct netvsc_device, rcu);
+
+	INIT_WORK(&nvdev->free_work, free_netvsc_device_work);
+	schedule_work(&nvdev->free_work);
+}
+
 static void free_netvsc_device_rcu(struct netvsc_device *nvdev)
 {
 	call_rcu(&nvdev->rcu, free_netvsc_device);
@@ -298,12 +425,43 @@ int netvsc_alloc_recv_comp_ring(struct netvsc_device *net_device, u32 q_idx)
 	int node = cpu_to_node(nvchan->channel->target_cpu);
 	size_t size;
 
+	/* The deferred completions and the write batch share the
+	 * allocation of the ring.
+	 */
 	size = net_device->recv_completion_cnt * sizeof(struct recv_comp_data);
-	nvchan->mrc.slots = vzalloc_node(size, node);
+	nvchan->mrc.slots = vzalloc_node(size + NETVSC_RX_DEFER_MAX *
+					 sizeof(struct recv_comp_deferred) +
+					 sizeof(struct recv_comp_batch), node);
 	if (!nvchan->mrc.slots)
-		nvchan->mrc.slots = vzalloc(size);
+		nvchan->mrc.slots = vzalloc(size + NETVSC_RX_DEFER_MAX *
+					    sizeof(struct recv_comp_deferred) +
+					    sizeof(struct recv_comp_batch));
+	if (!nvchan->mrc.slots)
+		return -ENOMEM;
+
+	nvchan->mrc.deferred = (void *)nvchan->mrc.slots + size;
+	nvchan->mrc.batch = (void *)(nvchan->mrc.deferred +
+				     NETVSC_RX_DEFER_MAX);
+	nvchan->mrc.budget = NAPI_POLL_WEIGHT;
+
+	nvchan->rsc = vzalloc_node(sizeof(struct netvsc_rsc), node);
+	if (!nvchan->rsc)
+		nvchan->rsc = vzalloc(sizeof(struct netvsc_rsc));
+	if (!nvchan->rsc)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/* Without a batch the channel simply sends every packet right away */
+void netvsc_alloc_tx_batch(struct netvsc_device *net_device, u32 q_idx)
+{
+	struct netvsc_channel *nvchan = &net_device->chan_table[q_idx];
+	int node = cpu_to_node(nvchan->channel->target_cpu);
 
-	return nvchan->mrc.slots ? 0 : -ENOMEM;
+	nvchan->txb = vzalloc_node(sizeof(struct netvsc_tx_batch), node);
+	if (!nvchan->txb)
+		nvchan->txb = vzalloc(sizeof(struct netvsc_tx_batch));
 }
 
 static int netvsc_init_buf(struct hv_device *device,
@@ -314,7 +472,7 @@ static int netvsc_init_buf(struct hv_device *device,
 	struct net_device *ndev = hv_get_drvdata(device);
 	struct nvsp_message *init_packet;
 	unsigned int buf_size;
-	size_t map_words;
+	u32 i;
 	int ret = 0;
 
 	/* Get receive buffer area. */
@@ -326,7 +484,8 @@ static int netvsc_init_buf(struct hv_device *device,
 		buf_size = min_t(unsigned int, buf_size,
 				 NETVSC_RECEIVE_BUFFER_SIZE_LEGACY);
 
-	net_device->recv_buf = vzalloc(buf_size);
+	net_device->recv_buf = netvsc_alloc_buf(buf_size,
+						&net_device->recv_buf_pages);
 	if (!net_device->recv_buf) {
 		netdev_err(ndev,
 			   "unable to allocate receive buffer of size %u\n",
@@ -408,11 +567,14 @@ static int netvsc_init_buf(struct hv_device *device,
 	if (ret)
 		goto cleanup;
 
+	netvsc_alloc_tx_batch(net_device, 0);
+
 	/* Now setup the send buffer. */
 	buf_size = device_info->send_sections * device_info->send_section_size;
 	buf_size = round_up(buf_size, PAGE_SIZE);
 
-	net_device->send_buf = vzalloc(buf_size);
+	net_device->send_buf = netvsc_alloc_buf(buf_size,
+						&net_device->send_buf_pages);
 	if (!net_device->send_buf) {
 		netdev_err(ndev, "unable to allocate send buffer of size %u\n",
 			   buf_size);
@@ -420,6 +582,8 @@ static int netvsc_init_buf(struct hv_device *device,
 		goto cleanup;
 	}
 
+	net_device->send_buf_size = buf_size;
+
 	/* Establish the gpadl handle for this buffer on this
 	 * channel.  Note: This call uses the vmbus connection rather
 	 * than the channel to establish the gpadl handle.
@@ -479,14 +643,20 @@ static int netvsc_init_buf(struct hv_device *device,
 		   net_device->send_section_size, net_device->send_section_cnt);
 
 	/* Setup state for managing the send buffer. */
-	map_words = DIV_ROUND_UP(net_device->send_section_cnt, BITS_PER_LONG);
-
-	net_device->send_section_map = kcalloc(map_words, sizeof(ulong), GFP_KERNEL);
-	if (net_device->send_section_map == NULL) {
+	net_device->send_section_next = kcalloc(net_device->send_section_cnt,
+						sizeof(u32), GFP_KERNEL);
+	if (net_device->send_section_next == NULL) {
 		ret = -ENOMEM;
 		goto cleanup;
 	}
 
+	/* The number of queues is not known yet, so queue 0 starts out
+	 * owning every section and the other queues steal what they need.
+	 */
+	for (i = net_device->send_section_cnt; i-- > 0; )
+		netvsc_send_pool_push(net_device,
+				      &net_device->chan_table[0].send_pool, i);
+
 	goto exit;
 
 cleanup:
@@ -546,6 +716,9 @@ static int negotiate_nvsp_ver(struct hv_device *device,
 		init_packet->msg.v2_msg.send_ndis_config.capability.teaming = 1;
 	}
 
+	if (nvsp_ver >= NVSP_PROTOCOL_VERSION_61)
+		init_packet->msg.v2_msg.send_ndis_config.capability.rsc = 1;
+
 	trace_nvsp_send(ndev, init_packet);
 
 	ret = vmbus_sendpacket(device->channel, init_packet,
@@ -618,6 +791,13 @@ cleanup:
 	return ret;
 }
 
+static void netvsc_release_deferred(struct net_device *ndev,
+				    struct netvsc_device *nvdev, u16 q_idx,
+				    bool all);
+static int send_recv_completions(struct net_device *ndev,
+				 struct netvsc_device *nvdev,
+				 struct netvsc_channel *nvchan);
+
 /*
  * netvsc_device_remove - Callback when the root bus device is removed
  */
@@ -643,16 +823,46 @@ void netvsc_device_remove(struct hv_device *device)
 
 	RCU_INIT_POINTER(net_device_ctx->nvdev, NULL);
 
+	/* A poll still running could re-arm the coalescing timer, so stop
+	 * polling first. NAPI is only enabled once a channel is opened for
+	 * it; a sub-channel queue still points at the primary until then.
+	 */
+	for (i = 0; i < net_device->num_chn; i++) {
+		struct netvsc_channel *nvchan = &net_device->chan_table[i];
+
+		if (i == 0 || (nvchan->channel != device->channel &&
+			       nvchan->channel->state == CHANNEL_OPENED_STATE))
+			napi_disable(&nvchan->napi);
+	}
+
+	for (i = 0; i < VRSS_CHANNEL_MAX; i++)
+		hrtimer_cancel(&net_device->chan_table[i].coal_timer);
+
 	/* And disassociate NAPI context from device */
 	for (i = 0; i < net_device->num_chn; i++)
 		netif_napi_del(&net_device->chan_table[i].napi);
 
+#if (RHEL_RELEASE_CODE <= RHEL_RELEASE_VERSION(7,1))
+	for (i = 0; i < VRSS_CHANNEL_MAX; i++)
+		tasklet_hrtimer_cancel(&net_device->chan_table[i].flush_timer);
+#endif
+
 	/*
 	 * At this point, no one should be accessing net_device
 	 * except in here
 	 */
 	netdev_dbg(ndev, "net device safe to remove\n");
 
+	/* The receive buffer has been revoked, so the sections the stack
+	 * may still hold are not reused: hand them back while the channels
+	 * are open.
+	 */
+	for (i = 0; i < net_device->num_chn; i++) {
+		netvsc_release_deferred(ndev, net_device, i, true);
+		send_recv_completions(ndev, net_device,
+				      &net_device->chan_table[i]);
+	}
+
 	/* Now, we can close the channel safely */
 	vmbus_close(device->channel);
 
@@ -685,11 +895,20 @@ static u32 hv_ringbuf_avail_percent(const struct hv_ring_buffer_info *ring_info)
 #endif
 
 static inline void netvsc_free_send_slot(struct netvsc_device *net_device,
-					 u32 index)
+					 u16 q_idx, u32 index)
 {
-	sync_change_bit(index, net_device->send_section_map);
+	struct netvsc_send_pool *pool = &net_device->chan_table[q_idx].send_pool;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	netvsc_send_pool_push(net_device, pool, index);
+	spin_unlock_irqrestore(&pool->lock, flags);
 }
 
+static bool netvsc_tx_batch_resend(struct net_device *ndev,
+				   struct netvsc_device *net_device,
+				   u16 q_idx);
+
 static void netvsc_send_tx_complete(struct net_device *ndev,
 				    struct netvsc_device *net_device,
 				    struct vmbus_channel *channel,
@@ -708,9 +927,9 @@ static void netvsc_send_tx_complete(struct net_device *ndev,
 		u32 send_index = packet->send_buf_index;
 		struct netvsc_stats *tx_stats;
 
-		if (send_index != NETVSC_INVALID_INDEX)
-			netvsc_free_send_slot(net_device, send_index);
 		q_idx = packet->q_idx;
+		if (send_index != NETVSC_INVALID_INDEX)
+			netvsc_free_send_slot(net_device, q_idx, send_index);
 
 #if (RHEL_RELEASE_CODE >= RHEL_RELEASE_VERSION(7,0))
 		tx_stats = &net_device->chan_table[q_idx].tx_stats;
@@ -736,6 +955,10 @@ static void netvsc_send_tx_complete(struct net_device *ndev,
 	} else {
 		struct netdev_queue *txq = netdev_get_tx_queue(ndev, q_idx);
 
+		/* What a full ring left in the batch goes out first */
+		if (netvsc_tx_batch_resend(ndev, net_device, q_idx))
+			return;
+
 		if (netif_tx_queue_stopped(txq) &&
 #if (RHEL_RELEASE_CODE == RHEL_RELEASE_VERSION(7, 0))
 			 (hv_ringbuf_avail_percent(&channel->outbound) > RING_AVAIL_PERCENT_HIWATER ||
@@ -784,19 +1007,71 @@ static void netvsc_send_completion(struct net_device *ndev,
 	}
 }
 
-static u32 netvsc_get_next_send_section(struct netvsc_device *net_device)
+/*
+ * Move all free sections of the first other queue that has any to this
+ * queue, and return one of them. The whole list is spliced, so this takes
+ * constant time however many sections there are. The two pool locks are
+ * never held together, so queues stealing from each other cannot deadlock.
+ */
+static u32 netvsc_send_pool_steal(struct netvsc_device *net_device, u16 q_idx)
 {
-	unsigned long *map_addr = net_device->send_section_map;
-	unsigned int i;
+	struct netvsc_send_pool *pool = &net_device->chan_table[q_idx].send_pool;
+	u32 *next = net_device->send_section_next;
+	unsigned long flags;
+	u32 first, last, n;
+	u16 i;
+
+	for (i = 1; i < VRSS_CHANNEL_MAX; i++) {
+		struct netvsc_send_pool *victim =
+		    &net_device->chan_table[(q_idx + i) % VRSS_CHANNEL_MAX].send_pool;
+
+		if (!READ_ONCE(victim->count))
+			continue;
 
-	for_each_clear_bit(i, map_addr, net_device->send_section_cnt) {
-		if (sync_test_and_set_bit(i, map_addr) == 0)
-			return i;
+		spin_lock_irqsave(&victim->lock, flags);
+		n = victim->count;
+		first = victim->head;
+		last = victim->tail;
+		victim->head = NETVSC_INVALID_INDEX;
+		victim->count = 0;
+		spin_unlock_irqrestore(&victim->lock, flags);
+
+		if (!n)
+			continue;
+
+		if (n > 1) {
+			spin_lock_irqsave(&pool->lock, flags);
+			if (!pool->count)
+				pool->tail = last;
+			next[last] = pool->head;
+			pool->head = next[first];
+			pool->count += n - 1;
+			spin_unlock_irqrestore(&pool->lock, flags);
+		}
+
+		return first;
 	}
 
 	return NETVSC_INVALID_INDEX;
 }
 
+static u32 netvsc_get_next_send_section(struct netvsc_device *net_device,
+					u16 q_idx)
+{
+	struct netvsc_send_pool *pool = &net_device->chan_table[q_idx].send_pool;
+	unsigned long flags;
+	u32 index;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	index = netvsc_send_pool_pop(net_device, pool);
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	if (unlikely(index == NETVSC_INVALID_INDEX))
+		index = netvsc_send_pool_steal(net_device, q_idx);
+
+	return index;
+}
+
 static void netvsc_copy_to_send_buf(struct netvsc_device *net_device,
 				    unsigned int section_index,
 				    u32 pend_size,
@@ -843,21 +1118,232 @@ static void netvsc_copy_to_send_buf(struct netvsc_device *net_device,
 		memset(dest, 0, padding);
 }
 
+static inline void netvsc_fill_rndis_pkt(struct nvsp_message *nvmsg,
+					 const struct hv_netvsc_packet *packet,
+					 const struct sk_buff *skb)
+{
+	struct nvsp_1_message_send_rndis_packet *rpkt =
+		&nvmsg->msg.v1_msg.send_rndis_pkt;
+
+	nvmsg->hdr.msg_type = NVSP_MSG1_TYPE_SEND_RNDIS_PKT;
+	if (skb)
+		rpkt->channel_type = 0;		/* 0 is RMC_DATA */
+	else
+		rpkt->channel_type = 1;		/* 1 is RMC_CONTROL */
+
+	rpkt->send_buf_section_index = packet->send_buf_index;
+	if (packet->send_buf_index == NETVSC_INVALID_INDEX)
+		rpkt->send_buf_section_size = 0;
+	else
+		rpkt->send_buf_section_size = packet->total_data_buflen;
+}
+
+/* Update queue state after (trying to) put packets on the ring */
+static int netvsc_send_done(struct net_device *ndev,
+			    struct netvsc_channel *nvchan,
+			    struct netdev_queue *txq,
+			    u32 ring_avail, int ret)
+{
+	struct net_device_context *ndev_ctx = netdev_priv(ndev);
+
+	if (ret == 0) {
+		if (ring_avail < RING_AVAIL_PERCENT_LOWATER) {
+			netif_tx_stop_queue(txq);
+			ndev_ctx->eth_stats.stop_queue++;
+		}
+	} else if (ret == -EAGAIN) {
+		netif_tx_stop_queue(txq);
+		ndev_ctx->eth_stats.stop_queue++;
+		if (atomic_read(&nvchan->queue_sends) < 1) {
+			netif_tx_wake_queue(txq);
+			ndev_ctx->eth_stats.wake_queue++;
+			ret = -ENOSPC;
+		}
+	}
+
+	return ret;
+}
+
+/* Queue a data packet on the per-channel transmit batch */
+static void netvsc_tx_batch_add(struct netvsc_tx_batch *txb,
+				const struct hv_netvsc_packet *packet,
+				struct hv_page_buffer *pb,
+				struct sk_buff *skb)
+{
+	struct netvsc_tx_batch_slot *slot = &txb->slot[txb->count];
+	struct vmbus_batch_packet *bp = &txb->pkts[txb->count];
+
+	netvsc_fill_rndis_pkt(&slot->nvmsg, packet, skb);
+
+	/* pb lives on the caller's stack, keep a copy until the flush */
+	if (packet->page_buf_cnt) {
+		if (packet->cp_partial)
+			pb += packet->rmsg_pgcnt;
+		memcpy(slot->pb, pb,
+		       packet->page_buf_cnt * sizeof(struct hv_page_buffer));
+	}
+	slot->skb = skb;
+
+	bp->buffer = &slot->nvmsg;
+	bp->bufferlen = sizeof(slot->nvmsg);
+	bp->requestid = (ulong)skb;
+	bp->type = VM_PKT_DATA_INBAND;
+	bp->flags = VMBUS_DATA_PACKET_FLAG_COMPLETION_REQUESTED;
+	bp->pagebuffers = packet->page_buf_cnt ? slot->pb : NULL;
+	bp->pagecount = packet->page_buf_cnt;
+
+	txb->count++;
+}
+
+/*
+ * Keep the @left packets after the first @sent at the front of the batch.
+ * The ring descriptors point into the slots, so they move with them.
+ */
+static void netvsc_tx_batch_trim(struct netvsc_tx_batch *txb,
+				 u32 sent, u32 left)
+{
+	u32 i;
+
+	for (i = 0; i < left && sent; i++) {
+		struct netvsc_tx_batch_slot *from = &txb->slot[sent + i];
+		struct netvsc_tx_batch_slot *slot = &txb->slot[i];
+		struct vmbus_batch_packet *bp = &txb->pkts[i];
+
+		*bp = txb->pkts[sent + i];
+		slot->nvmsg = from->nvmsg;
+		memcpy(slot->pb, from->pb,
+		       bp->pagecount * sizeof(struct hv_page_buffer));
+		slot->skb = from->skb;
+
+		bp->buffer = &slot->nvmsg;
+		bp->pagebuffers = bp->pagecount ? slot->pb : NULL;
+	}
+	txb->count = left;
+}
+
+/* Give up on every packet still in the batch */
+static void netvsc_tx_batch_drop(struct net_device *ndev,
+				 struct netvsc_device *net_device,
+				 struct netvsc_tx_batch *txb)
+{
+	u32 i;
+
+	for (i = 0; i < txb->count; i++) {
+		struct sk_buff *skb = txb->slot[i].skb;
+		struct hv_netvsc_packet *packet
+			= (struct hv_netvsc_packet *)skb->cb;
+
+		if (packet->send_buf_index != NETVSC_INVALID_INDEX)
+			netvsc_free_send_slot(net_device, packet->q_idx,
+					      packet->send_buf_index);
+		dev_kfree_skb_any(skb);
+		ndev->stats.tx_dropped++;
+	}
+	txb->count = 0;
+}
+
+/*
+ * Put every batched packet on the ring with a single host signal.
+ *
+ * Packets the ring cannot take stay in the batch, in order, and the queue
+ * is stopped until a send completion puts them on the ring. Unless
+ * @keep_last is set, the last packet is the caller's current one: it is
+ * taken out of the batch on failure, its status is returned and cleaning
+ * it up is left to the caller. With @keep_last the batch owns every packet
+ * and the caller has nothing to clean up.
+ */
+static int netvsc_tx_batch_flush(struct hv_device *device,
+				 struct netvsc_device *net_device,
+				 struct netvsc_channel *nvchan,
+				 struct netdev_queue *txq,
+				 bool keep_last)
+{
+	struct netvsc_tx_batch *txb = nvchan->txb;
+	struct vmbus_channel *out_channel = nvchan->channel;
+	struct net_device *ndev = hv_get_drvdata(device);
+	u32 i, left, sent = 0;
+	int ret;
+#if (RHEL_RELEASE_CODE == RHEL_RELEASE_VERSION(7, 0))
+	u32 ring_avail = hv_ringbuf_avail_percent(&out_channel->outbound);
+#else
+	u32 ring_avail = hv_get_avail_to_write_percent(&out_channel->outbound);
+#endif
+
+	for (i = 0; i < txb->count; i++)
+		trace_nvsp_send_pkt(ndev, out_channel,
+				    &txb->slot[i].nvmsg.msg.v1_msg.send_rndis_pkt);
+
+	ret = vmbus_sendpacket_batch(out_channel, txb->pkts, txb->count, &sent);
+	atomic_add(sent, &nvchan->queue_sends);
+
+	if (sent == txb->count) {
+		txb->count = 0;
+		return netvsc_send_done(ndev, nvchan, txq, ring_avail, 0);
+	}
+
+	if (ret != -EAGAIN)
+		netdev_err(ndev, "Unable to send %u batched packets, ret %d\n",
+			   txb->count - sent, ret);
+
+	left = txb->count - sent;
+	if (!keep_last)
+		left--;
+	netvsc_tx_batch_trim(txb, sent, left);
+
+	/* The queue is stopped now and a completion will resend the rest,
+	 * unless nothing is in flight to complete or the channel is gone.
+	 */
+	ret = netvsc_send_done(ndev, nvchan, txq, ring_avail, ret);
+	if (ret != -EAGAIN)
+		netvsc_tx_batch_drop(ndev, net_device, txb);
+
+	return keep_last ? 0 : ret;
+}
+
+/*
+ * Called from the send completion path: put packets a full ring left in
+ * the batch on the ring before the queue is woken. Returns true while some
+ * are still waiting.
+ */
+static bool netvsc_tx_batch_resend(struct net_device *ndev,
+				   struct netvsc_device *net_device,
+				   u16 q_idx)
+{
+	struct net_device_context *ndev_ctx = netdev_priv(ndev);
+	struct netvsc_channel *nvchan = &net_device->chan_table[q_idx];
+	struct netvsc_tx_batch *txb = nvchan->txb;
+	struct netdev_queue *txq = netdev_get_tx_queue(ndev, q_idx);
+	bool pending;
+
+	if (!txb || !READ_ONCE(txb->count))
+		return false;
+
+	__netif_tx_lock(txq, smp_processor_id());
+	if (txb->count)
+		netvsc_tx_batch_flush(ndev_ctx->device_ctx, net_device, nvchan,
+				      txq, true);
+	pending = txb->count != 0;
+	__netif_tx_unlock(txq);
+
+	return pending;
+}
+
 static inline int netvsc_send_pkt(
 	struct hv_device *device,
 	struct hv_netvsc_packet *packet,
 	struct netvsc_device *net_device,
 	struct hv_page_buffer *pb,
-	struct sk_buff *skb)
+	struct sk_buff *skb,
+	bool xmit_more)
 {
 	struct nvsp_message nvmsg;
 	struct nvsp_1_message_send_rndis_packet *rpkt =
 		&nvmsg.msg.v1_msg.send_rndis_pkt;
 	struct netvsc_channel * const nvchan =
 		&net_device->chan_table[packet->q_idx];
+	struct netvsc_tx_batch *txb = nvchan->txb;
 	struct vmbus_channel *out_channel = nvchan->channel;
 	struct net_device *ndev = hv_get_drvdata(device);
-	struct net_device_context *ndev_ctx = netdev_priv(ndev);
 	struct netdev_queue *txq = netdev_get_tx_queue(ndev, packet->q_idx);
 	u64 req_id;
 	int ret;
@@ -867,22 +1353,33 @@ static inline int netvsc_send_pkt(
 	u32 ring_avail = hv_get_avail_to_write_percent(&out_channel->outbound);
 #endif
 
-	nvmsg.hdr.msg_type = NVSP_MSG1_TYPE_SEND_RNDIS_PKT;
-	if (skb)
-		rpkt->channel_type = 0;		/* 0 is RMC_DATA */
-	else
-		rpkt->channel_type = 1;		/* 1 is RMC_CONTROL */
+	if (out_channel->rescind)
+		return -ENODEV;
 
-	rpkt->send_buf_section_index = packet->send_buf_index;
-	if (packet->send_buf_index == NETVSC_INVALID_INDEX)
-		rpkt->send_buf_section_size = 0;
-	else
-		rpkt->send_buf_section_size = packet->total_data_buflen;
+	/* Defer data packets while the stack says more are coming, then
+	 * put the whole batch on the ring with one host signal.
+	 */
+	if (skb && txb && (xmit_more || txb->count)) {
+		/* A full ring may have left the whole batch waiting */
+		if (txb->count == NETVSC_TX_BATCH_MAX) {
+			netvsc_tx_batch_flush(device, net_device, nvchan, txq,
+					      true);
+			if (txb->count == NETVSC_TX_BATCH_MAX)
+				return netvsc_send_done(ndev, nvchan, txq,
+							ring_avail, -EAGAIN);
+		}
 
-	req_id = (ulong)skb;
+		netvsc_tx_batch_add(txb, packet, pb, skb);
+		if (xmit_more && txb->count < NETVSC_TX_BATCH_MAX)
+			return 0;
 
-	if (out_channel->rescind)
-		return -ENODEV;
+		/* The packet is already accepted when more are coming */
+		return netvsc_tx_batch_flush(device, net_device, nvchan, txq,
+					     xmit_more);
+	}
+
+	netvsc_fill_rndis_pkt(&nvmsg, packet, skb);
+	req_id = (ulong)skb;
 
 	trace_nvsp_send_pkt(ndev, out_channel, rpkt);
 
@@ -901,29 +1398,15 @@ static inline int netvsc_send_pkt(
 				       VMBUS_DATA_PACKET_FLAG_COMPLETION_REQUESTED);
 	}
 
-	if (ret == 0) {
+	if (ret == 0)
 		atomic_inc_return(&nvchan->queue_sends);
-
-		if (ring_avail < RING_AVAIL_PERCENT_LOWATER) {
-			netif_tx_stop_queue(txq);
-			ndev_ctx->eth_stats.stop_queue++;
-		}
-	} else if (ret == -EAGAIN) {
-		netif_tx_stop_queue(txq);
-		ndev_ctx->eth_stats.stop_queue++;
-		if (atomic_read(&nvchan->queue_sends) < 1) {
-			netif_tx_wake_queue(txq);
-			ndev_ctx->eth_stats.wake_queue++;
-			ret = -ENOSPC;
-		}
-	} else {
+	else if (ret != -EAGAIN)
 		netdev_err(ndev,
 			   "Unable to send packet pages %u len %u, ret %d\n",
 			   packet->page_buf_cnt, packet->total_data_buflen,
 			   ret);
-	}
 
-	return ret;
+	return netvsc_send_done(ndev, nvchan, txq, ring_avail, ret);
 }
 
 /* Move packet out of multi send data (msd), and clear msd */
@@ -972,7 +1455,8 @@ int netvsc_send(struct net_device *ndev,
 	 * Data) field which may be changed during data packet processing.
 	 */
 	if (!skb)
-		return netvsc_send_pkt(device, packet, net_device, pb, skb);
+		return netvsc_send_pkt(device, packet, net_device, pb, skb,
+				       false);
 
 	/* batch packets in send buffer if possible */
 	msdp = &nvchan->msd;
@@ -991,7 +1475,8 @@ int netvsc_send(struct net_device *ndev,
 
 	} else if (pktlen + net_device->pkt_align <
 		   net_device->send_section_size) {
-		section_index = netvsc_get_next_send_section(net_device);
+		section_index = netvsc_get_next_send_section(net_device,
+							     packet->q_idx);
 		if (unlikely(section_index == NETVSC_INVALID_INDEX)) {
 			++ndev_ctx->eth_stats.tx_send_full;
 		} else {
@@ -1007,6 +1492,9 @@ int netvsc_send(struct net_device *ndev,
 	xmit_more = skb->xmit_more &&
 			!packet->cp_partial &&
 			!netif_xmit_stopped(netdev_get_tx_queue(ndev, packet->q_idx));
+#else
+	if (netif_xmit_stopped(netdev_get_tx_queue(ndev, packet->q_idx)))
+		packet->xmit_more = false;
 #endif
 
 	if (section_index != NETVSC_INVALID_INDEX) {
@@ -1053,57 +1541,151 @@ int netvsc_send(struct net_device *ndev,
 		cur_send = packet;
 	}
 
+	/* The flushed msd packet is always followed by cur_send or by
+	 * another transmit, so it can wait in the transmit batch.
+	 */
 	if (msd_send) {
 		int m_ret = netvsc_send_pkt(device, msd_send, net_device,
-					    NULL, msd_skb);
+					    NULL, msd_skb, true);
 
 		if (m_ret != 0) {
-			netvsc_free_send_slot(net_device,
+			netvsc_free_send_slot(net_device, msd_send->q_idx,
 					      msd_send->send_buf_index);
 			dev_kfree_skb_any(msd_skb);
 		}
 	}
 
 	if (cur_send)
-		ret = netvsc_send_pkt(device, cur_send, net_device, pb, skb);
+		ret = netvsc_send_pkt(device, cur_send, net_device, pb, skb,
+#if (RHEL_RELEASE_CODE > RHEL_RELEASE_VERSION(7,1))
+				      xmit_more);
+#else
+				      packet->xmit_more && !packet->cp_partial);
+#endif
 
 	if (ret != 0 && section_index != NETVSC_INVALID_INDEX)
-		netvsc_free_send_slot(net_device, section_index);
+		netvsc_free_send_slot(net_device, packet->q_idx,
+				      section_index);
+
+#if (RHEL_RELEASE_CODE <= RHEL_RELEASE_VERSION(7,1))
+	/* Don't let a guessed xmit_more strand what is left pending */
+	if ((msdp->pkt || (nvchan->txb && nvchan->txb->count)) &&
+	    !hrtimer_active(&nvchan->flush_timer.timer))
+		tasklet_hrtimer_start(&nvchan->flush_timer,
+				      ns_to_ktime(NETVSC_TX_FLUSH_NS),
+				      HRTIMER_MODE_REL);
+#endif
 
 	return ret;
 }
 
-/* Send pending recv completions */
+/*
+ * Put what is still pending on a queue, the packet in its send section and
+ * the transmit batch, on the ring. Called with the queue's transmit lock
+ * held. Batched packets a full ring leaves behind wait for a send
+ * completion. The send section packet is left pending for a retry if
+ * @retry is set, in which case false is returned, and dropped otherwise.
+ */
+static bool netvsc_send_flush_chan(struct hv_device *device,
+				   struct netvsc_device *net_device,
+				   struct netvsc_channel *nvchan,
+				   struct netdev_queue *txq, bool retry)
+{
+	struct net_device *ndev = hv_get_drvdata(device);
+	struct multi_send_data *msdp = &nvchan->msd;
+	struct hv_netvsc_packet *packet;
+	struct sk_buff *skb;
+	u32 count = msdp->count;
+	int ret;
+
+	if (msdp->pkt) {
+		move_pkt_msd(&packet, &skb, msdp);
+		ret = netvsc_send_pkt(device, packet, net_device, NULL, skb,
+				      true);
+		if (retry && (ret == -EAGAIN || ret == -ENOSPC)) {
+			msdp->skb = skb;
+			msdp->pkt = packet;
+			msdp->count = count;
+			return false;
+		}
+
+		if (ret != 0) {
+			netvsc_free_send_slot(net_device, packet->q_idx,
+					      packet->send_buf_index);
+			dev_kfree_skb_any(skb);
+			ndev->stats.tx_dropped++;
+		}
+	}
+
+	if (nvchan->txb && nvchan->txb->count)
+		netvsc_tx_batch_flush(device, net_device, nvchan, txq, true);
+
+	return true;
+}
+
+/*
+ * Flush a queue before the next packet takes another path. Called with
+ * the queue's transmit lock and RCU held.
+ */
+void netvsc_send_flush(struct net_device *ndev, u16 q_idx)
+{
+	struct net_device_context *ndev_ctx = netdev_priv(ndev);
+	struct netvsc_device *net_device
+		= rcu_dereference_bh(ndev_ctx->nvdev);
+
+	if (unlikely(!net_device || net_device->destroy))
+		return;
+
+	netvsc_send_flush_chan(ndev_ctx->device_ctx, net_device,
+			       &net_device->chan_table[q_idx],
+			       netdev_get_tx_queue(ndev, q_idx), false);
+}
+
+/* Send pending recv completions, up to NETVSC_RX_COMP_BATCH per ring write */
 static int send_recv_completions(struct net_device *ndev,
 				 struct netvsc_device *nvdev,
 				 struct netvsc_channel *nvchan)
 {
+	struct net_device_context *ndev_ctx = netdev_priv(ndev);
 	struct multi_recv_comp *mrc = &nvchan->mrc;
-	struct recv_comp_msg {
-		struct nvsp_message_header hdr;
-		u32 status;
-	}  __packed;
-	struct recv_comp_msg msg = {
-		.hdr.msg_type = NVSP_MSG1_TYPE_SEND_RNDIS_PKT_COMPLETE,
-	};
+	struct recv_comp_batch *batch = mrc->batch;
+	u32 count = nvdev->recv_completion_cnt;
+	u32 idx, n, sent;
 	int ret;
 
 	while (mrc->first != mrc->next) {
-		const struct recv_comp_data *rcd
-			= mrc->slots + mrc->first;
+		for (idx = mrc->first, n = 0;
+		     idx != mrc->next && n < NETVSC_RX_COMP_BATCH; n++) {
+			const struct recv_comp_data *rcd = mrc->slots + idx;
+			struct vmbus_batch_packet *pkt = &batch->pkts[n];
+
+			batch->msg[n].hdr.msg_type =
+				NVSP_MSG1_TYPE_SEND_RNDIS_PKT_COMPLETE;
+			batch->msg[n].status = rcd->status;
+
+			pkt->buffer = &batch->msg[n];
+			pkt->bufferlen = sizeof(batch->msg[n]);
+			pkt->requestid = rcd->tid;
+			pkt->type = VM_PKT_COMP;
+			pkt->flags = 0;
+			pkt->pagebuffers = NULL;
+			pkt->pagecount = 0;
+
+			if (++idx == count)
+				idx = 0;
+		}
 
-		msg.status = rcd->status;
-		ret = vmbus_sendpacket(nvchan->channel, &msg, sizeof(msg),
-				       rcd->tid, VM_PKT_COMP, 0);
-		if (unlikely(ret)) {
-			struct net_device_context *ndev_ctx = netdev_priv(ndev);
+		ret = vmbus_sendpacket_batch(nvchan->channel, batch->pkts, n,
+					     &sent);
+		if (sent) {
+			++ndev_ctx->eth_stats.rx_comp_writes;
+			mrc->first = (mrc->first + sent) % count;
+		}
 
+		if (unlikely(ret)) {
 			++ndev_ctx->eth_stats.rx_comp_busy;
 			return ret;
 		}
-
-		if (++mrc->first == nvdev->recv_completion_cnt)
-			mrc->first = 0;
 	}
 
 	/* receive completion ring has been emptied */
@@ -1140,7 +1722,7 @@ static void enq_receive_complete(struct net_device *ndev,
 
 	recv_comp_slot_avail(nvdev, mrc, &filled, &avail);
 
-	if (unlikely(filled > NAPI_POLL_WEIGHT)) {
+	if (unlikely(filled >= mrc->budget)) {
 		send_recv_completions(ndev, nvdev, nvchan);
 		recv_comp_slot_avail(nvdev, mrc, &filled, &avail);
 	}
@@ -1151,6 +1733,9 @@ static void enq_receive_complete(struct net_device *ndev,
 		return;
 	}
 
+	if (!filled)
+		mrc->first_ns = local_clock();
+
 	rcd = mrc->slots + mrc->next;
 	rcd->tid = tid;
 	rcd->status = status;
@@ -1159,6 +1744,76 @@ static void enq_receive_complete(struct net_device *ndev,
 		mrc->next = 0;
 }
 
+/* Check whether the stack still holds any of the pages of a completion */
+static bool netvsc_recv_pages_busy(const struct netvsc_device *nvdev,
+				   const struct recv_comp_deferred *rcd)
+{
+	u32 i, pg;
+
+	for (i = 0; i < rcd->nspans; i++) {
+		for (pg = rcd->span[i].first; pg <= rcd->span[i].last; pg++) {
+			const void *addr = nvdev->recv_buf +
+					   ((size_t)pg << PAGE_SHIFT);
+
+			if (page_count(vmalloc_to_page(addr)) > 1)
+				return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Queue the deferred completions whose pages have been released, or all
+ * of them once the receive buffer is no longer used.
+ */
+static void netvsc_release_deferred(struct net_device *ndev,
+				    struct netvsc_device *nvdev, u16 q_idx,
+				    bool all)
+{
+	struct multi_recv_comp *mrc = &nvdev->chan_table[q_idx].mrc;
+	u64 oldest = U64_MAX;
+	u32 i = 0;
+
+	while (i < mrc->deferred_cnt) {
+		struct recv_comp_deferred *rcd = &mrc->deferred[i];
+
+		if (!all && netvsc_recv_pages_busy(nvdev, rcd)) {
+			oldest = min(oldest, rcd->queued_ns);
+			++i;
+			continue;
+		}
+
+		enq_receive_complete(ndev, nvdev, q_idx, rcd->tid, rcd->status);
+		mrc->deferred_sections -= rcd->sections;
+		*rcd = mrc->deferred[--mrc->deferred_cnt];
+		mrc->defer_poll_ns = NETVSC_RX_DEFER_NS;
+	}
+
+	mrc->deferred_ns = oldest;
+}
+
+/*
+ * Frames may only be left in recv_buf for the stack while the completions
+ * held back for them keep a bounded part of the queue's receive sections
+ * and none has been held for NETVSC_RX_ZC_HOLD_NS; a reader that never
+ * drains its socket must not starve the host. Past either bound the queue
+ * copies until it gets its sections back.
+ */
+static bool netvsc_rx_zc_allowed(const struct netvsc_device *nvdev,
+				 const struct multi_recv_comp *mrc,
+				 u32 sections)
+{
+	u32 share = nvdev->recv_section_cnt / max(nvdev->num_chn, 1U);
+
+	if (mrc->deferred_cnt >= NETVSC_RX_DEFER_MAX ||
+	    mrc->deferred_sections + sections > share / NETVSC_RX_ZC_SHARE)
+		return false;
+
+	return !mrc->deferred_cnt ||
+		local_clock() - mrc->deferred_ns < NETVSC_RX_ZC_HOLD_NS;
+}
+
 static int netvsc_receive(struct net_device *ndev,
 			  struct netvsc_device *net_device,
 			  struct vmbus_channel *channel,
@@ -1169,8 +1824,11 @@ static int netvsc_receive(struct net_device *ndev,
 	const struct vmtransfer_page_packet_header *vmxferpage_packet
 		= container_of(desc, const struct vmtransfer_page_packet_header, d);
 	u16 q_idx = channel->offermsg.offer.sub_channel_index;
+	struct multi_recv_comp *mrc = &net_device->chan_table[q_idx].mrc;
 	char *recv_buf = net_device->recv_buf;
+	struct recv_comp_deferred *rcd;
 	u32 status = NVSP_STAT_SUCCESS;
+	u32 sections = 0;
 	int i;
 	int count = 0;
 
@@ -1192,6 +1850,17 @@ static int netvsc_receive(struct net_device *ndev,
 
 	count = vmxferpage_packet->range_cnt;
 
+	/* Receive sections the packet keeps if its completion is held back */
+	for (i = 0; i < count; i++)
+		sections += DIV_ROUND_UP(vmxferpage_packet->ranges[i].byte_count,
+					 net_device->recv_section_size);
+
+	mrc->zc = NULL;
+	if (netvsc_rx_zc_allowed(net_device, mrc, sections)) {
+		mrc->zc = &mrc->deferred[mrc->deferred_cnt];
+		mrc->zc->nspans = 0;
+	}
+
 	/* Each range represents 1 RNDIS pkt that contains 1 ethernet frame */
 	for (i = 0; i < count; i++) {
 		u32 offset = vmxferpage_packet->ranges[i].byte_offset;
@@ -1220,8 +1889,30 @@ static int netvsc_receive(struct net_device *ndev,
 			status = NVSP_STAT_FAIL;
 	}
 
-	enq_receive_complete(ndev, net_device, q_idx,
-			     vmxferpage_packet->d.trans_id, status);
+	netvsc_lro_flush(&net_device->chan_table[q_idx]);
+	rcd = mrc->zc;
+	mrc->zc = NULL;
+
+	/* The pieces of a coalesced frame all come in one transfer page
+	 * packet; drop any left over before their sections are returned.
+	 */
+	net_device->chan_table[q_idx].rsc->cnt = 0;
+
+	if (rcd && rcd->nspans) {
+		rcd->tid = vmxferpage_packet->d.trans_id;
+		rcd->queued_ns = local_clock();
+		rcd->status = status;
+		rcd->sections = sections;
+
+		if (!mrc->deferred_cnt++) {
+			mrc->deferred_ns = rcd->queued_ns;
+			mrc->defer_poll_ns = NETVSC_RX_DEFER_NS;
+		}
+		mrc->deferred_sections += sections;
+	} else {
+		enq_receive_complete(ndev, net_device, q_idx,
+				     vmxferpage_packet->d.trans_id, status);
+	}
 
 	return count;
 }
@@ -1314,6 +2005,126 @@ static struct hv_device *netvsc_channel_to_device(struct vmbus_channel *channel)
 	return primary ? primary->device_obj : channel->device_obj;
 }
 
+#if (RHEL_RELEASE_CODE <= RHEL_RELEASE_VERSION(7,1))
+/*
+ * These kernels have no skb->xmit_more, so netvsc_start_xmit() guesses it
+ * from the qdisc backlog. When the qdisc stops handing packets over after
+ * all, the flush timer puts the packet left in its send section and the
+ * transmit batch on the ring. If the ring is full the send section packet
+ * stays pending and the timer tries again.
+ */
+static enum hrtimer_restart netvsc_xmit_flush_timer(struct hrtimer *timer)
+{
+	struct netvsc_channel *nvchan
+		= container_of(timer, struct netvsc_channel, flush_timer.timer);
+	struct netvsc_device *net_device = nvchan->net_device;
+	struct hv_device *device = netvsc_channel_to_device(nvchan->channel);
+	struct net_device *ndev = hv_get_drvdata(device);
+	struct netdev_queue *txq
+		= netdev_get_tx_queue(ndev, nvchan - net_device->chan_table);
+
+	__netif_tx_lock(txq, smp_processor_id());
+
+	if (!netvsc_send_flush_chan(device, net_device, nvchan, txq, true) &&
+	    !net_device->destroy)
+		tasklet_hrtimer_start(&nvchan->flush_timer,
+				      ns_to_ktime(NETVSC_TX_FLUSH_NS),
+				      HRTIMER_MODE_REL);
+
+	__netif_tx_unlock(txq);
+	return HRTIMER_NORESTART;
+}
+#endif
+
+/*
+ * Every completion hands a receive buffer section back to the host, so the
+ * more of its share of the buffer a channel sits on, the sooner it has to
+ * let go. Allow an eighth of the share to be held for coalescing, less what
+ * in-place receive already pins and less still while the ring is pushing
+ * back.
+ */
+static void netvsc_rx_comp_budget(struct netvsc_device *nvdev,
+				  struct multi_recv_comp *mrc, bool busy)
+{
+	u32 share = nvdev->recv_section_cnt / max(nvdev->num_chn, 1U);
+	u32 budget = share / 8;
+
+	budget = budget > mrc->deferred_sections ?
+		 budget - mrc->deferred_sections : 0;
+	if (busy)
+		budget /= 4;
+
+	mrc->budget = clamp_t(u32, budget, 1, NETVSC_RX_COMP_MAX);
+}
+
+/*
+ * Completions are always flushed before NAPI goes idle. While the channel
+ * keeps polling they are held until the budget fills or the oldest one has
+ * waited NETVSC_RX_COMP_NS, so a busy channel needs only a few ring writes
+ * and host signals per budget's worth of packets.
+ */
+static bool netvsc_rx_comp_due(const struct netvsc_device *nvdev,
+			       const struct multi_recv_comp *mrc, bool idle)
+{
+	u32 filled, avail;
+
+	if (mrc->first == mrc->next)
+		return false;
+
+	if (idle)
+		return true;
+
+	recv_comp_slot_avail(nvdev, mrc, &filled, &avail);
+	return filled >= mrc->budget ||
+		local_clock() - mrc->first_ns >= NETVSC_RX_COMP_NS;
+}
+
+static enum hrtimer_restart netvsc_coal_timer(struct hrtimer *timer)
+{
+	struct netvsc_channel *nvchan
+		= container_of(timer, struct netvsc_channel, coal_timer);
+
+	napi_schedule(&nvchan->napi);
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Decide how long host interrupts stay masked after a poll drained the
+ * ring. A poll has to have drained rx_coalesce_frames packets to be worth
+ * waiting for more; anything less goes straight back to interrupts. With
+ * adaptive moderation the interval doubles while polls keep coming back
+ * with a sizeable batch and halves when they don't.
+ */
+static u32 netvsc_rx_coalesce(const struct net_device_context *ndev_ctx,
+			      struct netvsc_channel *nvchan, int work_done)
+{
+	u32 frames = max(READ_ONCE(ndev_ctx->rx_coalesce_frames), 1U);
+
+	/* Let the queue follow its interrupts to the new CPU */
+	if (unlikely(READ_ONCE(nvchan->coal_moved))) {
+		WRITE_ONCE(nvchan->coal_moved, false);
+		nvchan->coal_usecs = 0;
+		return 0;
+	}
+
+	if (work_done < frames) {
+		nvchan->coal_usecs /= 2;
+		return 0;
+	}
+
+	if (!READ_ONCE(ndev_ctx->rx_coalesce_adaptive))
+		return READ_ONCE(ndev_ctx->rx_coalesce_usecs);
+
+	if (work_done * 4 >= NAPI_POLL_WEIGHT)
+		nvchan->coal_usecs = clamp_t(u32, nvchan->coal_usecs * 2,
+					     NETVSC_RX_USECS_ADAPT_MIN,
+					     NETVSC_RX_USECS_ADAPT_MAX);
+	else
+		nvchan->coal_usecs /= 2;
+
+	return nvchan->coal_usecs;
+}
+
 /* Network processing softirq
  * Process data in incoming ring buffer from host
  * Stops when ring is empty or budget is met or exceeded.
@@ -1327,8 +2138,11 @@ int netvsc_poll(struct napi_struct *napi, int budget)
 	struct hv_device *device = netvsc_channel_to_device(channel);
 	struct net_device *ndev = hv_get_drvdata(device);
 	int work_done = 0;
+	u32 usecs;
 	int ret;
 
+	vmbus_chan_stat_inc(channel, polls);
+
 	/* If starting a new interval */
 	if (!nvchan->desc)
 		nvchan->desc = hv_pkt_iter_first(channel);
@@ -1339,27 +2153,74 @@ int netvsc_poll(struct napi_struct *napi, int budget)
 		nvchan->desc = hv_pkt_iter_next(channel, nvchan->desc);
 	}
 
-	/* Send any pending receive completions */
-	ret = send_recv_completions(ndev, net_device, nvchan);
+	/* Send any pending receive completions that are due */
+	if (nvchan->mrc.deferred_cnt)
+		netvsc_release_deferred(ndev, net_device,
+					channel->offermsg.offer.sub_channel_index,
+					false);
+
+	ret = 0;
+	if (netvsc_rx_comp_due(net_device, &nvchan->mrc, work_done < budget))
+		ret = send_recv_completions(ndev, net_device, nvchan);
+	netvsc_rx_comp_budget(net_device, &nvchan->mrc, ret != 0);
 
 	/* If it did not exhaust NAPI budget this time
 	 *  and not doing busy poll
-	 * then re-enable host interrupts
+	 * then either keep host interrupts masked and poll again once
+	 *  the moderation interval is over
+	 * or re-enable host interrupts
 	 *  and reschedule if ring is not empty
 	 *   or sending receive completion failed.
 	 */
-	if (work_done < budget &&
-	    napi_complete_done(napi, work_done) &&
-	    (ret || hv_end_read(&channel->inbound)) &&
-	    napi_schedule_prep(napi)) {
-		hv_begin_read(&channel->inbound);
-		__napi_schedule(napi);
+	if (work_done < budget && napi_complete_done(napi, work_done)) {
+		usecs = netvsc_rx_coalesce(netdev_priv(ndev), nvchan,
+					   work_done);
+		if (usecs && !ret) {
+			hrtimer_start(&nvchan->coal_timer,
+				      ns_to_ktime(usecs * NSEC_PER_USEC),
+				      HRTIMER_MODE_REL);
+		} else if ((ret || hv_end_read(&channel->inbound)) &&
+			   napi_schedule_prep(napi)) {
+			hv_begin_read(&channel->inbound);
+			__napi_schedule(napi);
+		} else if (nvchan->mrc.deferred_cnt &&
+			   local_clock() - nvchan->mrc.deferred_ns <
+			   NETVSC_RX_ZC_HOLD_NS) {
+			struct multi_recv_comp *mrc = &nvchan->mrc;
+
+			/* Host interrupts are back on, but on a quiet queue
+			 * nothing would hand back the sections the stack is
+			 * still holding: look again, less often each time.
+			 * Once held past NETVSC_RX_ZC_HOLD_NS they are left
+			 * to the next poll and the queue copies meanwhile.
+			 */
+			hrtimer_start(&nvchan->coal_timer,
+				      ns_to_ktime(mrc->defer_poll_ns),
+				      HRTIMER_MODE_REL);
+			mrc->defer_poll_ns = min_t(u32, mrc->defer_poll_ns * 2,
+						   NETVSC_RX_ZC_HOLD_NS);
+		}
 	}
 
 	/* Driver may overshoot since multiple packets per descriptor */
 	return min(work_done, budget);
 }
 
+/*
+ * Called after the channel's interrupts moved to CPU new. A queue that
+ * keeps host interrupts masked for coalescing is polled from a timer on
+ * the CPU it last ran on and would stay there until it goes quiet; make
+ * its next poll unmask the interrupts instead, so that NAPI runs where
+ * they now arrive.
+ */
+void netvsc_change_target_cpu(struct vmbus_channel *channel, u32 old, u32 new)
+{
+	struct netvsc_channel *nvchan = channel->channel_callback_context;
+
+	if (nvchan)
+		WRITE_ONCE(nvchan->coal_moved, true);
+}
+
 /* Call back when data is available in host ring buffer.
  * Processing is deferred until network softirq (NAPI)
  */
@@ -1403,6 +2264,7 @@ struct netvsc_device *netvsc_device_add(struct hv_device *device,
 	 * control is done via Net softirq, not the channel handling
 	 */
 	set_channel_read_mode(device->channel, HV_CALL_ISR);
+	device->channel->change_target_cpu_callback = netvsc_change_target_cpu;
 
 	/* If we're reopening the device we may have multiple queues, fill the
 	 * chn_table with the default channel to use it before subchannels are
@@ -1418,6 +2280,29 @@ struct netvsc_device *netvsc_device_add(struct hv_device *device,
 		nvchan->net_device = net_device;
 		u64_stats_init(&nvchan->tx_stats.syncp);
 		u64_stats_init(&nvchan->rx_stats.syncp);
+		hrtimer_init(&nvchan->coal_timer, CLOCK_MONOTONIC,
+			     HRTIMER_MODE_REL);
+		nvchan->coal_timer.function = netvsc_coal_timer;
+#if (RHEL_RELEASE_CODE <= RHEL_RELEASE_VERSION(7,1))
+		tasklet_hrtimer_init(&nvchan->flush_timer,
+				     netvsc_xmit_flush_timer,
+				     CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#endif
+#if (RHEL_RELEASE_CODE >= RHEL_RELEASE_VERSION(7,6))
+		ret = xdp_rxq_info_reg(&nvchan->xdp_rxq, ndev, i);
+		if (ret) {
+			netdev_err(ndev, "xdp_rxq_info_reg fail: %d\n", ret);
+
+			/* Only the queues before this one are registered,
+			 * keep __free_netvsc_device() off the others.
+			 */
+			for (; i < VRSS_CHANNEL_MAX; i++) {
+				nvchan = &net_device->chan_table[i];
+				xdp_rxq_info_unused(&nvchan->xdp_rxq);
+			}
+			goto cleanup2;
+		}
+#endif
 	}
 
 	/* Enable NAPI handler before init callbacks */
@@ -1463,7 +2348,10 @@ close:
 
 cleanup:
 	netif_napi_del(&net_device->chan_table[0].napi);
-	free_netvsc_device(&net_device->rcu);
+#if (RHEL_RELEASE_CODE >= RHEL_RELEASE_VERSION(7,6))
+cleanup2:
+#endif
+	__free_netvsc_device(net_device);
 
 	return ERR_PTR(ret);
 }
@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2018, Microsoft Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * XDP on the synthetic receive path. The program runs on the frame where
+ * the host put it in the receive buffer, before an skb is allocated.
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/netdevice.h>
+#include <linux/etherdevice.h>
+#include <linux/skbuff.h>
+#include <linux/rtnetlink.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
+
+#include "hyperv_net.h"
+
+#if (RHEL_RELEASE_CODE >= RHEL_RELEASE_VERSION(7,6))
+#include <trace/events/xdp.h>
+
+/* Send an XDP_TX frame back out on the queue it arrived on */
+static void netvsc_xdp_xmit(struct net_device *ndev,
+			    struct netvsc_channel *nvchan,
+			    void *data, u32 len)
+{
+	u16 q_idx = nvchan->channel->offermsg.offer.sub_channel_index;
+	struct netdev_queue *txq;
+	struct sk_buff *skb;
+	netdev_tx_t ret = NETDEV_TX_BUSY;
+
+	/* netvsc_start_xmit() copies it on into a send buffer section */
+	skb = napi_alloc_skb(&nvchan->napi, len);
+	if (unlikely(!skb)) {
+		ndev->stats.tx_dropped++;
+		return;
+	}
+	memcpy(skb_put(skb, len), data, len);
+
+	if (unlikely(q_idx >= ndev->real_num_tx_queues))
+		q_idx = 0;
+	skb_set_queue_mapping(skb, q_idx);
+	txq = netdev_get_tx_queue(ndev, q_idx);
+
+	__netif_tx_lock(txq, smp_processor_id());
+	if (!netif_xmit_frozen_or_stopped(txq))
+		ret = ndev->netdev_ops->ndo_start_xmit(skb, ndev);
+	__netif_tx_unlock(txq);
+
+	if (ret != NETDEV_TX_OK) {
+		dev_kfree_skb_any(skb);
+		ndev->stats.tx_dropped++;
+	}
+}
+
+/*
+ * Run the XDP program, if any, on a received frame. Returns true if the
+ * frame goes on to the stack; *data and *len then describe it as the
+ * program left it.
+ */
+bool netvsc_run_xdp(struct net_device *ndev, struct netvsc_channel *nvchan,
+		    void **data, u32 *len)
+{
+	struct net_device_context *ndc = netdev_priv(ndev);
+	struct bpf_prog *prog;
+	struct xdp_buff xdp;
+	bool pass = true;
+	u32 act;
+
+	rcu_read_lock();
+	prog = rcu_dereference(ndc->xdp_prog);
+	if (!prog)
+		goto out;
+
+	/* The RNDIS header in front of the frame is still needed for the
+	 * per-packet info, so there is no headroom to grow into.
+	 */
+	xdp.data_hard_start = *data;
+	xdp.data = *data;
+	xdp_set_data_meta_invalid(&xdp);
+	xdp.data_end = *data + *len;
+	xdp.rxq = &nvchan->xdp_rxq;
+
+	act = bpf_prog_run_xdp(prog, &xdp);
+	switch (act) {
+	case XDP_PASS:
+		*data = xdp.data;
+		*len = xdp.data_end - xdp.data;
+		break;
+
+	case XDP_TX:
+		netvsc_xdp_xmit(ndev, nvchan, xdp.data,
+				xdp.data_end - xdp.data);
+		pass = false;
+		break;
+
+	case XDP_DROP:
+		pass = false;
+		break;
+
+	default:
+		bpf_warn_invalid_xdp_action(act);
+		/* fall through */
+	case XDP_ABORTED:
+		trace_xdp_exception(ndev, prog, act);
+		pass = false;
+		break;
+	}
+out:
+	rcu_read_unlock();
+	return pass;
+}
+
+/* Install prog on the VF, taking a reference for it */
+int netvsc_vf_setxdp(struct net_device *vf_netdev, struct bpf_prog *prog)
+{
+	struct netdev_bpf xdp;
+	bpf_op_t ndo_bpf;
+	int ret;
+
+	ASSERT_RTNL();
+
+	ndo_bpf = get_ndo_ext(vf_netdev->netdev_ops, ndo_bpf);
+	if (!ndo_bpf)
+		return 0;
+
+	if (prog) {
+		prog = bpf_prog_add(prog, 1);
+		if (IS_ERR(prog))
+			return PTR_ERR(prog);
+	}
+
+	memset(&xdp, 0, sizeof(xdp));
+	xdp.command = XDP_SETUP_PROG;
+	xdp.prog = prog;
+
+	ret = ndo_bpf(vf_netdev, &xdp);
+	if (ret && prog)
+		bpf_prog_put(prog);
+
+	return ret;
+}
+
+/*
+ * Replace the device's program; the reference passed in is kept. With a
+ * VF the program is installed there as well, since that is where most of
+ * the traffic arrives.
+ */
+int netvsc_xdp_set(struct net_device *ndev, struct bpf_prog *prog,
+		   struct netlink_ext_ack *extack)
+{
+	struct net_device_context *ndc = netdev_priv(ndev);
+	struct net_device *vf_netdev = rtnl_dereference(ndc->vf_netdev);
+	struct bpf_prog *old;
+	int ret;
+
+	/* Frames coalesced by the host span several buffers */
+	if (prog && (ndev->features & NETIF_F_LRO)) {
+		NL_SET_ERR_MSG_MOD(extack, "XDP needs LRO disabled");
+		return -EOPNOTSUPP;
+	}
+
+	if (vf_netdev) {
+		ret = netvsc_vf_setxdp(vf_netdev, prog);
+		if (ret) {
+			NL_SET_ERR_MSG_MOD(extack,
+					   "unable to set XDP program on VF");
+			return ret;
+		}
+	}
+
+	old = rtnl_dereference(ndc->xdp_prog);
+	rcu_assign_pointer(ndc->xdp_prog, prog);
+	if (old)
+		bpf_prog_put(old);
+
+	return 0;
+}
+
+int netvsc_bpf(struct net_device *ndev, struct netdev_bpf *bpf)
+{
+	struct net_device_context *ndc = netdev_priv(ndev);
+	struct bpf_prog *prog;
+
+	switch (bpf->command) {
+	case XDP_SETUP_PROG:
+		return netvsc_xdp_set(ndev, bpf->prog, bpf->extack);
+
+	case XDP_QUERY_PROG:
+		prog = rtnl_dereference(ndc->xdp_prog);
+		bpf->prog_id = prog ? prog->aux->id : 0;
+		return 0;
+
+	default:
+		return -EINVAL;
+	}
+}
+#endif
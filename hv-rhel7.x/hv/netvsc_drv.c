@@ -33,11 +33,14 @@
 #include <linux/if_vlan.h>
 #include <linux/in.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/rtnetlink.h>
 #include <linux/netpoll.h>
 #include <linux/pci.h>
+#include <linux/tcp.h>
 
 #include <net/arp.h>
+#include <net/ip.h>
 #include <net/route.h>
 #include <net/sock.h>
 #include <net/udp.h>
@@ -77,6 +80,14 @@ static int debug = -1;
 module_param(debug, int, 0444);
 MODULE_PARM_DESC(debug, "Debug level (0=none,...,16=all)");
 
+static bool rx_zerocopy;
+module_param(rx_zerocopy, bool, 0644);
+MODULE_PARM_DESC(rx_zerocopy, "Receive large frames in place in the receive buffer");
+
+static unsigned int rx_copybreak = 256;
+module_param(rx_copybreak, uint, 0644);
+MODULE_PARM_DESC(rx_copybreak, "Frames up to this size are always copied");
+
 static LIST_HEAD(netvsc_dev_list);
 
 static void netvsc_change_rx_flags(struct net_device *net, int change)
@@ -242,43 +253,32 @@ static inline void *init_ppi_data(struct rndis_message *msg,
 	return ppi + 1;
 }
 
-union sub_key {
-	u64 k;
-	struct {
-		u8 pad[3];
-		u8 kb;
-		u32 ka;
-	};
-};
+/* Toeplitz table for netvsc_hash_key, built at module load */
+static struct netvsc_toeplitz netvsc_default_hash;
 
-/* Toeplitz hash function
- * data: network byte order
- * return: host byte order
+/*
+ * Switch the transmit hash to a new RSS key. Devices using the default key
+ * share netvsc_default_hash, others get a table of their own.
  */
-static u32 comp_hash(u8 *key, int klen, void *data, int dlen)
-{
-	union sub_key subk;
-	int k_next = 4;
-	u8 dt;
-	int i, j;
-	u32 ret = 0;
-
-	subk.k = 0;
-	subk.ka = ntohl(*(u32 *)key);
-
-	for (i = 0; i < dlen; i++) {
-		subk.kb = key[k_next];
-		k_next = (k_next + 1) % klen;
-		dt = ((u8 *)data)[i];
-		for (j = 0; j < 8; j++) {
-			if (dt & 0x80)
-				ret ^= subk.ka;
-			dt <<= 1;
-			subk.k <<= 1;
-		}
+void netvsc_set_tx_hash_key(struct net_device *ndev, const u8 *key)
+{
+	struct net_device_context *ndc = netdev_priv(ndev);
+	struct netvsc_toeplitz *new = NULL, *old;
+
+	if (memcmp(key, netvsc_hash_key, NETVSC_HASH_KEYLEN)) {
+		new = vmalloc(sizeof(*new));
+		if (!new)
+			netdev_warn(ndev, "using default key for tx hash\n");
+		else
+			netvsc_toeplitz_init(new, key);
 	}
 
-	return ret;
+	old = rcu_dereference_protected(ndc->tx_hash, true);
+	rcu_assign_pointer(ndc->tx_hash, new);
+	if (old) {
+		synchronize_rcu();
+		vfree(old);
+	}
 }
 
 /* Continue using Toeplitz hash function.
@@ -286,7 +286,8 @@ static u32 comp_hash(u8 *key, int klen, void *data, int dlen)
  * See more info from this upstream commit:
  * 757647e10e55c01fb7a9c4356529442e316a7c72
  */
-bool netvsc_set_hash(u32 *hash, struct sk_buff *skb)
+static bool netvsc_tx_hash(const struct netvsc_toeplitz *t,
+			   u32 *hash, struct sk_buff *skb)
 {
 	struct iphdr *iphdr;
 	struct ipv6hdr *ipv6hdr;
@@ -321,11 +322,16 @@ bool netvsc_set_hash(u32 *hash, struct sk_buff *skb)
 		return false;
 	}
 
-	*hash = comp_hash(netvsc_hash_key, HASH_KEYLEN, dbuf, data_len);
+	*hash = netvsc_toeplitz_hash(t, dbuf, data_len);
 
 	return true;
 }
 
+bool netvsc_set_hash(u32 *hash, struct sk_buff *skb)
+{
+	return netvsc_tx_hash(&netvsc_default_hash, hash, skb);
+}
+
 // skb_get_hash() will include UDP port numbers into hash computation,
 // which causes UDP loss problem. Comment this out for now.
 #ifdef NOTYET
@@ -351,13 +357,15 @@ static inline int netvsc_get_tx_queue(struct net_device *ndev,
 static u16 netvsc_pick_tx(struct net_device *ndev, struct sk_buff *skb)
 {
 	struct net_device_context *net_device_ctx = netdev_priv(ndev);
+	const struct netvsc_toeplitz *t;
 	u32 hash;
 	u16 q_idx = 0;
 
 	if (ndev->real_num_tx_queues <= 1)
 		return 0;
 
-	if (netvsc_set_hash(&hash, skb)) {
+	t = rcu_dereference(net_device_ctx->tx_hash) ? : &netvsc_default_hash;
+	if (netvsc_tx_hash(t, &hash, skb)) {
 		q_idx = net_device_ctx->tx_table[hash % VRSS_SEND_TAB_SIZE] %
 			ndev->real_num_tx_queues;
 		skb_set_hash(skb, hash, PKT_HASH_TYPE_L3);
@@ -584,6 +592,27 @@ static int netvsc_vf_xmit(struct net_device *net, struct net_device *vf_netdev,
 	return rc;
 }
 
+/*
+ * skb->next is cleared before the driver is called, so it hardly ever
+ * says more is coming. Packets still backlogged in this queue's qdisc are
+ * handed over right after this one though, which is what xmit_more means,
+ * unless the queue gets stopped or the qdisc run yields the CPU first.
+ * netvsc_send() arms a flush timer in case they are not.
+ */
+static bool netvsc_xmit_more(struct net_device *net, struct sk_buff *skb)
+{
+#if (RHEL_RELEASE_CODE <= RHEL_RELEASE_VERSION(7,1))
+	struct netdev_queue *txq
+		= netdev_get_tx_queue(net, skb_get_queue_mapping(skb));
+	struct Qdisc *q = rcu_dereference_bh(txq->qdisc);
+
+	if (q && qdisc_qlen(q) > 0 && !netif_xmit_stopped(txq) &&
+	    !need_resched())
+		return true;
+#endif
+	return skb->next != NULL;
+}
+
 static int netvsc_start_xmit(struct sk_buff *skb, struct net_device *net)
 {
 	struct net_device_context *net_device_ctx = netdev_priv(net);
@@ -601,8 +630,11 @@ static int netvsc_start_xmit(struct sk_buff *skb, struct net_device *net)
 	 */
 	vf_netdev = rcu_dereference_bh(net_device_ctx->vf_netdev);
 	if (vf_netdev && netif_running(vf_netdev) &&
-	    !netpoll_tx_running(net))
+	    !netpoll_tx_running(net)) {
+		/* Don't strand what the synthetic path still holds */
+		netvsc_send_flush(net, skb_get_queue_mapping(skb));
 		return netvsc_vf_xmit(net, vf_netdev, skb);
+	}
 
 	/* We will atmost need two pages to describe the rndis
 	 * header. We can only transmit MAX_PAGE_BUFFER_COUNT number
@@ -639,11 +671,7 @@ static int netvsc_start_xmit(struct sk_buff *skb, struct net_device *net)
 			FIELD_SIZEOF(struct sk_buff, cb));
 	packet = (struct hv_netvsc_packet *)skb->cb;
 
-	/* TODO: This will likely evaluate to false, since RH7 and
-	 * below kernels will set next pointer to NULL before calling
-	 * into here. Should find another way to set this flag.
-	 */
-	packet->xmit_more = (skb->next != NULL);
+	packet->xmit_more = netvsc_xmit_more(net, skb);
 
 	packet->q_idx = skb_get_queue_mapping(skb);
 
@@ -777,6 +805,9 @@ static int netvsc_start_xmit(struct sk_buff *skb, struct net_device *net)
 		++net_device_ctx->eth_stats.tx_no_space;
 
 drop:
+	/* The dropped packet may have been the one to end the batch */
+	netvsc_send_flush(net, skb_get_queue_mapping(skb));
+
 	dev_kfree_skb_any(skb);
 	net->stats.tx_dropped++;
 
@@ -829,28 +860,164 @@ void netvsc_linkstatus_callback(struct net_device *net,
 	schedule_delayed_work(&ndev_ctx->dwork, 0);
 }
 
-static struct sk_buff *netvsc_alloc_recv_skb(struct net_device *net,
-					     struct napi_struct *napi,
-					     const struct ndis_tcp_ip_checksum_info *csum_info,
-					     const struct ndis_pkt_8021q_info *vlan,
-					     void *data, u32 buflen)
+/* Pages of recv_buf that len bytes at data fill completely */
+static u32 netvsc_recv_full_pages(const void *data, u32 len)
 {
-	struct sk_buff *skb;
+	unsigned long start = PAGE_ALIGN((unsigned long)data);
+	unsigned long end = ((unsigned long)data + len) & PAGE_MASK;
 
-#if (RHEL_RELEASE_CODE > RHEL_RELEASE_VERSION(7,1))
-	skb = napi_alloc_skb(napi, buflen);
-#else
-	skb = netdev_alloc_skb_ip_align(net, buflen);
-#endif
-	if (!skb)
-		return skb;
+	return end > start ? (end - start) >> PAGE_SHIFT : 0;
+}
 
-	/*
-	 * Copy to skb. This copy is needed here since the memory pointed by
-	 * hv_netvsc_packet cannot be deallocated
-	 */
-	memcpy(skb_put(skb, buflen), data, buflen);
+/*
+ * Check whether the pieces of a frame, less the skip bytes of headers
+ * copied from the first one, can be left in the receive buffer: some page
+ * must be filled by them, and the fragments and page runs that takes must
+ * fit. The partial pages at either end of a piece are shared with other
+ * sections and are copied, each piece adding at most two fragments.
+ */
+static bool netvsc_recv_zc_fits(const struct recv_comp_deferred *zc,
+				void * const *data, const u32 *len, u32 cnt,
+				u32 skip)
+{
+	u32 i, n, pages = 0, spans = 0;
+
+	for (i = 0; i < cnt; i++) {
+		n = netvsc_recv_full_pages(data[i] + (i ? 0 : skip),
+					   len[i] - (i ? 0 : skip));
+		pages += n;
+		spans += n ? 1 : 0;
+	}
+
+	return pages && pages + 2 * cnt <= MAX_SKB_FRAGS &&
+		zc->nspans + spans <= NETVSC_RX_ZC_SPANS;
+}
+
+/*
+ * Decide whether a frame can be left in the receive buffer. The frame must
+ * be worth it, and its payload past the copied headers must fit in the
+ * skb fragments.
+ */
+static bool netvsc_recv_in_place(struct net_device *net,
+				 struct multi_recv_comp *mrc,
+				 void *data, u32 buflen)
+{
+	struct net_device_context *ndev_ctx = netdev_priv(net);
+
+	if (!READ_ONCE(rx_zerocopy) || buflen <= NETVSC_RX_PULL ||
+	    buflen <= READ_ONCE(rx_copybreak))
+		return false;
+
+	if (unlikely(!mrc->zc)) {
+		++ndev_ctx->eth_stats.rx_zc_full;
+		return false;
+	}
+
+	return netvsc_recv_zc_fits(mrc->zc, &data, &buflen, 1,
+				   NETVSC_RX_PULL);
+}
+
+/* Page the bytes copied for a frame received in place go to */
+struct netvsc_recv_copy {
+	struct page *page;
+	u32 used;
+};
+
+/*
+ * Copy bytes of a page shared with other sections into a fragment of the
+ * skb's own, appending to the previous one where they follow it.
+ */
+static int netvsc_recv_copy_frag(struct sk_buff *skb,
+				 struct netvsc_recv_copy *cp,
+				 const void *data, u32 len)
+{
+	struct skb_shared_info *shinfo = skb_shinfo(skb);
+	skb_frag_t *last = NULL;
+
+	if (!len)
+		return 0;
+
+	if (shinfo->nr_frags)
+		last = &shinfo->frags[shinfo->nr_frags - 1];
+
+	if (!cp->page || cp->used + len > PAGE_SIZE) {
+		cp->page = alloc_page(GFP_ATOMIC);
+		if (!cp->page)
+			return -ENOMEM;
+
+		cp->used = 0;
+		skb_add_rx_frag(skb, shinfo->nr_frags, cp->page, 0, len,
+				PAGE_SIZE);
+	} else if (last && skb_frag_page(last) == cp->page &&
+		   last->page_offset + skb_frag_size(last) == cp->used) {
+		skb_frag_size_add(last, len);
+		skb->len += len;
+		skb->data_len += len;
+	} else {
+		get_page(cp->page);
+		skb_add_rx_frag(skb, shinfo->nr_frags, cp->page, cp->used,
+				len, 0);
+	}
+
+	memcpy(page_address(cp->page) + cp->used, data, len);
+	cp->used += len;
+
+	return 0;
+}
+
+/*
+ * Attach a piece of a frame to the skb. The recv_buf pages it fills are
+ * referenced as fragments and recorded as a page run the receive
+ * completion has to wait for; the bytes on partial pages are copied, so
+ * that no page the completion waits for carries another frame.
+ */
+static int netvsc_recv_attach_pages(struct netvsc_device *nvdev,
+				    struct recv_comp_deferred *zc,
+				    struct sk_buff *skb,
+				    struct netvsc_recv_copy *cp,
+				    void *data, u32 len)
+{
+	void *start = PTR_ALIGN(data, PAGE_SIZE);
+	void *end = (void *)((unsigned long)(data + len) & PAGE_MASK);
+	struct recv_comp_span *span;
+	u32 first, last;
+	void *p;
+	int ret;
+
+	if (end <= start)
+		return netvsc_recv_copy_frag(skb, cp, data, len);
+
+	ret = netvsc_recv_copy_frag(skb, cp, data, start - data);
+	if (ret)
+		return ret;
+
+	for (p = start; p < end; p += PAGE_SIZE) {
+		struct page *page = vmalloc_to_page(p);
+
+		get_page(page);
+		skb_add_rx_frag(skb, skb_shinfo(skb)->nr_frags, page, 0,
+				PAGE_SIZE, PAGE_SIZE);
+	}
 
+	first = (start - nvdev->recv_buf) >> PAGE_SHIFT;
+	last = ((end - nvdev->recv_buf) >> PAGE_SHIFT) - 1;
+	span = zc->nspans ? &zc->span[zc->nspans - 1] : NULL;
+	if (span && span->last + 1 == first) {
+		span->last = last;
+	} else {
+		span = &zc->span[zc->nspans++];
+		span->first = first;
+		span->last = last;
+	}
+
+	return netvsc_recv_copy_frag(skb, cp, end, data + len - end);
+}
+
+/* Apply what the host told about a received frame */
+static void netvsc_recv_skb_setup(struct net_device *net, struct sk_buff *skb,
+				  const struct ndis_tcp_ip_checksum_info *csum_info,
+				  const struct ndis_pkt_8021q_info *vlan)
+{
 	skb->protocol = eth_type_trans(skb, net);
 
 	/* skb is already created with CHECKSUM_NONE */
@@ -872,10 +1039,308 @@ static struct sk_buff *netvsc_alloc_recv_skb(struct net_device *net,
 		__vlan_hwaccel_put_tag(skb, htons(ETH_P_8021Q),
 				       vlan_tci);
 	}
+}
+
+static struct sk_buff *netvsc_alloc_recv_skb(struct net_device *net,
+					     struct netvsc_device *nvdev,
+					     struct netvsc_channel *nvchan,
+					     const struct ndis_tcp_ip_checksum_info *csum_info,
+					     const struct ndis_pkt_8021q_info *vlan,
+					     void *data, u32 buflen)
+{
+	struct netvsc_recv_copy cp = { NULL, 0 };
+	u32 hlen = buflen;
+	struct sk_buff *skb;
+
+	/* Large frames stay where the host put them, only the headers
+	 * are copied.
+	 */
+	if (netvsc_recv_in_place(net, &nvchan->mrc, data, buflen))
+		hlen = NETVSC_RX_PULL;
+
+#if (RHEL_RELEASE_CODE > RHEL_RELEASE_VERSION(7,1))
+	skb = napi_alloc_skb(&nvchan->napi, hlen);
+#else
+	skb = netdev_alloc_skb_ip_align(net, hlen);
+#endif
+	if (!skb)
+		return skb;
+
+	/*
+	 * Copy to skb. This copy is needed here since the memory pointed by
+	 * hv_netvsc_packet cannot be deallocated
+	 */
+	memcpy(skb_put(skb, hlen), data, hlen);
+
+	if (hlen < buflen &&
+	    netvsc_recv_attach_pages(nvdev, nvchan->mrc.zc, skb, &cp,
+				     data + hlen, buflen - hlen)) {
+		dev_kfree_skb_any(skb);
+		return NULL;
+	}
+
+	netvsc_recv_skb_setup(net, skb, csum_info, vlan);
 
 	return skb;
 }
 
+/*
+ * Build the skb for a frame the host coalesced. Its pieces stay in the
+ * receive buffer when their pages fit in the skb fragments, otherwise
+ * they are copied into one linear skb.
+ */
+static struct sk_buff *netvsc_alloc_rsc_skb(struct net_device *net,
+					    struct netvsc_device *nvdev,
+					    struct netvsc_channel *nvchan,
+					    const struct netvsc_rsc *rsc)
+{
+	struct recv_comp_deferred *zc = nvchan->mrc.zc;
+	u32 hlen = min_t(u32, rsc->len[0], NETVSC_RX_PULL);
+	struct netvsc_recv_copy cp = { NULL, 0 };
+	bool in_place;
+	struct sk_buff *skb;
+	u32 i;
+
+	in_place = READ_ONCE(rx_zerocopy) && zc &&
+		   netvsc_recv_zc_fits(zc, rsc->data, rsc->len, rsc->cnt,
+				       hlen);
+
+#if (RHEL_RELEASE_CODE > RHEL_RELEASE_VERSION(7,1))
+	skb = napi_alloc_skb(&nvchan->napi, in_place ? hlen : rsc->pktlen);
+#else
+	skb = netdev_alloc_skb_ip_align(net, in_place ? hlen : rsc->pktlen);
+#endif
+	if (!skb)
+		return skb;
+
+	memcpy(skb_put(skb, hlen), rsc->data[0], hlen);
+
+	for (i = 0; i < rsc->cnt; i++) {
+		void *data = rsc->data[i] + (i ? 0 : hlen);
+		u32 len = rsc->len[i] - (i ? 0 : hlen);
+
+		if (!len)
+			continue;
+
+		if (!in_place) {
+			memcpy(skb_put(skb, len), data, len);
+		} else if (netvsc_recv_attach_pages(nvdev, zc, skb, &cp,
+						    data, len)) {
+			dev_kfree_skb_any(skb);
+			return NULL;
+		}
+	}
+
+	return skb;
+}
+
+/*
+ * Find the TCP header of a frame software LRO could merge: a checksummed
+ * IPv4 or IPv6 TCP data segment without IP options or extension headers
+ * and with no TCP flags other than ACK and PSH.
+ */
+static struct tcphdr *netvsc_lro_tcp(struct sk_buff *skb, u32 *nhlen,
+				     u32 *payload)
+{
+	struct tcphdr *th;
+	u32 thlen;
+
+	if (skb->ip_summed != CHECKSUM_UNNECESSARY)
+		return NULL;
+
+	if (skb->protocol == htons(ETH_P_IP)) {
+		const struct iphdr *iph = (const struct iphdr *)skb->data;
+
+		*nhlen = sizeof(struct iphdr);
+		if (skb_headlen(skb) < *nhlen || iph->ihl != 5 ||
+		    iph->protocol != IPPROTO_TCP || ip_is_fragment(iph) ||
+		    ntohs(iph->tot_len) != skb->len)
+			return NULL;
+	} else if (skb->protocol == htons(ETH_P_IPV6)) {
+		const struct ipv6hdr *ip6h = (const struct ipv6hdr *)skb->data;
+
+		*nhlen = sizeof(struct ipv6hdr);
+		if (skb_headlen(skb) < *nhlen || ip6h->nexthdr != IPPROTO_TCP ||
+		    ntohs(ip6h->payload_len) + *nhlen != skb->len)
+			return NULL;
+	} else {
+		return NULL;
+	}
+
+	if (skb_headlen(skb) < *nhlen + sizeof(struct tcphdr))
+		return NULL;
+
+	th = (struct tcphdr *)(skb->data + *nhlen);
+	thlen = th->doff * 4;
+	if (thlen < sizeof(struct tcphdr) || skb_headlen(skb) < *nhlen + thlen)
+		return NULL;
+
+	if (!th->ack || th->syn || th->fin || th->rst || th->urg ||
+	    th->ece || th->cwr)
+		return NULL;
+
+	*payload = skb->len - *nhlen - thlen;
+	return *payload ? th : NULL;
+}
+
+/* Check that skb continues the flow being merged, right where it left off */
+static bool netvsc_lro_match(const struct netvsc_rx_lro *lro,
+			     const struct sk_buff *skb,
+			     const struct tcphdr *th, u32 payload)
+{
+	const struct sk_buff *p = lro->skb;
+	const struct tcphdr *pth = (const struct tcphdr *)(p->data + lro->nhlen);
+
+	if (p->protocol != skb->protocol || p->vlan_tci != skb->vlan_tci)
+		return false;
+
+	if (skb->protocol == htons(ETH_P_IP)) {
+		const struct iphdr *piph = (const struct iphdr *)p->data;
+		const struct iphdr *iph = (const struct iphdr *)skb->data;
+
+		if (piph->saddr != iph->saddr || piph->daddr != iph->daddr ||
+		    piph->tos != iph->tos)
+			return false;
+	} else {
+		const struct ipv6hdr *pip6h = (const struct ipv6hdr *)p->data;
+		const struct ipv6hdr *ip6h = (const struct ipv6hdr *)skb->data;
+
+		/* version, traffic class and flow label */
+		if (*(const __be32 *)pip6h != *(const __be32 *)ip6h ||
+		    ipv6_addr_cmp(&pip6h->saddr, &ip6h->saddr) ||
+		    ipv6_addr_cmp(&pip6h->daddr, &ip6h->daddr))
+			return false;
+	}
+
+	/* Only the last segment may be short or carry PSH */
+	if (pth->psh || payload > lro->mss ||
+	    lro->segs * lro->mss != lro->next_seq - ntohl(pth->seq))
+		return false;
+
+	if (pth->source != th->source || pth->dest != th->dest ||
+	    ntohl(th->seq) != lro->next_seq || th->doff != pth->doff ||
+	    memcmp(pth + 1, th + 1, th->doff * 4 - sizeof(struct tcphdr)))
+		return false;
+
+	/* The merged length has to fit the IP length field */
+	return p->len + payload <= 0xffff;
+}
+
+/* Chain the payload of skb to the merged frame, the way GRO does */
+static void netvsc_lro_merge(struct netvsc_rx_lro *lro, struct sk_buff *skb,
+			     const struct tcphdr *th, u32 payload)
+{
+	struct sk_buff *p = lro->skb;
+	struct tcphdr *pth = (struct tcphdr *)(p->data + lro->nhlen);
+
+	skb_pull(skb, skb->len - payload);
+
+	if (lro->last)
+		lro->last->next = skb;
+	else
+		skb_shinfo(p)->frag_list = skb;
+	lro->last = skb;
+
+	p->len += payload;
+	p->data_len += payload;
+	p->truesize += skb->truesize;
+
+	pth->ack_seq = th->ack_seq;
+	pth->window = th->window;
+	pth->psh = th->psh;
+
+	lro->next_seq += payload;
+	lro->segs++;
+}
+
+/* Hand the frame being merged to GRO, fixing up its headers first */
+void netvsc_lro_flush(struct netvsc_channel *nvchan)
+{
+	struct netvsc_rx_lro *lro = &nvchan->lro;
+	struct sk_buff *p = lro->skb;
+
+	if (!p)
+		return;
+	lro->skb = NULL;
+
+	if (lro->segs > 1) {
+		if (p->protocol == htons(ETH_P_IP)) {
+			struct iphdr *iph = (struct iphdr *)p->data;
+
+			iph->tot_len = htons(p->len);
+			ip_send_check(iph);
+			skb_shinfo(p)->gso_type = SKB_GSO_TCPV4;
+		} else {
+			struct ipv6hdr *ip6h = (struct ipv6hdr *)p->data;
+
+			ip6h->payload_len = htons(p->len - lro->nhlen);
+			skb_shinfo(p)->gso_type = SKB_GSO_TCPV6;
+		}
+		skb_shinfo(p)->gso_size = lro->mss;
+		skb_shinfo(p)->gso_segs = lro->segs;
+	}
+
+	napi_gro_receive(&nvchan->napi, p);
+}
+
+/*
+ * Bulk TCP transfers often get several segments of a flow in one transfer
+ * page packet. Merging them here saves GRO and the stack most of the per
+ * segment work when the host does not coalesce them itself. Whatever is
+ * merged is flushed when the transfer page packet has been walked.
+ */
+static void netvsc_lro_receive(struct net_device *net,
+			       struct netvsc_channel *nvchan,
+			       struct sk_buff *skb)
+{
+	struct netvsc_rx_lro *lro = &nvchan->lro;
+	struct tcphdr *th = NULL;
+	u32 nhlen, payload;
+
+	if (net->features & NETIF_F_LRO)
+		th = netvsc_lro_tcp(skb, &nhlen, &payload);
+
+	if (th && lro->skb && netvsc_lro_match(lro, skb, th, payload)) {
+		netvsc_lro_merge(lro, skb, th, payload);
+		return;
+	}
+
+	netvsc_lro_flush(nvchan);
+
+	if (th && !th->psh) {
+		lro->skb = skb;
+		lro->last = NULL;
+		lro->next_seq = ntohl(th->seq) + payload;
+		lro->nhlen = nhlen;
+		lro->mss = payload;
+		lro->segs = 1;
+		return;
+	}
+
+	napi_gro_receive(&nvchan->napi, skb);
+}
+
+/*
+ * Even if injecting the packet, record the statistics
+ * on the synthetic device because modifying the VF device
+ * statistics will not work correctly.
+ */
+static void netvsc_count_rx(struct netvsc_channel *nvchan,
+			    const struct sk_buff *skb, u32 len)
+{
+	struct netvsc_stats *rx_stats = &nvchan->rx_stats;
+
+	u64_stats_update_begin(&rx_stats->syncp);
+	rx_stats->packets++;
+	rx_stats->bytes += len;
+
+	if (skb->pkt_type == PACKET_BROADCAST)
+		++rx_stats->broadcast;
+	else if (skb->pkt_type == PACKET_MULTICAST)
+		++rx_stats->multicast;
+	u64_stats_update_end(&rx_stats->syncp);
+}
+
 /*
  * netvsc_recv_callback -  Callback when we receive a packet from the
  * "wire" on the specified device.
@@ -891,13 +1356,12 @@ int netvsc_recv_callback(struct net_device *net,
 	u16 q_idx = channel->offermsg.offer.sub_channel_index;
 	struct netvsc_channel *nvchan = &net_device->chan_table[q_idx];
 	struct sk_buff *skb;
-	struct netvsc_stats *rx_stats;
 
 	if (net->reg_state != NETREG_REGISTERED)
 		return NVSP_STAT_FAIL;
 
-	/* Allocate a skb - TODO direct I/O to pages? */
-	skb = netvsc_alloc_recv_skb(net, &nvchan->napi,
+	/* Allocate a skb, large frames are received in place */
+	skb = netvsc_alloc_recv_skb(net, net_device, nvchan,
 				    csum_info, vlan, data, len);
 	if (unlikely(!skb)) {
 		++net_device_ctx->eth_stats.rx_no_memory;
@@ -906,23 +1370,60 @@ int netvsc_recv_callback(struct net_device *net,
 	}
 
 	skb_record_rx_queue(skb, q_idx);
+	netvsc_count_rx(nvchan, skb, len);
 
-	/*
-	 * Even if injecting the packet, record the statistics
-	 * on the synthetic device because modifying the VF device
-	 * statistics will not work correctly.
-	 */
-	rx_stats = &nvchan->rx_stats;
-	u64_stats_update_begin(&rx_stats->syncp);
-	rx_stats->packets++;
-	rx_stats->bytes += len;
+	netvsc_lro_receive(net, nvchan, skb);
+	return NVSP_STAT_SUCCESS;
+}
 
-	if (skb->pkt_type == PACKET_BROADCAST)
-		++rx_stats->broadcast;
-	else if (skb->pkt_type == PACKET_MULTICAST)
-		++rx_stats->multicast;
-	u64_stats_update_end(&rx_stats->syncp);
+/*
+ * Pass up a frame the host coalesced from several TCP segments. The host
+ * does not say how large the segments were, so full sized ones are
+ * assumed, which is what bulk transfers send and keeps TCP's estimate of
+ * the peer's MSS right.
+ */
+int netvsc_recv_rsc(struct net_device *net,
+		    struct netvsc_device *nvdev,
+		    struct vmbus_channel *channel,
+		    const struct netvsc_rsc *rsc)
+{
+	struct net_device_context *net_device_ctx = netdev_priv(net);
+	u16 q_idx = channel->offermsg.offer.sub_channel_index;
+	struct netvsc_channel *nvchan = &nvdev->chan_table[q_idx];
+	struct tcphdr *th;
+	struct sk_buff *skb;
+	u32 nhlen, payload, mss;
+
+	if (net->reg_state != NETREG_REGISTERED)
+		return NVSP_STAT_FAIL;
+
+	skb = netvsc_alloc_rsc_skb(net, nvdev, nvchan, rsc);
+	if (unlikely(!skb)) {
+		++net_device_ctx->eth_stats.rx_no_memory;
+		return NVSP_STAT_FAIL;
+	}
+
+	netvsc_recv_skb_setup(net, skb, rsc->csum_info, rsc->vlan);
+	skb_record_rx_queue(skb, q_idx);
 
+	th = netvsc_lro_tcp(skb, &nhlen, &payload);
+	if (th) {
+		mss = net->mtu - nhlen - th->doff * 4;
+		if (payload > mss) {
+			skb_shinfo(skb)->gso_size = mss;
+			skb_shinfo(skb)->gso_segs = DIV_ROUND_UP(payload, mss);
+			skb_shinfo(skb)->gso_type =
+				skb->protocol == htons(ETH_P_IP) ?
+				SKB_GSO_TCPV4 : SKB_GSO_TCPV6;
+		}
+	}
+
+	netvsc_count_rx(nvchan, skb, rsc->pktlen);
+
+	/* Already coalesced, so it only has to stay behind what software
+	 * LRO is holding.
+	 */
+	netvsc_lro_flush(nvchan);
 	napi_gro_receive(&nvchan->napi, skb);
 	return NVSP_STAT_SUCCESS;
 }
@@ -1025,6 +1526,56 @@ static int netvsc_attach(struct net_device *ndev,
 	return 0;
 }
 
+/*
+ * Close and reopen all channels keeping the net device, e.g. to apply new
+ * VMBus ring buffer sizes.
+ */
+static int netvsc_reopen(struct hv_device *dev)
+{
+	struct net_device *net = hv_get_drvdata(dev);
+	struct net_device_context *ndev_ctx;
+	struct netvsc_device_info device_info;
+	struct netvsc_device *nvdev;
+	int ret;
+
+	if (!net)
+		return -ENODEV;
+
+	rtnl_lock();
+	ndev_ctx = netdev_priv(net);
+	nvdev = rtnl_dereference(ndev_ctx->nvdev);
+
+	memset(&device_info, 0, sizeof(device_info));
+	if (nvdev) {
+		if (nvdev->destroy) {
+			ret = -ENODEV;
+			goto out;
+		}
+
+		device_info.num_chn = nvdev->num_chn;
+		device_info.send_sections = nvdev->send_section_cnt;
+		device_info.send_section_size = nvdev->send_section_size;
+		device_info.recv_sections = nvdev->recv_section_cnt;
+		device_info.recv_section_size = nvdev->recv_section_size;
+
+		ret = netvsc_detach(net, nvdev);
+		if (ret)
+			goto out;
+	} else {
+		/* An earlier reopen failed to attach, start over */
+		device_info.num_chn = VRSS_CHANNEL_DEFAULT;
+		device_info.send_sections = NETVSC_DEFAULT_TX;
+		device_info.send_section_size = NETVSC_SEND_SECTION_SIZE;
+		device_info.recv_sections = NETVSC_DEFAULT_RX;
+		device_info.recv_section_size = NETVSC_RECV_SECTION_SIZE;
+	}
+
+	ret = netvsc_attach(net, &device_info);
+out:
+	rtnl_unlock();
+	return ret;
+}
+
 static int netvsc_set_channels(struct net_device *net,
 			       struct ethtool_channels *channels)
 {
@@ -1094,6 +1645,7 @@ static void netvsc_init_settings(struct net_device *dev)
 
 	ndc->speed = SPEED_UNKNOWN;
 	ndc->duplex = DUPLEX_FULL;
+	ndc->rx_coalesce_frames = 1;
 }
 
 static int netvsc_get_settings(struct net_device *dev, struct ethtool_cmd *cmd)
@@ -1417,7 +1969,9 @@ static const struct {
 	{ "tx_busy",	  offsetof(struct netvsc_ethtool_stats, tx_busy) },
 	{ "tx_send_full", offsetof(struct netvsc_ethtool_stats, tx_send_full) },
 	{ "rx_comp_busy", offsetof(struct netvsc_ethtool_stats, rx_comp_busy) },
+	{ "rx_comp_writes", offsetof(struct netvsc_ethtool_stats, rx_comp_writes) },
 	{ "rx_no_memory", offsetof(struct netvsc_ethtool_stats, rx_no_memory) },
+	{ "rx_zc_full", offsetof(struct netvsc_ethtool_stats, rx_zc_full) },
 	{ "stop_queue", offsetof(struct netvsc_ethtool_stats, stop_queue) },
 	{ "wake_queue", offsetof(struct netvsc_ethtool_stats, wake_queue) },
 }, pcpu_stats[] = {
@@ -1794,6 +2348,41 @@ static int netvsc_set_ringparam(struct net_device *ndev,
 	return ret;
 }
 
+/*
+ * Receive interrupt moderation: how long NAPI keeps host interrupts masked
+ * once a poll has drained the ring, and how many packets that poll must
+ * have drained for the wait to be worth it.
+ */
+static int netvsc_get_coalesce(struct net_device *ndev,
+			       struct ethtool_coalesce *ec)
+{
+	struct net_device_context *ndev_ctx = netdev_priv(ndev);
+
+	ec->rx_coalesce_usecs = ndev_ctx->rx_coalesce_usecs;
+	ec->rx_max_coalesced_frames = ndev_ctx->rx_coalesce_frames;
+	ec->use_adaptive_rx_coalesce = ndev_ctx->rx_coalesce_adaptive;
+
+	return 0;
+}
+
+static int netvsc_set_coalesce(struct net_device *ndev,
+			       struct ethtool_coalesce *ec)
+{
+	struct net_device_context *ndev_ctx = netdev_priv(ndev);
+
+	if (ec->rx_coalesce_usecs > NETVSC_RX_USECS_MAX ||
+	    ec->rx_max_coalesced_frames > NAPI_POLL_WEIGHT)
+		return -EINVAL;
+
+	WRITE_ONCE(ndev_ctx->rx_coalesce_usecs, ec->rx_coalesce_usecs);
+	WRITE_ONCE(ndev_ctx->rx_coalesce_frames,
+		   max(ec->rx_max_coalesced_frames, 1U));
+	WRITE_ONCE(ndev_ctx->rx_coalesce_adaptive,
+		   !!ec->use_adaptive_rx_coalesce);
+
+	return 0;
+}
+
 static u32 netvsc_get_msglevel(struct net_device *ndev)
 {
 	struct net_device_context *ndev_ctx = netdev_priv(ndev);
@@ -1830,8 +2419,49 @@ static const struct ethtool_ops ethtool_ops = {
 #endif
 	.get_ringparam	= netvsc_get_ringparam,
 	.set_ringparam	= netvsc_set_ringparam,
+	.get_coalesce	= netvsc_get_coalesce,
+	.set_coalesce	= netvsc_set_coalesce,
 };
 
+/* Receive segment coalescing on the host follows the LRO feature */
+static int netvsc_set_features(struct net_device *ndev,
+			       netdev_features_t features)
+{
+	netdev_features_t change = features ^ ndev->features;
+	struct net_device_context *ndevctx = netdev_priv(ndev);
+	struct netvsc_device *nvdev = rtnl_dereference(ndevctx->nvdev);
+	struct ndis_offload_params offloads;
+
+	if (!nvdev || nvdev->destroy)
+		return -ENODEV;
+
+	if (!(change & NETIF_F_LRO))
+		return 0;
+
+#if (RHEL_RELEASE_CODE >= RHEL_RELEASE_VERSION(7,6))
+	/* XDP programs only see single buffer frames */
+	if ((features & NETIF_F_LRO) && rtnl_dereference(ndevctx->xdp_prog)) {
+		netdev_err(ndev, "LRO cannot be enabled with XDP\n");
+		return -EOPNOTSUPP;
+	}
+#endif
+
+	if (!nvdev->rsc_offload)
+		return 0;
+
+	memset(&offloads, 0, sizeof(struct ndis_offload_params));
+
+	if (features & NETIF_F_LRO) {
+		offloads.rsc_ip_v4 = NDIS_OFFLOAD_PARAMETERS_RSC_ENABLED;
+		offloads.rsc_ip_v6 = NDIS_OFFLOAD_PARAMETERS_RSC_ENABLED;
+	} else {
+		offloads.rsc_ip_v4 = NDIS_OFFLOAD_PARAMETERS_RSC_DISABLED;
+		offloads.rsc_ip_v6 = NDIS_OFFLOAD_PARAMETERS_RSC_DISABLED;
+	}
+
+	return rndis_filter_set_offload_params(ndev, nvdev, &offloads);
+}
+
 static const struct net_device_ops device_ops = {
 	.ndo_open =			netvsc_open,
 	.ndo_stop =			netvsc_close,
@@ -1844,12 +2474,17 @@ static const struct net_device_ops device_ops = {
 	.ndo_change_mtu_rh74 =		netvsc_change_mtu,
 #endif
 	.ndo_validate_addr =		eth_validate_addr,
+	.ndo_set_features =		netvsc_set_features,
 	.ndo_set_mac_address =		netvsc_set_mac_addr,
 	.ndo_select_queue =		netvsc_select_queue,
 	.ndo_get_stats64 =		netvsc_get_stats64,
 #ifdef CONFIG_NET_POLL_CONTROLLER
 	.ndo_poll_controller =		netvsc_poll_controller,
 #endif
+#if (RHEL_RELEASE_CODE >= RHEL_RELEASE_VERSION(7,6))
+	.ndo_size =			sizeof(struct net_device_ops),
+	.extended.ndo_bpf =		netvsc_bpf,
+#endif
 };
 
 /*
@@ -2173,6 +2808,15 @@ static int netvsc_register_vf(struct net_device *vf_netdev)
 
 	dev_hold(vf_netdev);
 	rcu_assign_pointer(net_device_ctx->vf_netdev, vf_netdev);
+
+#if (RHEL_RELEASE_CODE >= RHEL_RELEASE_VERSION(7,6))
+	/* Carry the XDP program over to the VF */
+	if (rtnl_dereference(net_device_ctx->xdp_prog) &&
+	    netvsc_vf_setxdp(vf_netdev,
+			     rtnl_dereference(net_device_ctx->xdp_prog)))
+		netdev_warn(ndev, "unable to set XDP program on VF %s\n",
+			    vf_netdev->name);
+#endif
 	return NOTIFY_OK;
 }
 
@@ -2214,6 +2858,11 @@ static int netvsc_unregister_vf(struct net_device *vf_netdev)
 
 	netdev_info(ndev, "VF unregistering: %s\n", vf_netdev->name);
 
+#if (RHEL_RELEASE_CODE >= RHEL_RELEASE_VERSION(7,6))
+	if (rtnl_dereference(net_device_ctx->xdp_prog))
+		netvsc_vf_setxdp(vf_netdev, NULL);
+#endif
+
 	netdev_rx_handler_unregister(vf_netdev);
 	netdev_upper_dev_unlink(vf_netdev, ndev);
 	RCU_INIT_POINTER(net_device_ctx->vf_netdev, NULL);
@@ -2326,6 +2975,7 @@ register_failed:
 	rndis_filter_device_remove(dev, nvdev);
 rndis_failed:
 	free_percpu(net_device_ctx->vf_stats);
+	vfree(rcu_dereference_protected(net_device_ctx->tx_hash, true));
 no_stats:
 	hv_set_drvdata(dev, NULL);
 	free_netdev(net);
@@ -2367,6 +3017,9 @@ static int netvsc_remove(struct hv_device *dev)
 	if (nvdev)
 		rndis_filter_device_remove(dev, nvdev);
 
+#if (RHEL_RELEASE_CODE >= RHEL_RELEASE_VERSION(7,6))
+	netvsc_xdp_set(net, NULL, NULL);
+#endif
 	unregister_netdevice(net);
 	list_del(&ndev_ctx->list);
 
@@ -2376,6 +3029,7 @@ static int netvsc_remove(struct hv_device *dev)
 	hv_set_drvdata(dev, NULL);
 
 	free_percpu(ndev_ctx->vf_stats);
+	vfree(rcu_dereference_protected(ndev_ctx->tx_hash, true));
 	free_netdev(net);
 	return 0;
 }
@@ -2394,6 +3048,7 @@ static struct  hv_driver netvsc_drv = {
 	.id_table = id_table,
 	.probe = netvsc_probe,
 	.remove = netvsc_remove,
+	.reopen = netvsc_reopen,
 };
 
 /*
@@ -2449,6 +3104,10 @@ static void __exit netvsc_drv_exit(void)
 {
 	unregister_netdevice_notifier(&netvsc_netdev_notifier);
 	vmbus_driver_unregister(&netvsc_drv);
+
+	/* Wait for the devices still being freed */
+	rcu_barrier();
+	flush_scheduled_work();
 }
 
 static int __init netvsc_drv_init(void)
@@ -2464,6 +3123,7 @@ static int __init netvsc_drv_init(void)
 #if (RHEL_RELEASE_CODE == RHEL_RELEASE_VERSION(7, 0))
 	netvsc_ring_reciprocal = reciprocal_value(netvsc_ring_bytes);
 #endif
+	netvsc_toeplitz_init(&netvsc_default_hash, netvsc_hash_key);
 
 	ret = vmbus_driver_register(&netvsc_drv);
 	if (ret)
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2018, Microsoft Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * Table driven Toeplitz hash, checked against the reference bit by bit
+ * implementation and the Microsoft RSS verification vectors by
+ * tools/toeplitz.
+ */
+
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+
+#include "netvsc_hash.h"
+
+/*
+ * Build the table for a key of at least NETVSC_HASH_INPUT_MAX + 4 bytes.
+ * Input bit j (MSB first) of byte i selects the 32 key bits starting at
+ * bit 8 * i + j; the entry for a byte value is the XOR of the windows of
+ * its set bits.
+ */
+void netvsc_toeplitz_init(struct netvsc_toeplitz *t, const u8 *key)
+{
+	u32 window[8];
+	int i, j, b;
+
+	for (i = 0; i < NETVSC_HASH_INPUT_MAX; i++) {
+		u64 k = (u64)key[i] << 32 | (u64)key[i + 1] << 24 |
+			(u64)key[i + 2] << 16 | (u64)key[i + 3] << 8 |
+			key[i + 4];
+
+		for (j = 0; j < 8; j++)
+			window[j] = (u32)(k >> (8 - j));
+
+		t->tbl[i][0] = 0;
+		for (b = 1; b < 256; b++)
+			t->tbl[i][b] = t->tbl[i][b & (b - 1)] ^
+				       window[7 - __ffs(b)];
+	}
+}
+
+/* data: network byte order, at most NETVSC_HASH_INPUT_MAX bytes
+ * return: host byte order
+ */
+u32 netvsc_toeplitz_hash(const struct netvsc_toeplitz *t,
+			 const void *data, int dlen)
+{
+	const u8 *p = data;
+	u32 ret = 0;
+	int i;
+
+	for (i = 0; i < dlen; i++)
+		ret ^= t->tbl[i][p[i]];
+
+	return ret;
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2018, Microsoft Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#ifndef _NETVSC_HASH_H
+#define _NETVSC_HASH_H
+
+#include <linux/types.h>
+
+/* Longest hash input: IPv6 source and destination address and TCP ports */
+#define NETVSC_HASH_INPUT_MAX	36
+
+/*
+ * Toeplitz hash lookup table for one RSS key. tbl[i][b] is the part of the
+ * hash contributed by byte value b at input offset i, so hashing takes one
+ * lookup per input byte instead of a key shift per input bit.
+ */
+struct netvsc_toeplitz {
+	u32 tbl[NETVSC_HASH_INPUT_MAX][256];
+};
+
+void netvsc_toeplitz_init(struct netvsc_toeplitz *t, const u8 *key);
+u32 netvsc_toeplitz_hash(const struct netvsc_toeplitz *t,
+			 const void *data, int dlen);
+
+#endif /* _NETVSC_HASH_H */
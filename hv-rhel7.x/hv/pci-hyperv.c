@@ -1841,14 +1841,11 @@ static void hv_pci_eject_device(struct hv_pci_dev *hpdev)
  */
 static void hv_pci_onchannelcallback(void *context)
 {
-	const int packet_size = 0x100;
-	int ret;
 	struct hv_pcibus_device *hbus = context;
 	u32 bytes_recvd;
 	u64 req_id;
 	struct vmpacket_descriptor *desc;
-	unsigned char *buffer;
-	int bufferlen = packet_size;
+	void *buffer;
 	struct pci_packet *comp_packet;
 	struct pci_response *response;
 	struct pci_incoming_message *new_message;
@@ -1856,27 +1853,14 @@ static void hv_pci_onchannelcallback(void *context)
 	struct pci_dev_incoming *dev_message;
 	struct hv_pci_dev *hpdev;
 
-	buffer = kmalloc(bufferlen, GFP_ATOMIC);
-	if (!buffer)
-		return;
-
-	while (1) {
-		ret = vmbus_recvpacket_raw(hbus->hdev->channel, buffer,
-					   bufferlen, &bytes_recvd, &req_id);
-
-		if (ret == -ENOBUFS) {
-			kfree(buffer);
-			/* Handle large packet */
-			bufferlen = bytes_recvd;
-			buffer = kmalloc(bytes_recvd, GFP_ATOMIC);
-			if (!buffer)
-				return;
-			continue;
-		}
-
-		/* Zero length indicates there are no more packets. */
-		if (ret || !bytes_recvd)
-			break;
+	/*
+	 * Packets are parsed in place in the ring, raw (descriptor
+	 * included), and the ring space is released once at the end.
+	 */
+	foreach_vmbus_pkt(desc, hbus->hdev->channel) {
+		buffer = desc;
+		bytes_recvd = desc->len8 << 3;
+		req_id = desc->trans_id;
 
 		/*
 		 * All incoming packets must be at least as large as a
@@ -1884,7 +1868,6 @@ static void hv_pci_onchannelcallback(void *context)
 		 */
 		if (bytes_recvd <= sizeof(struct pci_response))
 			continue;
-		desc = (struct vmpacket_descriptor *)buffer;
 
 		switch (desc->type) {
 		case VM_PKT_COMP:
@@ -1946,8 +1929,6 @@ static void hv_pci_onchannelcallback(void *context)
 			break;
 		}
 	}
-
-	kfree(buffer);
 }
 
 /**
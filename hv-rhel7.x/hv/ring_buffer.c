@@ -63,7 +63,7 @@ static void hv_signal_on_write(u32 old_write, struct vmbus_channel *channel)
 	struct hv_ring_buffer_info *rbi = &channel->outbound;
 	mb();
 	if (READ_ONCE(rbi->ring_buffer->interrupt_mask))
-		return;
+		goto suppressed;
 
 	/* check interrupt_mask before read_index */
 	rmb();
@@ -71,25 +71,43 @@ static void hv_signal_on_write(u32 old_write, struct vmbus_channel *channel)
 	 * This is the only case we need to signal when the
 	 * ring transitions from being empty to non-empty.
 	 */
-	if (old_write == READ_ONCE(rbi->ring_buffer->read_index))
+	if (old_write == READ_ONCE(rbi->ring_buffer->read_index)) {
+		vmbus_chan_stat_inc(channel, signals);
 		vmbus_setevent(channel);
+		return;
+	}
+
+suppressed:
+	vmbus_chan_stat_inc(channel, signals_suppressed);
 }
 
-/* Get the next write location for the specified ring buffer */
-static inline u32
-hv_get_next_write_location(struct hv_ring_buffer_info *ring_info)
+/* Account packets put on the outbound ring, ending at end_write */
+static void hv_ringbuffer_write_stats(struct vmbus_channel *channel,
+				      u32 packets, u32 bytes, u32 end_write,
+				      int ret)
 {
-	u32 next = ring_info->ring_buffer->write_index;
+	struct hv_ring_buffer_info *rbi = &channel->outbound;
+	u32 read_loc = READ_ONCE(rbi->ring_buffer->read_index);
+	u32 used;
 
-	return next;
+	used = end_write >= read_loc ? end_write - read_loc :
+		rbi->ring_datasize - (read_loc - end_write);
+
+	vmbus_chan_stat_add(channel, out_packets, packets);
+	vmbus_chan_stat_add(channel, out_bytes, bytes);
+	vmbus_chan_stat_inc(channel,
+			    out_occupancy[hv_ring_occupancy_bucket(rbi, used)]);
+	trace_vmbus_ringbuffer_write(channel, packets, bytes, used, ret);
 }
 
-/* Set the next write location for the specified ring buffer */
-static inline void
-hv_set_next_write_location(struct hv_ring_buffer_info *ring_info,
-		     u32 next_write_location)
+/* Account a write that found no room for even one packet */
+static void hv_ringbuffer_write_full(struct vmbus_channel *channel, u32 bytes)
 {
-	ring_info->ring_buffer->write_index = next_write_location;
+	vmbus_chan_stat_inc(channel, ring_full);
+	trace_vmbus_ringbuffer_write(channel, 0, bytes,
+			channel->outbound.ring_datasize -
+			hv_get_bytes_to_write(&channel->outbound),
+			-EAGAIN);
 }
 
 /* Set the next read location for the specified ring buffer */
@@ -108,13 +126,6 @@ hv_get_ring_buffersize(const struct hv_ring_buffer_info *ring_info)
 	return ring_info->ring_datasize;
 }
 
-/* Get the read and write indices as u64 of the specified ring buffer */
-static inline u64
-hv_get_ring_bufferindices(struct hv_ring_buffer_info *ring_info)
-{
-	return (u64)ring_info->ring_buffer->write_index << 32;
-}
-
 /*
  * Helper routine to copy from source to ring buffer.
  * Assume there is enough room. Handles wrap-around in dest case only!!
@@ -221,6 +232,7 @@ int hv_ringbuffer_init(struct hv_ring_buffer_info *ring_info,
 
 	ring_info->ring_buffer->read_index =
 		ring_info->ring_buffer->write_index = 0;
+	ring_info->priv_write_index = 0;
 
 	/* Set the feature bit for enabling flow control. */
 	ring_info->ring_buffer->feature_bits.value = 1;
@@ -240,17 +252,116 @@ void hv_ringbuffer_cleanup(struct hv_ring_buffer_info *ring_info)
 	vunmap(ring_info->ring_buffer);
 }
 
-/* Write to the ring buffer */
+/* Bytes free in the outbound ring beyond what writers already reserved */
+static inline u32
+hv_ringbuffer_avail_to_reserve(const struct hv_ring_buffer_info *rbi,
+			       u32 reserve_loc)
+{
+	u32 read_loc = READ_ONCE(rbi->ring_buffer->read_index);
+	u32 dsize = rbi->ring_datasize;
+
+	return reserve_loc >= read_loc ?
+		dsize - (reserve_loc - read_loc) : read_loc - reserve_loc;
+}
+
+/*
+ * Reserve totalbytes of space in the outbound ring.
+ *
+ * Writers claim space by advancing priv_write_index with cmpxchg, copy their
+ * data without holding ring_lock and then publish it with
+ * hv_ringbuffer_publish(). On success the offset of the reserved space is
+ * returned in *start.
+ */
+static int hv_ringbuffer_reserve(struct hv_ring_buffer_info *rbi,
+				 u32 totalbytes, u32 *start)
+{
+	u32 dsize = rbi->ring_datasize;
+	u32 old_write, next_write;
+
+	do {
+		old_write = READ_ONCE(rbi->priv_write_index);
+
+		/*
+		 * If there is only room for the packet, assume it is full.
+		 * Otherwise, the next time around, we think the ring buffer
+		 * is empty since the read index == write index
+		 */
+		if (hv_ringbuffer_avail_to_reserve(rbi, old_write) <=
+		    totalbytes)
+			return -EAGAIN;
+
+		next_write = old_write + totalbytes;
+		if (next_write >= dsize)
+			next_write -= dsize;
+	} while (cmpxchg(&rbi->priv_write_index,
+			 old_write, next_write) != old_write);
+
+	*start = old_write;
+	return 0;
+}
+
+/*
+ * Make the reserved space [start, end) visible to the host.
+ *
+ * The host consumes the ring strictly in order, so reservations must be
+ * published in the order they were made: wait until every writer that
+ * reserved space ahead of us has moved write_index up to our start.
+ */
+static void hv_ringbuffer_publish(struct hv_ring_buffer_info *rbi,
+				  u32 start, u32 end)
+{
+	while (READ_ONCE(rbi->ring_buffer->write_index) != start)
+		cpu_relax();
+
+	/* Issue a full memory barrier before updating the write index */
+	mb();
+
+	WRITE_ONCE(rbi->ring_buffer->write_index, end);
+}
+
+/*
+ * Copy one packet described by kv_list into the reserved space at start,
+ * followed by the trailer holding the packet's start offset.
+ */
+static u32 hv_ringbuffer_copy_packet(struct hv_ring_buffer_info *rbi,
+				     u32 start, const struct kvec *kv_list,
+				     u32 kv_count)
+{
+	u32 next_write_location = start;
+	u64 prev_indices;
+	int i;
+
+	for (i = 0; i < kv_count; i++) {
+		next_write_location = hv_copyto_ringbuffer(rbi,
+						     next_write_location,
+						     kv_list[i].iov_base,
+						     kv_list[i].iov_len);
+	}
+
+	/* Set previous packet start */
+	prev_indices = (u64)start << 32;
+
+	return hv_copyto_ringbuffer(rbi, next_write_location,
+				    &prev_indices, sizeof(u64));
+}
+
+/*
+ * Write to the ring buffer
+ *
+ * Multiple CPUs may copy into the ring at the same time; only the space
+ * reservation and the in-order publication of write_index are serialized.
+ * Interrupts stay disabled between the two so that a writer running in
+ * interrupt context never waits on a reservation made by the code it
+ * interrupted.
+ */
 int hv_ringbuffer_write(struct vmbus_channel *channel,
 			const struct kvec *kv_list, u32 kv_count)
 {
 	int i = 0;
-	u32 bytes_avail_towrite;
 	u32 totalbytes_towrite = 0;
 
 	u32 next_write_location;
 	u32 old_write;
-	u64 prev_indices = 0;
 	unsigned long flags = 0;
 	struct hv_ring_buffer_info *outring_info = &channel->outbound;
 
@@ -262,54 +373,108 @@ int hv_ringbuffer_write(struct vmbus_channel *channel,
 
 	totalbytes_towrite += sizeof(u64);
 
-	spin_lock_irqsave(&outring_info->ring_lock, flags);
+	local_irq_save(flags);
 
-	bytes_avail_towrite = hv_get_bytes_to_write(outring_info);
-
-	/*
-	 * If there is only room for the packet, assume it is full.
-	 * Otherwise, the next time around, we think the ring buffer
-	 * is empty since the read index == write index
-	 */
-	if (bytes_avail_towrite <= totalbytes_towrite) {
-		spin_unlock_irqrestore(&outring_info->ring_lock, flags);
+	if (hv_ringbuffer_reserve(outring_info, totalbytes_towrite,
+				  &old_write)) {
+		local_irq_restore(flags);
+		hv_ringbuffer_write_full(channel, totalbytes_towrite);
 		return -EAGAIN;
 	}
 
 	/* Write to the ring buffer */
-	next_write_location = hv_get_next_write_location(outring_info);
+	next_write_location = hv_ringbuffer_copy_packet(outring_info,
+							old_write,
+							kv_list, kv_count);
 
-	old_write = next_write_location;
+	/* Now, update the write location */
+	hv_ringbuffer_publish(outring_info, old_write, next_write_location);
 
-	for (i = 0; i < kv_count; i++) {
-		next_write_location = hv_copyto_ringbuffer(outring_info,
-						     next_write_location,
-						     kv_list[i].iov_base,
-						     kv_list[i].iov_len);
+	local_irq_restore(flags);
+
+	hv_ringbuffer_write_stats(channel, 1, totalbytes_towrite,
+				  next_write_location, 0);
+	hv_signal_on_write(old_write, channel);
+
+	if (channel->rescind)
+		return -ENODEV;
+
+	return 0;
+}
+
+/*
+ * Write a batch of packets to the ring buffer
+ *
+ * The packets are written back to back under a single reservation, the
+ * write_index is published once and the host is signaled at most once for
+ * the whole batch. If the ring cannot take every packet, as many leading
+ * packets as fit are written, *written is set to their number and -EAGAIN
+ * is returned.
+ */
+int hv_ringbuffer_write_batch(struct vmbus_channel *channel,
+			      struct vmbus_batch_packet *pkts, u32 count,
+			      u32 *written)
+{
+	struct hv_ring_buffer_info *outring_info = &channel->outbound;
+	u32 next_write_location, old_write, avail, bytes;
+	unsigned long flags = 0;
+	u32 i, j, n;
+
+	*written = 0;
+
+	if (channel->rescind)
+		return -ENODEV;
+
+	for (i = 0; i < count; i++) {
+		pkts[i].ring_len = sizeof(u64);
+		for (j = 0; j < pkts[i].kv_count; j++)
+			pkts[i].ring_len += pkts[i].kv[j].iov_len;
 	}
 
-	/* Set previous packet start */
-	prev_indices = hv_get_ring_bufferindices(outring_info);
+	local_irq_save(flags);
 
-	next_write_location = hv_copyto_ringbuffer(outring_info,
-					     next_write_location,
-					     &prev_indices,
-					     sizeof(u64));
+	/* Reserve room for the longest run of packets that fits */
+	do {
+		avail = hv_ringbuffer_avail_to_reserve(outring_info,
+				READ_ONCE(outring_info->priv_write_index));
 
-	/* Issue a full memory barrier before updating the write index */
-	mb();
+		for (n = 0, bytes = 0; n < count; n++) {
+			if (bytes + pkts[n].ring_len >= avail)
+				break;
+			bytes += pkts[n].ring_len;
+		}
 
-	/* Now, update the write location */
-	hv_set_next_write_location(outring_info, next_write_location);
+		if (n == 0) {
+			local_irq_restore(flags);
+			hv_ringbuffer_write_full(channel, pkts[0].ring_len);
+			return -EAGAIN;
+		}
+	} while (hv_ringbuffer_reserve(outring_info, bytes, &old_write));
 
-	spin_unlock_irqrestore(&outring_info->ring_lock, flags);
+	next_write_location = old_write;
+	for (i = 0; i < n; i++)
+		next_write_location =
+			hv_ringbuffer_copy_packet(outring_info,
+						  next_write_location,
+						  pkts[i].kv, pkts[i].kv_count);
 
+	hv_ringbuffer_publish(outring_info, old_write, next_write_location);
+
+	local_irq_restore(flags);
+
+	hv_ringbuffer_write_stats(channel, n, bytes, next_write_location,
+				  n == count ? 0 : -EAGAIN);
 	hv_signal_on_write(old_write, channel);
 
+	*written = n;
+
+	if (n != count)
+		vmbus_chan_stat_inc(channel, ring_full);
+
 	if (channel->rescind)
 		return -ENODEV;
 
-	return 0;
+	return n == count ? 0 : -EAGAIN;
 }
 
 void hv_get_ringbuffer_available_space(struct hv_ring_buffer_info *inring_info,
@@ -390,26 +555,80 @@ static u32 hv_pkt_iter_avail(const struct hv_ring_buffer_info *rbi)
 }
 
 /*
- * Get first vmbus packet from ring buffer after read_index
- *
- * If ring buffer is empty, returns NULL and no other action needed.
+ * Get the packet at priv_read_index, if the host has published all of it.
  */
-struct vmpacket_descriptor *hv_pkt_iter_first(struct vmbus_channel *channel)
+static struct vmpacket_descriptor *
+hv_pkt_iter_peek(struct vmbus_channel *channel)
 {
 	struct hv_ring_buffer_info *rbi = &channel->inbound;
 	struct vmpacket_descriptor *desc;
+	u32 avail = hv_pkt_iter_avail(rbi);
 
-	if (hv_pkt_iter_avail(rbi) < sizeof(struct vmpacket_descriptor))
+	if (avail < sizeof(struct vmpacket_descriptor))
 		return NULL;
 
 	desc = hv_get_ring_buffer(rbi) + rbi->priv_read_index;
+
+	/*
+	 * Callers use the packet in place, so never hand out one that
+	 * claims more than the host has published.
+	 */
+	if (unlikely(desc->offset8 > desc->len8 ||
+		     (desc->len8 << 3) + VMBUS_PKT_TRAILER > avail))
+		return NULL;
+
+	prefetch((char *)desc + (desc->len8 << 3));
+
+	return desc;
+}
+
+/*
+ * Get first vmbus packet from ring buffer after read_index
+ *
+ * If ring buffer is empty, returns NULL and no other action needed.
+ */
+struct vmpacket_descriptor *hv_pkt_iter_first(struct vmbus_channel *channel)
+{
+	struct vmpacket_descriptor *desc = hv_pkt_iter_peek(channel);
+
 	if (desc)
-		prefetch((char *)desc + (desc->len8 << 3));
+		trace_vmbus_pkt_iter_begin(channel);
 
 	return desc;
 }
 EXPORT_SYMBOL_GPL(hv_pkt_iter_first);
 
+/*
+ * Borrow the next packet in place instead of copying it out.
+ *
+ * The ring space holding the packet is not given back to the host until
+ * vmbus_release_packet() moves read_index past it, so the descriptor and
+ * its payload stay valid until then. Only one packet per channel can be
+ * borrowed at a time, and only from the channel callback context.
+ */
+struct vmpacket_descriptor *vmbus_borrow_packet(struct vmbus_channel *channel)
+{
+	return hv_pkt_iter_first(channel);
+}
+EXPORT_SYMBOL_GPL(vmbus_borrow_packet);
+
+/*
+ * Give a borrowed packet's ring space back to the host, signaling it if
+ * it is waiting for room.
+ */
+void vmbus_release_packet(struct vmbus_channel *channel,
+			  const struct vmpacket_descriptor *desc)
+{
+	struct hv_ring_buffer_info *rbi = &channel->inbound;
+
+	if (WARN_ON(desc != hv_get_ring_buffer(rbi) + rbi->priv_read_index))
+		return;
+
+	__hv_pkt_iter_next(channel, desc);
+	hv_pkt_iter_close(channel);
+}
+EXPORT_SYMBOL_GPL(vmbus_release_packet);
+
 /*
  * Get next vmbus packet from ring buffer.
  *
@@ -424,13 +643,16 @@ __hv_pkt_iter_next(struct vmbus_channel *channel,
 	u32 packetlen = desc->len8 << 3;
 	u32 dsize = rbi->ring_datasize;
 
+	vmbus_chan_stat_inc(channel, in_packets);
+	vmbus_chan_stat_add(channel, in_bytes, packetlen + VMBUS_PKT_TRAILER);
+
 	/* bump offset to next potential packet */
 	rbi->priv_read_index += packetlen + VMBUS_PKT_TRAILER;
 	if (rbi->priv_read_index >= dsize)
 		rbi->priv_read_index -= dsize;
 
 	/* more data? */
-	return hv_pkt_iter_first(channel);
+	return hv_pkt_iter_peek(channel);
 
 }
 EXPORT_SYMBOL_GPL(__hv_pkt_iter_next);
@@ -456,28 +678,19 @@ EXPORT_SYMBOL_GPL(__hv_pkt_iter_next);
  * guest ring buffer to indicate whether it should be signaled.
  *
  */
-void hv_pkt_iter_close(struct vmbus_channel *channel)
+static bool hv_pkt_iter_need_signal(struct hv_ring_buffer_info *rbi,
+				    u32 orig_read_index)
 {
-	struct hv_ring_buffer_info *rbi = &channel->inbound;
-	u32 orig_read_index, read_index, write_index, pending_sz;
+	u32 read_index, write_index, pending_sz;
 	u32 orig_free_space, free_space;
 
-	/*
-	 * Make sure all reads are done before updating the read index since
-	 * the writer may start writing to the read area once the read index
-	 * is updated.
-	 */
-	rmb();
-	orig_read_index = rbi->ring_buffer->read_index;
-	rbi->ring_buffer->read_index = rbi->priv_read_index;
-
 	/*
 	 * Older versions of Hyper-V (before WS2012 and Win8) do not
 	 * implement pending_send_sz and simply poll if the host->guest
 	 * ring buffer is full. No signaling is needed or expected.
 	 */
 	if (!rbi->ring_buffer->feature_bits.feat_pending_send_sz)
-		return;
+		return false;
 
 	/*
 	 * Issue a full memory barrier before making the signaling decision.
@@ -497,7 +710,7 @@ void hv_pkt_iter_close(struct vmbus_channel *channel)
 	 */
 	pending_sz = READ_ONCE(rbi->ring_buffer->pending_send_sz);
 	if (!pending_sz)
-		return;
+		return false;
 
 	/*
 	 * Since pending_send_sz is non-zero, this ring buffer is probably
@@ -531,7 +744,7 @@ void hv_pkt_iter_close(struct vmbus_channel *channel)
 			? rbi->ring_datasize - (write_index - orig_read_index)
 			: orig_read_index - write_index;
 	if (orig_free_space > pending_sz)
-		return;
+		return false;
 
 	/* 
 	 * If still in a "not enough space" situation after updating the
@@ -543,12 +756,36 @@ void hv_pkt_iter_close(struct vmbus_channel *channel)
 			? rbi->ring_datasize - (write_index - read_index)
 			: read_index - write_index;
 	if (free_space <= pending_sz)
-		return;
+		return false;
 
 	/*
 	 * We're transitioning from "not enough free space" to
 	 * "enough free space", so signal the host.
 	 */
-	vmbus_setevent(channel);
+	return true;
+}
+
+void hv_pkt_iter_close(struct vmbus_channel *channel)
+{
+	struct hv_ring_buffer_info *rbi = &channel->inbound;
+	u32 orig_read_index;
+	bool signal;
+
+	/*
+	 * Make sure all reads are done before updating the read index since
+	 * the writer may start writing to the read area once the read index
+	 * is updated.
+	 */
+	rmb();
+	orig_read_index = rbi->ring_buffer->read_index;
+	rbi->ring_buffer->read_index = rbi->priv_read_index;
+
+	signal = hv_pkt_iter_need_signal(rbi, orig_read_index);
+	trace_vmbus_pkt_iter_close(channel, orig_read_index, signal);
+
+	if (signal) {
+		vmbus_chan_stat_inc(channel, pending_send_wakeups);
+		vmbus_setevent(channel);
+	}
 }
 EXPORT_SYMBOL_GPL(hv_pkt_iter_close);
@@ -345,7 +345,8 @@ static void rndis_filter_receive_response(struct net_device *ndev,
  * Get the Per-Packet-Info with the specified type
  * return NULL if not found.
  */
-static inline void *rndis_get_ppi(struct rndis_packet *rpkt, u32 type)
+static inline void *rndis_get_ppi(struct rndis_packet *rpkt, u32 type,
+				  u8 internal)
 {
 	struct rndis_per_packet_info *ppi;
 	int len;
@@ -358,7 +359,7 @@ static inline void *rndis_get_ppi(struct rndis_packet *rpkt, u32 type)
 	len = rpkt->per_pkt_info_len;
 
 	while (len > 0) {
-		if (ppi->type == type)
+		if (ppi->type == type && ppi->internal == internal)
 			return (void *)((ulong)ppi + ppi->ppi_offset);
 		len -= ppi->size;
 		ppi = (struct rndis_per_packet_info *)((ulong)ppi + ppi->size);
@@ -367,6 +368,53 @@ static inline void *rndis_get_ppi(struct rndis_packet *rpkt, u32 type)
 	return NULL;
 }
 
+/*
+ * With RSC the host may split a coalesced frame over several receive
+ * sections, each carried in its own RNDIS message and marked with a
+ * packet info ID. Collect the pieces and pass the frame up once the last
+ * one has arrived. Pieces without a first one are dropped.
+ */
+static int rndis_filter_receive_rsc(struct net_device *ndev,
+				    struct netvsc_device *nvdev,
+				    struct vmbus_channel *channel,
+				    const struct rndis_pktinfo_id *pktinfo_id,
+				    const struct ndis_tcp_ip_checksum_info *csum_info,
+				    const struct ndis_pkt_8021q_info *vlan,
+				    void *data, u32 len)
+{
+	u16 q_idx = channel->offermsg.offer.sub_channel_index;
+	struct netvsc_rsc *rsc = nvdev->chan_table[q_idx].rsc;
+	int ret;
+
+	if (pktinfo_id->flag & RNDIS_PKTINFO_1ST_FRAG) {
+		rsc->cnt = 0;
+		rsc->pktlen = 0;
+		rsc->csum_info = csum_info;
+		rsc->vlan = vlan;
+	} else if (!rsc->cnt) {
+		return NVSP_STAT_FAIL;
+	}
+
+	if (unlikely(rsc->cnt >= NVSP_RSC_MAX)) {
+		netdev_err(ndev, "coalesced frame has too many pieces\n");
+		rsc->cnt = 0;
+		return NVSP_STAT_FAIL;
+	}
+
+	rsc->data[rsc->cnt] = data;
+	rsc->len[rsc->cnt] = len;
+	rsc->pktlen += len;
+	rsc->cnt++;
+
+	if (!(pktinfo_id->flag & RNDIS_PKTINFO_LAST_FRAG))
+		return NVSP_STAT_SUCCESS;
+
+	ret = netvsc_recv_rsc(ndev, nvdev, channel, rsc);
+	rsc->cnt = 0;
+
+	return ret;
+}
+
 static int rndis_filter_receive_data(struct net_device *ndev,
 				     struct netvsc_device *nvdev,
 				     struct rndis_message *msg,
@@ -376,7 +424,9 @@ static int rndis_filter_receive_data(struct net_device *ndev,
 	struct rndis_packet *rndis_pkt = &msg->msg.pkt;
 	const struct ndis_tcp_ip_checksum_info *csum_info;
 	const struct ndis_pkt_8021q_info *vlan;
-	u32 data_offset;
+	const struct rndis_pktinfo_id *pktinfo_id;
+	struct netvsc_rsc *rsc;
+	u32 data_offset, len;
 
 	/* Remove the rndis header and pass it back up the stack */
 	data_offset = RNDIS_HEADER_SIZE + rndis_pkt->data_offset;
@@ -395,7 +445,7 @@ static int rndis_filter_receive_data(struct net_device *ndev,
 		return NVSP_STAT_FAIL;
 	}
 
-	vlan = rndis_get_ppi(rndis_pkt, IEEE_8021Q_INFO);
+	vlan = rndis_get_ppi(rndis_pkt, IEEE_8021Q_INFO, 0);
 
 	/*
 	 * Remove the rndis trailer padding from rndis packet message
@@ -403,11 +453,28 @@ static int rndis_filter_receive_data(struct net_device *ndev,
 	 * the data packet to the stack, without the rndis trailer padding
 	 */
 	data = (void *)((unsigned long)data + data_offset);
-	csum_info = rndis_get_ppi(rndis_pkt, TCPIP_CHKSUM_PKTINFO);
+	len = rndis_pkt->data_len;
+	csum_info = rndis_get_ppi(rndis_pkt, TCPIP_CHKSUM_PKTINFO, 0);
+
+	pktinfo_id = rndis_get_ppi(rndis_pkt, RNDIS_PKTINFO_ID, 1);
+	if (pktinfo_id && (pktinfo_id->flag & RNDIS_PKTINFO_SUBALLOC))
+		return rndis_filter_receive_rsc(ndev, nvdev, channel, pktinfo_id,
+						csum_info, vlan, data, len);
+
+	/* A whole frame ends any coalesced one still being collected */
+	rsc = nvdev->chan_table[channel->offermsg.offer.sub_channel_index].rsc;
+	if (unlikely(rsc->cnt))
+		rsc->cnt = 0;
+
+#if (RHEL_RELEASE_CODE >= RHEL_RELEASE_VERSION(7,6))
+	if (!netvsc_run_xdp(ndev, &nvdev->chan_table[
+				channel->offermsg.offer.sub_channel_index],
+			    &data, &len))
+		return NVSP_STAT_SUCCESS;
+#endif
 
 	return netvsc_recv_callback(ndev, nvdev, channel,
-				    data, rndis_pkt->data_len,
-				    csum_info, vlan);
+				    data, len, csum_info, vlan);
 }
 
 int rndis_filter_receive(struct net_device *ndev,
@@ -658,7 +725,7 @@ cleanup:
 	return ret;
 }
 
-static int
+int
 rndis_filter_set_offload_params(struct net_device *ndev,
 				struct netvsc_device *nvdev,
 				struct ndis_offload_params *req_offloads)
@@ -771,9 +838,10 @@ int rndis_filter_set_rss_param(struct rndis_device *rdev,
 
 	wait_for_completion(&request->wait_event);
 	set_complete = &request->response_msg.msg.set_complete;
-	if (set_complete->status == RNDIS_STATUS_SUCCESS)
+	if (set_complete->status == RNDIS_STATUS_SUCCESS) {
 		memcpy(rdev->rss_key, rss_key, NETVSC_HASH_KEYLEN);
-	else {
+		netvsc_set_tx_hash_key(ndev, rss_key);
+	} else {
 		netdev_err(ndev, "Fail to set RSS parameters:0x%x\n",
 			   set_complete->status);
 		ret = -EINVAL;
@@ -1043,6 +1111,7 @@ static void netvsc_sc_open(struct vmbus_channel *new_sc)
 	 * control is done via Net softirq, not the channel handling
 	 */
 	set_channel_read_mode(new_sc, HV_CALL_ISR);
+	new_sc->change_target_cpu_callback = netvsc_change_target_cpu;
 
 	/* Set the channel before opening.*/
 	nvchan->channel = new_sc;
@@ -1143,6 +1212,25 @@ static int rndis_netdev_set_hwcaps(struct rndis_device *rndis_device,
 	/* Compute tx offload settings based on hw capabilities */
 	net->hw_features |= NETIF_F_RXCSUM;
 
+	/* Done in software on segments the host checksummed, and by the
+	 * host itself when it can coalesce receive segments. RSC follows
+	 * the LRO feature, which defaults to on.
+	 */
+	net->hw_features |= NETIF_F_LRO;
+
+	nvdev->rsc_offload = hwcaps.rsc.ip4 && hwcaps.rsc.ip6 &&
+		nvdev->nvsp_version >= NVSP_PROTOCOL_VERSION_61;
+	if (nvdev->rsc_offload) {
+		if (net->reg_state != NETREG_REGISTERED ||
+		    (net->features & NETIF_F_LRO)) {
+			offloads.rsc_ip_v4 = NDIS_OFFLOAD_PARAMETERS_RSC_ENABLED;
+			offloads.rsc_ip_v6 = NDIS_OFFLOAD_PARAMETERS_RSC_ENABLED;
+		} else {
+			offloads.rsc_ip_v4 = NDIS_OFFLOAD_PARAMETERS_RSC_DISABLED;
+			offloads.rsc_ip_v6 = NDIS_OFFLOAD_PARAMETERS_RSC_DISABLED;
+		}
+	}
+
 	if ((hwcaps.csum.ip4_txcsum & NDIS_TXCSUM_ALL_TCP4) == NDIS_TXCSUM_ALL_TCP4) {
 		/* Can checksum TCP */
 		net->hw_features |= NETIF_F_IP_CSUM;
@@ -1297,6 +1385,8 @@ struct netvsc_device *rndis_filter_device_add(struct hv_device *dev,
 				vfree(net_device->chan_table[i].mrc.slots);
 			goto out;
 		}
+
+		netvsc_alloc_tx_batch(net_device, i);
 	}
 
 	for (i = 1; i < net_device->num_chn; i++)
@@ -29,14 +29,16 @@
 #include <linux/delay.h>
 #include <linux/init.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/module.h>
 #include <linux/device.h>
 #include "include/linux/hyperv.h"
 /*
  * Divergence from upstream commit: ead3700d893654d440edcb66fb3767a0c0db54cf
  * storvsc: use cmd_size to allocate per-command data
+ * Requests come from a preallocated per-host slot table instead, see
+ * storvsc_get_request().
  */
-#include <linux/mempool.h>
 #include <asm/bug.h>
 #include <linux/blkdev.h>
 #include <scsi/scsi.h>
@@ -400,23 +402,58 @@ enum storvsc_request_type {
  */
 
 
-/*
- * We setup a mempool to allocate request structures for this driver
- * on a per-lun basis. The following define specifies the number of
- * elements in the pool.
- */
-
-#define STORVSC_MIN_BUF_NR				64
 static int storvsc_ringbuffer_size = (256 * PAGE_SIZE);
 static u32 max_outstanding_req_per_channel;
 
+static int storvsc_bounce_pages = 256;
+
 static int storvsc_vcpus_per_sub_channel = 4;
 
+/*
+ * Which channel I/O goes out on, relative to the submitting CPU:
+ * SAME_CPU uses the channel whose interrupts land on that CPU, so the
+ * completion runs where the I/O was issued and its data is cache hot.
+ * OTHER_CPU prefers another channel on the same NUMA node, so the
+ * completion work does not compete with the submitter.
+ */
+enum storvsc_chn_policy {
+	STORVSC_CHN_OTHER_CPU,
+	STORVSC_CHN_SAME_CPU,
+};
+
+static const char * const storvsc_chn_policy_names[] = {
+	[STORVSC_CHN_OTHER_CPU]	= "other_cpu",
+	[STORVSC_CHN_SAME_CPU]	= "same_cpu",
+};
+
+/*
+ * Where the SCSI completions collected by one channel callback run:
+ * INLINE completes them at the end of the callback, once the ring has
+ * been handed back to the host. THREAD hands them to a work item on the
+ * channel's CPU so the callback returns, and host interrupts are
+ * re-enabled, as soon as the ring is drained.
+ */
+enum storvsc_comp_mode {
+	STORVSC_COMP_INLINE,
+	STORVSC_COMP_THREAD,
+};
+
+static const char * const storvsc_comp_mode_names[] = {
+	[STORVSC_COMP_INLINE]	= "inline",
+	[STORVSC_COMP_THREAD]	= "thread",
+};
+
+static struct workqueue_struct *storvsc_comp_wq;
+
 module_param(storvsc_ringbuffer_size, int, S_IRUGO);
 MODULE_PARM_DESC(storvsc_ringbuffer_size, "Ring buffer size (bytes)");
 
 module_param(storvsc_vcpus_per_sub_channel, int, S_IRUGO);
 MODULE_PARM_DESC(storvsc_vcpus_per_sub_channel, "Ratio of VCPUs to subchannels");
+
+module_param(storvsc_bounce_pages, int, S_IRUGO);
+MODULE_PARM_DESC(storvsc_bounce_pages,
+		 "Bounce buffer pages kept per NUMA node and controller");
 /*
  * Timeout in seconds for all devices managed by this driver.
  */
@@ -440,6 +477,32 @@ static void storvsc_on_channel_callback(void *context);
 #define STORVSC_IDE_MAX_TARGETS				1
 #define STORVSC_IDE_MAX_CHANNELS			1
 
+/*
+ * Pages for bouncing scatterlists with holes, one pool per NUMA node.
+ * Pages beyond the pool come from the page allocator and are counted in
+ * misses; once the pool is back to size, extra pages are freed again.
+ */
+struct storvsc_bounce_pool {
+	spinlock_t lock;
+	struct list_head pages;
+	unsigned int count;
+	unsigned int size;
+	int node;
+
+	/* Statistics, under lock */
+	u64 commands;
+	u64 bytes;
+	u64 misses;
+};
+
+/* Per-channel completion state, the channel's per_channel_state */
+struct storvsc_chn_ctx {
+	struct storvsc_device *stor_device;
+	spinlock_t lock;
+	struct list_head done;		/* waiting for work */
+	struct work_struct work;
+};
+
 struct storvsc_cmd_request {
 	struct list_head entry;
 	struct scsi_cmnd *cmd;
@@ -450,8 +513,9 @@ struct storvsc_cmd_request {
 	 * to possible gaps in sg list. Bounce buffers are
 	 * eliminated upstream with calls to blk_queue_virt_boundary().
 	 */
-	unsigned int bounce_sgl_count;
-	struct scatterlist *bounce_sgl;
+	unsigned int bounce_count;
+	struct page **bounce_pages;	/* kept with the slot once allocated */
+	struct storvsc_bounce_pool *bounce_pool;
 
 	struct hv_device *device;
 
@@ -463,6 +527,8 @@ struct storvsc_cmd_request {
 	struct vmbus_channel_packet_multipage_buffer mpb;
 	struct vmbus_packet_mpb_array *payload;
 	u32 payload_sz;
+	/* Descriptor for I/O beyond mpb, kept with the slot once allocated */
+	struct vmbus_packet_mpb_array *mpb_array;
 
 	struct vstor_packet vstor_packet;
 };
@@ -502,9 +568,29 @@ struct storvsc_device {
 	 * Mask of CPUs bound to subchannels.
 	 */
 	struct cpumask alloced_cpus;
+	/*
+	 * Outgoing channel for I/O submitted on each CPU, rebuilt by
+	 * storvsc_update_og_chns() under chns_lock and read locklessly.
+	 */
+	struct vmbus_channel **og_chns;
+	spinlock_t chns_lock;
+	struct cpumask og_mask;		/* scratch, under chns_lock */
+	int chn_policy;
+	int comp_mode;
 	/* Used for vsc/vsp channel reset process */
 	struct storvsc_cmd_request init_request;
 	struct storvsc_cmd_request reset_request;
+	/*
+	 * Command slots, one per host->can_queue. The index of a slot is
+	 * the trans_id of the request sent to the host (plus one).
+	 */
+	u32 nr_requests;
+	unsigned long *request_map;
+	struct storvsc_cmd_request *requests;
+	/* Most PFNs a single request can carry */
+	u32 max_pfns;
+	/* Indexed by NUMA node */
+	struct storvsc_bounce_pool **bounce_pools;
 	/*
 	 * Currently active port and node names for FC devices.
 	 */
@@ -515,11 +601,6 @@ struct storvsc_device {
 #endif
 };
 
-struct stor_mem_pools {
-	struct kmem_cache *request_pool;
-	mempool_t *request_mempool;
-};
-
 struct hv_host_device {
 	struct hv_device *dev;
 	unsigned int port;
@@ -696,19 +777,109 @@ get_in_err:
 
 }
 
-static void destroy_bounce_buffer(struct scatterlist *sgl,
-				  unsigned int sg_count)
+static int storvsc_alloc_requests(struct storvsc_device *stor_device,
+				  u32 nr_requests)
 {
-	int i;
-	struct page *page_buf;
+	stor_device->request_map = kcalloc(BITS_TO_LONGS(nr_requests),
+					   sizeof(unsigned long), GFP_KERNEL);
+	if (!stor_device->request_map)
+		return -ENOMEM;
 
-	for (i = 0; i < sg_count; i++) {
-		page_buf = sg_page((&sgl[i]));
-		if (page_buf != NULL)
-			__free_page(page_buf);
+	stor_device->requests = vzalloc(nr_requests *
+					sizeof(struct storvsc_cmd_request));
+	if (!stor_device->requests) {
+		kfree(stor_device->request_map);
+		stor_device->request_map = NULL;
+		return -ENOMEM;
+	}
+
+	stor_device->nr_requests = nr_requests;
+	return 0;
+}
+
+static void storvsc_free_requests(struct storvsc_device *stor_device)
+{
+	u32 i;
+
+	if (stor_device->requests)
+		for (i = 0; i < stor_device->nr_requests; i++) {
+			kfree(stor_device->requests[i].mpb_array);
+			kfree(stor_device->requests[i].bounce_pages);
+		}
+
+	vfree(stor_device->requests);
+	kfree(stor_device->request_map);
+}
+
+/*
+ * Grab a free command slot. The SCSI midlayer never has more than
+ * can_queue commands outstanding, so this only fails if the table could
+ * not be sized to match. Each CPU starts its search in its own part of
+ * the bitmap so that concurrent submitters rarely touch the same word.
+ */
+static struct storvsc_cmd_request *
+storvsc_get_request(struct storvsc_device *stor_device)
+{
+	unsigned long *map = stor_device->request_map;
+	u32 nr = stor_device->nr_requests;
+	unsigned long cpu = raw_smp_processor_id();
+	u32 start, idx;
+
+	start = round_down(cpu * nr / nr_cpu_ids, BITS_PER_LONG);
+	for (;;) {
+		idx = find_next_zero_bit(map, nr, start);
+		while (idx < nr) {
+			if (!test_and_set_bit_lock(idx, map))
+				return &stor_device->requests[idx];
+			idx = find_next_zero_bit(map, nr, idx + 1);
+		}
+		if (start == 0)
+			return NULL;
+		start = 0;
 	}
+}
 
-	kfree(sgl);
+static void storvsc_put_request(struct storvsc_device *stor_device,
+				struct storvsc_cmd_request *request)
+{
+	clear_bit_unlock(request - stor_device->requests,
+			 stor_device->request_map);
+}
+
+/*
+ * I/O with more than MAX_PAGE_BUFFER_COUNT pages does not fit the
+ * descriptor embedded in the request. A slot allocates a full sized one
+ * the first time it needs it and reuses it from then on, so large
+ * sequential I/O stops allocating once every busy slot has seen one.
+ */
+static struct vmbus_packet_mpb_array *
+storvsc_mpb_array(struct storvsc_device *stor_device,
+		  struct storvsc_cmd_request *request)
+{
+	if (!request->mpb_array)
+		request->mpb_array =
+			kmalloc(sizeof(struct vmbus_packet_mpb_array) +
+				stor_device->max_pfns * sizeof(u64),
+				GFP_ATOMIC);
+
+	return request->mpb_array;
+}
+
+static void storvsc_fill_pfns(u64 *pfns, struct scatterlist *sgl,
+			      unsigned int sg_count)
+{
+	struct scatterlist *sg;
+	unsigned int i;
+
+	/* dma_boundary keeps every segment within one page */
+	for_each_sg(sgl, sg, sg_count, i)
+		pfns[i] = page_to_pfn(sg_page(sg));
+}
+
+static inline u64 storvsc_request_id(struct storvsc_device *stor_device,
+				     struct storvsc_cmd_request *request)
+{
+	return request - stor_device->requests + 1;
 }
 
 static int do_bounce_buffer(struct scatterlist *sgl, unsigned int sg_count)
@@ -739,193 +910,343 @@ static int do_bounce_buffer(struct scatterlist *sgl, unsigned int sg_count)
 	return -1;
 }
 
-static struct scatterlist *create_bounce_buffer(struct scatterlist *sgl,
-						unsigned int sg_count,
-						unsigned int len,
-						int write)
+static void storvsc_bounce_put(struct storvsc_bounce_pool *pool,
+			       struct page **pages, unsigned int n)
 {
-	int i;
-	int num_pages;
-	struct scatterlist *bounce_sgl;
-	struct page *page_buf;
-	unsigned int buf_len = ((write == WRITE_TYPE) ? 0 : PAGE_SIZE);
-
-	num_pages = ALIGN(len, PAGE_SIZE) >> PAGE_SHIFT;
-
-	bounce_sgl = kcalloc(num_pages, sizeof(struct scatterlist), GFP_ATOMIC);
-	if (!bounce_sgl)
-		return NULL;
-
-	sg_init_table(bounce_sgl, num_pages);
-	for (i = 0; i < num_pages; i++) {
-		page_buf = alloc_page(GFP_ATOMIC);
-		if (!page_buf)
-			goto cleanup;
-		sg_set_page(&bounce_sgl[i], page_buf, buf_len, 0);
-	}
+	unsigned long flags;
+	unsigned int i = 0;
 
-	return bounce_sgl;
+	spin_lock_irqsave(&pool->lock, flags);
+	for (; i < n && pool->count < pool->size; i++) {
+		list_add(&pages[i]->lru, &pool->pages);
+		pool->count++;
+	}
+	spin_unlock_irqrestore(&pool->lock, flags);
 
-cleanup:
-	destroy_bounce_buffer(bounce_sgl, num_pages);
-	return NULL;
+	for (; i < n; i++)
+		__free_page(pages[i]);
 }
 
-/* Assume the original sgl has enough room */
-static unsigned int copy_from_bounce_buffer(struct scatterlist *orig_sgl,
-					    struct scatterlist *bounce_sgl,
-					    unsigned int orig_sgl_count,
-					    unsigned int bounce_sgl_count)
+static bool storvsc_bounce_get(struct storvsc_bounce_pool *pool,
+			       struct page **pages, unsigned int n,
+			       unsigned int len)
 {
-	int i;
-	int j = 0;
-	unsigned long src, dest;
-	unsigned int srclen, destlen, copylen;
-	unsigned int total_copied = 0;
-	unsigned long bounce_addr = 0;
-	unsigned long dest_addr = 0;
 	unsigned long flags;
-	struct scatterlist *cur_dest_sgl;
-	struct scatterlist *cur_src_sgl;
-
-	local_irq_save(flags);
-	cur_dest_sgl = orig_sgl;
-	cur_src_sgl = bounce_sgl;
-	for (i = 0; i < orig_sgl_count; i++) {
-		dest_addr = (unsigned long)
-				kmap_atomic(sg_page(cur_dest_sgl)) +
-				cur_dest_sgl->offset;
-		dest = dest_addr;
-		destlen = cur_dest_sgl->length;
-
-		if (bounce_addr == 0)
-			bounce_addr = (unsigned long)kmap_atomic(
-							sg_page(cur_src_sgl));
-
-		while (destlen) {
-			src = bounce_addr + cur_src_sgl->offset;
-			srclen = cur_src_sgl->length - cur_src_sgl->offset;
-
-			copylen = min(srclen, destlen);
-			memcpy((void *)dest, (void *)src, copylen);
-
-			total_copied += copylen;
-			cur_src_sgl->offset += copylen;
-			destlen -= copylen;
-			dest += copylen;
-
-			if (cur_src_sgl->offset == cur_src_sgl->length) {
-				/* full */
-				kunmap_atomic((void *)bounce_addr);
-				j++;
-				/*
-				 * It is possible that the number of elements
-				 * in the bounce buffer may not be equal to
-				 * the number of elements in the original
-				 * scatter list. Handle this correctly.
-				 */
-
-				if (j == bounce_sgl_count) {
-					/*
-					 * We are done; cleanup and return.
-					 */
-					kunmap_atomic((void *)(dest_addr -
-						cur_dest_sgl->offset));
-					local_irq_restore(flags);
-					return total_copied;
-				}
-
-				/* if we need to use another bounce buffer */
-				if (destlen || i != orig_sgl_count - 1) {
-					cur_src_sgl = sg_next(cur_src_sgl);
-					bounce_addr = (unsigned long)
-							kmap_atomic(
-							sg_page(cur_src_sgl));
-				}
-			} else if (destlen == 0 && i == orig_sgl_count - 1) {
-				/* unmap the last bounce that is < PAGE_SIZE */
-				kunmap_atomic((void *)bounce_addr);
-			}
+	struct page *page;
+	unsigned int i = 0;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	for (; i < n && pool->count; i++) {
+		page = list_first_entry(&pool->pages, struct page, lru);
+		list_del(&page->lru);
+		pool->count--;
+		pages[i] = page;
+	}
+	pool->commands++;
+	pool->bytes += len;
+	pool->misses += n - i;
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	for (; i < n; i++) {
+		pages[i] = alloc_pages_node(pool->node, GFP_ATOMIC, 0);
+		if (!pages[i]) {
+			storvsc_bounce_put(pool, pages, i);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Copy between a scatterlist and bounce pages that hold the same data
+ * packed from offset 0. dma_boundary keeps every segment within one page
+ * and the bounce pages are lowmem, so each segment is one mapping and at
+ * most two memcpy() calls.
+ */
+static void storvsc_bounce_copy(struct scatterlist *sgl,
+				unsigned int sg_count,
+				struct page **pages, bool to_bounce)
+{
+	struct scatterlist *sg;
+	unsigned int i, len, boff, chunk;
+	size_t pos = 0;
+	void *va, *bounce;
+
+	for_each_sg(sgl, sg, sg_count, i) {
+		va = kmap_atomic(sg_page(sg)) + sg->offset;
+		len = sg->length;
+
+		while (len) {
+			bounce = page_address(pages[pos >> PAGE_SHIFT]);
+			boff = pos & ~PAGE_MASK;
+			chunk = min_t(unsigned int, len, PAGE_SIZE - boff);
+
+			if (to_bounce)
+				memcpy(bounce + boff, va, chunk);
+			else
+				memcpy(va, bounce + boff, chunk);
+
+			va += chunk;
+			pos += chunk;
+			len -= chunk;
 		}
 
-		kunmap_atomic((void *)(dest_addr - cur_dest_sgl->offset));
-		cur_dest_sgl = sg_next(cur_dest_sgl);
+		kunmap_atomic(va - sg->length);
 	}
+}
+
+static int storvsc_bounce_map(struct storvsc_device *stor_device,
+			      struct storvsc_cmd_request *request,
+			      struct scatterlist *sgl, unsigned int sg_count,
+			      unsigned int len, bool write)
+{
+	struct storvsc_bounce_pool *pool;
+	unsigned int n = ALIGN(len, PAGE_SIZE) >> PAGE_SHIFT;
+
+	if (!request->bounce_pages) {
+		request->bounce_pages = kmalloc(stor_device->max_pfns *
+						sizeof(struct page *),
+						GFP_ATOMIC);
+		if (!request->bounce_pages)
+			return -ENOMEM;
+	}
+
+	pool = stor_device->bounce_pools[cpu_to_node(raw_smp_processor_id())];
+	if (!pool)
+		pool = stor_device->bounce_pools[first_online_node];
+
+	if (!storvsc_bounce_get(pool, request->bounce_pages, n, len))
+		return -ENOMEM;
 
-	local_irq_restore(flags);
-	return total_copied;
+	request->bounce_pool = pool;
+	request->bounce_count = n;
+
+	if (write)
+		storvsc_bounce_copy(sgl, sg_count, request->bounce_pages, true);
+
+	return 0;
 }
 
-/* Assume the bounce_sgl has enough room ie using the create_bounce_buffer() */
-static unsigned int copy_to_bounce_buffer(struct scatterlist *orig_sgl,
-					  struct scatterlist *bounce_sgl,
-					  unsigned int orig_sgl_count)
+static void storvsc_bounce_unmap(struct storvsc_cmd_request *request)
 {
-	int i;
-	unsigned long src, dest;
-	unsigned int srclen, destlen, copylen;
-	unsigned int total_copied = 0;
-	unsigned long bounce_addr = 0;
-	unsigned long src_addr = 0;
+	storvsc_bounce_put(request->bounce_pool, request->bounce_pages,
+			   request->bounce_count);
+	request->bounce_count = 0;
+}
+
+static void storvsc_free_bounce_pools(struct storvsc_device *stor_device)
+{
+	struct storvsc_bounce_pool *pool;
+	struct page *page, *tmp;
+	int node;
+
+	if (!stor_device->bounce_pools)
+		return;
+
+	for_each_node(node) {
+		pool = stor_device->bounce_pools[node];
+		if (!pool)
+			continue;
+		list_for_each_entry_safe(page, tmp, &pool->pages, lru)
+			__free_page(page);
+		kfree(pool);
+	}
+
+	kfree(stor_device->bounce_pools);
+	stor_device->bounce_pools = NULL;
+}
+
+static int storvsc_alloc_bounce_pools(struct storvsc_device *stor_device)
+{
+	struct storvsc_bounce_pool *pool;
+	struct page *page;
+	int node;
+
+	stor_device->bounce_pools = kcalloc(nr_node_ids, sizeof(void *),
+					    GFP_KERNEL);
+	if (!stor_device->bounce_pools)
+		return -ENOMEM;
+
+	for_each_online_node(node) {
+		pool = kzalloc_node(sizeof(*pool), GFP_KERNEL, node);
+		if (!pool)
+			goto err;
+
+		spin_lock_init(&pool->lock);
+		INIT_LIST_HEAD(&pool->pages);
+		pool->node = node;
+		pool->size = max(storvsc_bounce_pages, 0);
+		stor_device->bounce_pools[node] = pool;
+
+		while (pool->count < pool->size) {
+			page = alloc_pages_node(node, GFP_KERNEL, 0);
+			if (!page)
+				goto err;
+			list_add(&page->lru, &pool->pages);
+			pool->count++;
+		}
+	}
+
+	return 0;
+
+err:
+	storvsc_free_bounce_pools(stor_device);
+	return -ENOMEM;
+}
+
+static void storvsc_bounce_stats(struct storvsc_device *stor_device,
+				 u64 *commands, u64 *bytes, u64 *misses)
+{
+	struct storvsc_bounce_pool *pool;
 	unsigned long flags;
+	int node;
+
+	*commands = *bytes = *misses = 0;
+	for_each_node(node) {
+		pool = stor_device->bounce_pools[node];
+		if (!pool)
+			continue;
+		spin_lock_irqsave(&pool->lock, flags);
+		*commands += pool->commands;
+		*bytes += pool->bytes;
+		*misses += pool->misses;
+		spin_unlock_irqrestore(&pool->lock, flags);
+	}
+}
 
-	struct scatterlist *cur_src_sgl;
-	struct scatterlist *cur_dest_sgl;
+static void storvsc_complete_batch(struct storvsc_device *stor_device,
+				   struct list_head *batch);
 
-	local_irq_save(flags);
+static void storvsc_comp_work(struct work_struct *work)
+{
+	struct storvsc_chn_ctx *ctx =
+		container_of(work, struct storvsc_chn_ctx, work);
+	LIST_HEAD(batch);
+
+	spin_lock_irq(&ctx->lock);
+	list_splice_init(&ctx->done, &batch);
+	spin_unlock_irq(&ctx->lock);
+
+	/* Let the block softirq run when we are done, not from ksoftirqd */
+	local_bh_disable();
+	storvsc_complete_batch(ctx->stor_device, &batch);
+	local_bh_enable();
+}
 
-	cur_src_sgl = orig_sgl;
-	cur_dest_sgl = bounce_sgl;
+static void storvsc_alloc_chn_ctx(struct storvsc_device *stor_device,
+				  struct vmbus_channel *channel)
+{
+	struct storvsc_chn_ctx *ctx;
 
-	for (i = 0; i < orig_sgl_count; i++) {
-		src_addr = (unsigned long)
-				kmap_atomic(sg_page(cur_src_sgl)) +
-				cur_src_sgl->offset;
-		src = src_addr;
-		srclen = cur_src_sgl->length;
+	/* Without one the channel completes inline */
+	ctx = kzalloc_node(sizeof(*ctx), GFP_KERNEL,
+			   cpu_to_node(channel->target_cpu));
+	if (!ctx)
+		return;
 
-		if (bounce_addr == 0)
-			bounce_addr = (unsigned long)
-					kmap_atomic(sg_page(cur_dest_sgl));
+	ctx->stor_device = stor_device;
+	spin_lock_init(&ctx->lock);
+	INIT_LIST_HEAD(&ctx->done);
+	INIT_WORK(&ctx->work, storvsc_comp_work);
+	set_per_channel_state(channel, ctx);
+}
 
-		while (srclen) {
-			/* assume bounce offset always == 0 */
-			dest = bounce_addr + cur_dest_sgl->length;
-			destlen = PAGE_SIZE - cur_dest_sgl->length;
+/* Only once the channel is closed */
+static void storvsc_free_chn_ctx(struct vmbus_channel *channel)
+{
+	struct storvsc_chn_ctx *ctx = get_per_channel_state(channel);
 
-			copylen = min(srclen, destlen);
-			memcpy((void *)dest, (void *)src, copylen);
+	if (!ctx)
+		return;
 
-			total_copied += copylen;
-			cur_dest_sgl->length += copylen;
-			srclen -= copylen;
-			src += copylen;
+	flush_work(&ctx->work);
+	set_per_channel_state(channel, NULL);
+	kfree(ctx);
+}
 
-			if (cur_dest_sgl->length == PAGE_SIZE) {
-				/* full..move to next entry */
-				kunmap_atomic((void *)bounce_addr);
-				bounce_addr = 0;
-			}
+/*
+ * Recompute og_chns[] from the channels bound in stor_chns[]. CPUs of a
+ * node without a bound channel spread evenly over that node's channels;
+ * a node without any channel uses the primary channel. Called whenever a
+ * channel is opened or moves to another CPU and when the policy changes,
+ * so storvsc_do_io() only has to read one pointer.
+ */
+static void storvsc_update_og_chns(struct storvsc_device *stor_device)
+{
+	struct cpumask *node_mask = &stor_device->og_mask;
+	struct vmbus_channel *chn;
+	unsigned long flags;
+	int cpu, tgt_cpu, hash, n, policy;
+
+	if (!stor_device->og_chns)
+		return;
 
-			/* if we need to use another bounce buffer */
-			if (srclen && bounce_addr == 0) {
-				cur_dest_sgl = sg_next(cur_dest_sgl);
-				bounce_addr = (unsigned long)
-						kmap_atomic(
-						sg_page(cur_dest_sgl));
+	spin_lock_irqsave(&stor_device->chns_lock, flags);
+	/* Set from sysfs without the lock; use one value for the whole table */
+	policy = READ_ONCE(stor_device->chn_policy);
+	for_each_possible_cpu(cpu) {
+		cpumask_and(node_mask, &stor_device->alloced_cpus,
+			    cpumask_of_node(cpu_to_node(cpu)));
+		n = cpumask_weight(node_mask);
+
+		if (n == 0) {
+			chn = stor_device->device->channel;
+		} else if (cpumask_test_cpu(cpu, node_mask)) {
+			tgt_cpu = cpu;
+			if (policy == STORVSC_CHN_OTHER_CPU && n > 1) {
+				tgt_cpu = cpumask_next(cpu, node_mask);
+				if (tgt_cpu >= nr_cpu_ids)
+					tgt_cpu = cpumask_first(node_mask);
 			}
+			chn = stor_device->stor_chns[tgt_cpu];
+		} else {
+			hash = cpu % n;
+			for_each_cpu(tgt_cpu, node_mask)
+				if (hash-- == 0)
+					break;
+			chn = stor_device->stor_chns[tgt_cpu];
 		}
 
-		kunmap_atomic((void *)(src_addr - cur_src_sgl->offset));
-		cur_src_sgl = sg_next(cur_src_sgl);
+		WRITE_ONCE(stor_device->og_chns[cpu], chn);
 	}
+	spin_unlock_irqrestore(&stor_device->chns_lock, flags);
+}
+
+/*
+ * The interrupts of one of our channels moved from CPU old to CPU new, so
+ * send the I/O issued on new down that channel. Entries of stor_chns[] are
+ * only ever repointed, never cleared; a stale entry still names a working
+ * channel, and og_chns[] only uses entries of CPUs in alloced_cpus.
+ */
+static void storvsc_change_target_cpu(struct vmbus_channel *channel, u32 old,
+				      u32 new)
+{
+	struct hv_device *device = channel->primary_channel ?
+		channel->primary_channel->device_obj : channel->device_obj;
+	struct storvsc_device *stor_device;
+	struct vmbus_channel *cur_chn = NULL, *sc;
 
-	if (bounce_addr)
-		kunmap_atomic((void *)bounce_addr);
+	stor_device = get_out_stor_device(device);
+	if (!stor_device || !stor_device->stor_chns)
+		return;
+
+	/* Is another of our channels still bound to old? */
+	if (device->channel->target_cpu == old)
+		cur_chn = device->channel;
+	list_for_each_entry(sc, &device->channel->sc_list, sc_list)
+		if (sc->target_cpu == old && sc->state == CHANNEL_OPENED_STATE)
+			cur_chn = sc;
 
-	local_irq_restore(flags);
+	WRITE_ONCE(stor_device->stor_chns[new], channel);
+	cpumask_set_cpu(new, &stor_device->alloced_cpus);
+
+	if (cur_chn)
+		WRITE_ONCE(stor_device->stor_chns[old], cur_chn);
+	else
+		cpumask_clear_cpu(old, &stor_device->alloced_cpus);
 
-	return total_copied;
+	storvsc_update_og_chns(stor_device);
 }
 
 static void handle_sc_creation(struct vmbus_channel *new_sc)
@@ -943,6 +1264,8 @@ static void handle_sc_creation(struct vmbus_channel *new_sc)
 
 	memset(&props, 0, sizeof(struct vmstorage_channel_properties));
 
+	new_sc->change_target_cpu_callback = storvsc_change_target_cpu;
+	storvsc_alloc_chn_ctx(stor_device, new_sc);
 	vmbus_open(new_sc,
 		   storvsc_ringbuffer_size,
 		   storvsc_ringbuffer_size,
@@ -950,9 +1273,13 @@ static void handle_sc_creation(struct vmbus_channel *new_sc)
 		   sizeof(struct vmstorage_channel_properties),
 		   storvsc_on_channel_callback, new_sc);
 
+	if (new_sc->state != CHANNEL_OPENED_STATE)
+		storvsc_free_chn_ctx(new_sc);
+
 	if (new_sc->state == CHANNEL_OPENED_STATE) {
 		stor_device->stor_chns[new_sc->target_cpu] = new_sc;
 		cpumask_set_cpu(new_sc->target_cpu, &stor_device->alloced_cpus);
+		storvsc_update_og_chns(stor_device);
 	}
 }
 
@@ -1175,9 +1502,15 @@ static int storvsc_channel_init(struct hv_device *device, bool is_fc)
 	if (stor_device->stor_chns == NULL)
 		return -ENOMEM;
 
+	stor_device->og_chns = kcalloc(nr_cpu_ids, sizeof(void *),
+				       GFP_KERNEL);
+	if (stor_device->og_chns == NULL)
+		return -ENOMEM;
+
 	stor_device->stor_chns[device->channel->target_cpu] = device->channel;
 	cpumask_set_cpu(device->channel->target_cpu,
 			&stor_device->alloced_cpus);
+	storvsc_update_og_chns(stor_device);
 
 	if (vmstor_proto_version >= VMSTOR_PROTO_VERSION_WIN8) {
 		if (vstor_packet->storage_channel_properties.flags &
@@ -1312,24 +1645,19 @@ static void storvsc_command_completion(struct storvsc_cmd_request *cmd_request,
 	struct scsi_sense_hdr sense_hdr;
 	struct vmscsi_request *vm_srb;
 	u32 data_transfer_length;
-	struct stor_mem_pools *memp = scmnd->device->hostdata;
 	struct Scsi_Host *host;
-	u32 payload_sz = cmd_request->payload_sz;
-	void *payload = cmd_request->payload;
 
 	host = stor_dev->host;
 
 	vm_srb = &cmd_request->vstor_packet.vm_srb;
 	data_transfer_length = vm_srb->data_transfer_length;
 
-	if (cmd_request->bounce_sgl_count) {
+	if (cmd_request->bounce_count) {
 		if (vm_srb->data_in == READ_TYPE)
-			copy_from_bounce_buffer(scsi_sglist(scmnd),
-					cmd_request->bounce_sgl,
-					scsi_sg_count(scmnd),
-					cmd_request->bounce_sgl_count);
-		destroy_bounce_buffer(cmd_request->bounce_sgl,
-					cmd_request->bounce_sgl_count);
+			storvsc_bounce_copy(scsi_sglist(scmnd),
+					    scsi_sg_count(scmnd),
+					    cmd_request->bounce_pages, false);
+		storvsc_bounce_unmap(cmd_request);
 	}
 
 	scmnd->result = vm_srb->scsi_status;
@@ -1395,11 +1723,7 @@ static void storvsc_command_completion(struct storvsc_cmd_request *cmd_request,
 
 	scsi_done_fn(scmnd);
 
-	if (payload_sz >
-		sizeof(struct vmbus_channel_packet_multipage_buffer))
-		kfree(payload);
-
-	mempool_free(cmd_request, memp->request_mempool);
+	storvsc_put_request(stor_dev, cmd_request);
 }
 
 static void storvsc_on_io_completion(struct storvsc_device *stor_device,
@@ -1462,24 +1786,34 @@ static void storvsc_on_io_completion(struct storvsc_device *stor_device,
 
 	stor_pkt->vm_srb.data_transfer_length =
 	vstor_packet->vm_srb.data_transfer_length;
+}
 
-	storvsc_command_completion(request, stor_device);
-
-	if (atomic_dec_and_test(&stor_device->num_outstanding_req) &&
-		stor_device->drain_notify)
-		wake_up(&stor_device->waiting_to_drain);
+static void storvsc_complete_batch(struct storvsc_device *stor_device,
+				   struct list_head *batch)
+{
+	struct storvsc_cmd_request *request, *tmp;
+	int n = 0;
 
+	list_for_each_entry_safe(request, tmp, batch, entry) {
+		storvsc_command_completion(request, stor_device);
+		n++;
+	}
 
+	if (n && atomic_sub_and_test(n, &stor_device->num_outstanding_req) &&
+	    stor_device->drain_notify)
+		wake_up(&stor_device->waiting_to_drain);
 }
 
 static void storvsc_on_receive(struct storvsc_device *stor_device,
 			     struct vstor_packet *vstor_packet,
-			     struct storvsc_cmd_request *request)
+			     struct storvsc_cmd_request *request,
+			     struct list_head *batch)
 {
 	struct hv_host_device *host_dev;
 	switch (vstor_packet->operation) {
 	case VSTOR_OPERATION_COMPLETE_IO:
 		storvsc_on_io_completion(stor_device, vstor_packet, request);
+		list_add_tail(&request->entry, batch);
 		break;
 
 	case VSTOR_OPERATION_REMOVE_DEVICE:
@@ -1503,9 +1837,12 @@ static void storvsc_on_receive(struct storvsc_device *stor_device,
 static void storvsc_on_channel_callback(void *context)
 {
 	struct vmbus_channel *channel = (struct vmbus_channel *)context;
+	struct storvsc_chn_ctx *ctx = get_per_channel_state(channel);
 	const struct vmpacket_descriptor *desc;
 	struct hv_device *device;
 	struct storvsc_device *stor_device;
+	unsigned long flags;
+	LIST_HEAD(batch);
 
 	if (channel->primary_channel != NULL)
 		device = channel->primary_channel->device_obj;
@@ -1518,20 +1855,59 @@ static void storvsc_on_channel_callback(void *context)
 
 	foreach_vmbus_pkt(desc, channel) {
 		void *packet = hv_pkt_data(desc);
-		struct storvsc_cmd_request *request;
+		struct storvsc_cmd_request *request = NULL;
+		u64 trans_id = desc->trans_id;
 
-		request = (struct storvsc_cmd_request *)
-			((unsigned long)desc->trans_id);
-
-		if (request == &stor_device->init_request ||
-		    request == &stor_device->reset_request) {
+		if (trans_id == (unsigned long)&stor_device->init_request ||
+		    trans_id == (unsigned long)&stor_device->reset_request) {
+			request = (struct storvsc_cmd_request *)
+				((unsigned long)trans_id);
 			memcpy(&request->vstor_packet, packet,
 			       (sizeof(struct vstor_packet) - vmscsi_size_delta));
 			complete(&request->wait_event);
-		} else {
-			storvsc_on_receive(stor_device, packet, request);
+			continue;
 		}
+
+		/* Unsolicited packets from the host carry no slot */
+		if (trans_id != 0 && trans_id <= stor_device->nr_requests)
+			request = &stor_device->requests[trans_id - 1];
+		else if (((struct vstor_packet *)packet)->operation ==
+			 VSTOR_OPERATION_COMPLETE_IO) {
+			dev_warn_ratelimited(&device->device,
+					     "bad trans_id 0x%llx\n", trans_id);
+			continue;
+		}
+
+		storvsc_on_receive(stor_device, packet, request, &batch);
 	}
+
+	/*
+	 * The ring has been handed back to the host; now finish the SCSI
+	 * commands, all of them in one go.
+	 */
+	if (list_empty(&batch))
+		return;
+
+	if (ctx && READ_ONCE(stor_device->comp_mode) == STORVSC_COMP_THREAD) {
+		spin_lock_irqsave(&ctx->lock, flags);
+		list_splice_tail_init(&batch, &ctx->done);
+		spin_unlock_irqrestore(&ctx->lock, flags);
+		queue_work_on(channel->target_cpu, storvsc_comp_wq, &ctx->work);
+	} else {
+		storvsc_complete_batch(stor_device, &batch);
+	}
+}
+
+/*
+ * Divide the ring buffer data size by the max request size (which is
+ * vmbus_channel_packet_multipage_buffer + struct vstor_packet + u64)
+ */
+static u32 storvsc_max_outstanding(u32 ring_datasize)
+{
+	return ring_datasize / ALIGN(MAX_MULTIPAGE_BUFFER_PACKET +
+				     sizeof(struct vstor_packet) +
+				     sizeof(u64) - vmscsi_size_delta,
+				     sizeof(u64));
 }
 
 static int storvsc_connect_to_vsp(struct hv_device *device, u32 ring_size,
@@ -1542,6 +1918,8 @@ static int storvsc_connect_to_vsp(struct hv_device *device, u32 ring_size,
 
 	memset(&props, 0, sizeof(struct vmstorage_channel_properties));
 
+	device->channel->change_target_cpu_callback = storvsc_change_target_cpu;
+	storvsc_alloc_chn_ctx(hv_get_drvdata(device), device->channel);
 	ret = vmbus_open(device->channel,
 			 ring_size,
 			 ring_size,
@@ -1549,8 +1927,10 @@ static int storvsc_connect_to_vsp(struct hv_device *device, u32 ring_size,
 			 sizeof(struct vmstorage_channel_properties),
 			 storvsc_on_channel_callback, device->channel);
 
-	if (ret != 0)
+	if (ret != 0) {
+		storvsc_free_chn_ctx(device->channel);
 		return ret;
+	}
 
 	ret = storvsc_channel_init(device, is_fc);
 
@@ -1560,6 +1940,7 @@ static int storvsc_connect_to_vsp(struct hv_device *device, u32 ring_size,
 static int storvsc_dev_remove(struct hv_device *device)
 {
 	struct storvsc_device *stor_device;
+	struct vmbus_channel *sc;
 
 	stor_device = hv_get_drvdata(device);
 
@@ -1588,54 +1969,18 @@ static int storvsc_dev_remove(struct hv_device *device)
 	/* Close the channel */
 	vmbus_close(device->channel);
 
+	list_for_each_entry(sc, &device->channel->sc_list, sc_list)
+		storvsc_free_chn_ctx(sc);
+	storvsc_free_chn_ctx(device->channel);
+
+	storvsc_free_requests(stor_device);
+	storvsc_free_bounce_pools(stor_device);
+	kfree(stor_device->og_chns);
 	kfree(stor_device->stor_chns);
 	kfree(stor_device);
 	return 0;
 }
 
-static struct vmbus_channel *get_og_chn(struct storvsc_device *stor_device,
-					u16 q_num)
-{
-	u16 slot = 0;
-	u16 hash_qnum;
-	struct cpumask alloced_mask;
-	int num_channels, tgt_cpu;
-
-	if (stor_device->num_sc == 0)
-		return stor_device->device->channel;
-
-	/*
-	 * Our channel array is sparsley populated and we
-	 * initiated I/O on a processor/hw-q that does not
-	 * currently have a designated channel. Fix this.
-	 * The strategy is simple:
-	 * I. Ensure NUMA locality
-	 * II. Distribute evenly (best effort)
-	 * III. Mapping is persistent.
-	 */
-
-	cpumask_and(&alloced_mask, &stor_device->alloced_cpus,
-		    cpumask_of_node(cpu_to_node(q_num)));
-
-	num_channels = cpumask_weight(&alloced_mask);
-	if (num_channels == 0)
-		return stor_device->device->channel;
-
-	hash_qnum = q_num;
-	while (hash_qnum >= num_channels)
-		hash_qnum -= num_channels;
-
-	for_each_cpu(tgt_cpu, &alloced_mask) {
-		if (slot == hash_qnum)
-			break;
-		slot++;
-	}
-
-	stor_device->stor_chns[q_num] = stor_device->stor_chns[tgt_cpu];
-
-	return stor_device->stor_chns[q_num];
-}
-
 static int storvsc_do_io(struct hv_device *device,
 			 struct storvsc_cmd_request *request, u16 q_num)
 {
@@ -1643,8 +1988,6 @@ static int storvsc_do_io(struct hv_device *device,
 	struct vstor_packet *vstor_packet;
 	struct vmbus_channel *outgoing_channel;
 	int ret = 0;
-	struct cpumask alloced_mask;
-	int tgt_cpu;
 
 	vstor_packet = &request->vstor_packet;
 	stor_device = get_out_stor_device(device);
@@ -1659,27 +2002,7 @@ static int storvsc_do_io(struct hv_device *device,
 	 * We will base the request based on the CPU that is presenting
 	 * the I/O request.
 	 */
-	if (stor_device->stor_chns[q_num] != NULL) {
-		outgoing_channel = stor_device->stor_chns[q_num];
-		if (outgoing_channel->target_cpu == smp_processor_id()) {
-			/*
-			 * Ideally, we want to pick a different channel if
-			 * available on the same NUMA node.
-			 */
-			cpumask_and(&alloced_mask, &stor_device->alloced_cpus,
-				    cpumask_of_node(cpu_to_node(q_num)));
-			for_each_cpu_wrap(tgt_cpu, &alloced_mask,
-					outgoing_channel->target_cpu + 1) {
-				if (tgt_cpu != outgoing_channel->target_cpu) {
-					outgoing_channel =
-					stor_device->stor_chns[tgt_cpu];
-					break;
-				}
-			}
-		}
-	} else {
-		outgoing_channel = get_og_chn(stor_device, q_num);
-	}
+	outgoing_channel = READ_ONCE(stor_device->og_chns[q_num]);
 
 	vstor_packet->flags |= REQUEST_COMPLETION_FLAG;
 
@@ -1702,12 +2025,12 @@ static int storvsc_do_io(struct hv_device *device,
 				vstor_packet,
 				(sizeof(struct vstor_packet) -
 				vmscsi_size_delta),
-				(unsigned long)request);
+				storvsc_request_id(stor_device, request));
 	} else {
 		ret = vmbus_sendpacket(outgoing_channel, vstor_packet,
 			       (sizeof(struct vstor_packet) -
 				vmscsi_size_delta),
-			       (unsigned long)request,
+			       storvsc_request_id(stor_device, request),
 			       VM_PKT_DATA_INBAND,
 			       VMBUS_DATA_PACKET_FLAG_COMPLETION_REQUESTED);
 	}
@@ -1722,30 +2045,6 @@ static int storvsc_do_io(struct hv_device *device,
 
 static int storvsc_device_alloc(struct scsi_device *sdevice)
 {
-	struct stor_mem_pools *memp;
-	int number = STORVSC_MIN_BUF_NR;
-
-	memp = kzalloc(sizeof(struct stor_mem_pools), GFP_KERNEL);
-	if (!memp)
-		return -ENOMEM;
-
-	memp->request_pool =
-		kmem_cache_create(dev_name(&sdevice->sdev_dev),
-				sizeof(struct storvsc_cmd_request), 0,
-				SLAB_HWCACHE_ALIGN, NULL);
-
-	if (!memp->request_pool)
-		goto err0;
-
-	memp->request_mempool = mempool_create(number, mempool_alloc_slab,
-						mempool_free_slab,
-						memp->request_pool);
-
-	if (!memp->request_mempool)
-		goto err1;
-
-	sdevice->hostdata = memp;
-
 	/*
 	 * Set blist flag to permit the reading of the VPD pages even when
 	 * the target may claim SPC-2 compliance. MSFT targets currently
@@ -1758,26 +2057,6 @@ static int storvsc_device_alloc(struct scsi_device *sdevice)
 	sdevice->sdev_bflags = BLIST_REPORTLUN2;
 
 	return 0;
-
-err1:
-	kmem_cache_destroy(memp->request_pool);
-
-err0:
-	kfree(memp);
-	return -ENOMEM;
-}
-
-static void storvsc_device_destroy(struct scsi_device *sdevice)
-{
-	struct stor_mem_pools *memp = sdevice->hostdata;
-
-	if (!memp)
-		return;
-
-	mempool_destroy(memp->request_mempool);
-	kmem_cache_destroy(memp->request_pool);
-	kfree(memp);
-	sdevice->hostdata = NULL;
 }
 
 static int storvsc_device_configure(struct scsi_device *sdevice)
@@ -1943,14 +2222,12 @@ static int storvsc_queuecommand(struct Scsi_Host *host, struct scsi_cmnd *scmnd)
 	int ret;
 	struct hv_host_device *host_dev = shost_priv(host);
 	struct hv_device *dev = host_dev->dev;
+	struct storvsc_device *stor_device = hv_get_drvdata(dev);
 	struct storvsc_cmd_request *cmd_request;
-	unsigned int request_size = 0;
-	int i;
 	struct scatterlist *sgl;
 	unsigned int sg_count = 0;
 	struct vmscsi_request *vm_srb;
-	struct stor_mem_pools *memp = scmnd->device->hostdata;
-	struct scatterlist *cur_sgl;
+	unsigned int i;
 
 	struct vmbus_packet_mpb_array  *payload;
 	u32 payload_sz;
@@ -1972,19 +2249,17 @@ static int storvsc_queuecommand(struct Scsi_Host *host, struct scsi_cmnd *scmnd)
 		}
 	}
 
-	request_size = sizeof(struct storvsc_cmd_request);
-
-	cmd_request = mempool_alloc(memp->request_mempool,
-				       GFP_ATOMIC);
+	cmd_request = storvsc_get_request(stor_device);
+	if (!cmd_request)
+		return SCSI_MLQUEUE_HOST_BUSY;
 
 	/*
-	 * We might be invoked in an interrupt context; hence
-	 * mempool_alloc() can fail.
+	 * Slots are reused; clear what the code below does not always set.
 	 */
-	if (!cmd_request)
-		return SCSI_MLQUEUE_DEVICE_BUSY;
-
-	memset(cmd_request, 0, sizeof(struct storvsc_cmd_request));
+	cmd_request->bounce_count = 0;
+	cmd_request->mpb.range.len = 0;
+	cmd_request->mpb.range.offset = 0;
+	memset(&cmd_request->vstor_packet, 0, sizeof(struct vstor_packet));
 
 	/* Setup the cmd request */
 	cmd_request->cmd = scmnd;
@@ -2024,7 +2299,8 @@ static int storvsc_queuecommand(struct Scsi_Host *host, struct scsi_cmnd *scmnd)
 		 */
 		WARN(1, "Unexpected data direction: %d\n",
 		     scmnd->sc_data_direction);
-		return -EINVAL;
+		ret = -EINVAL;
+		goto queue_error;
 	}
 
 
@@ -2050,24 +2326,14 @@ static int storvsc_queuecommand(struct Scsi_Host *host, struct scsi_cmnd *scmnd)
 	if (sg_count) {
 		/* check if we need to bounce the sgl */
 		if (do_bounce_buffer(sgl, scsi_sg_count(scmnd)) != -1) {
-			cmd_request->bounce_sgl =
-				create_bounce_buffer(sgl, sg_count,
-						     length,
-						     vm_srb->data_in);
-			if (!cmd_request->bounce_sgl) {
+			if (storvsc_bounce_map(stor_device, cmd_request,
+					       sgl, sg_count, length,
+					       vm_srb->data_in == WRITE_TYPE)) {
 				ret = SCSI_MLQUEUE_HOST_BUSY;
 				goto queue_error;
 			}
 
-			cmd_request->bounce_sgl_count =
-				ALIGN(length, PAGE_SIZE) >> PAGE_SHIFT;
-
-			if (vm_srb->data_in == WRITE_TYPE)
-				copy_to_bounce_buffer(sgl,
-					cmd_request->bounce_sgl, sg_count);
-
-			sgl = cmd_request->bounce_sgl;
-			sg_count = cmd_request->bounce_sgl_count;
+			sg_count = cmd_request->bounce_count;
 		}
 
 
@@ -2075,24 +2341,26 @@ static int storvsc_queuecommand(struct Scsi_Host *host, struct scsi_cmnd *scmnd)
 
 			payload_sz = (sg_count * sizeof(u64) +
 				      sizeof(struct vmbus_packet_mpb_array));
-			payload = kzalloc(payload_sz, GFP_ATOMIC);
+			payload = storvsc_mpb_array(stor_device, cmd_request);
 			if (!payload) {
-				if (cmd_request->bounce_sgl_count)
-					destroy_bounce_buffer(
-					cmd_request->bounce_sgl,
-					cmd_request->bounce_sgl_count);
+				if (cmd_request->bounce_count)
+					storvsc_bounce_unmap(cmd_request);
 
-				return SCSI_MLQUEUE_DEVICE_BUSY;
+				ret = SCSI_MLQUEUE_DEVICE_BUSY;
+				goto queue_error;
 			}
 		}
 
 		payload->range.len = length;
-		payload->range.offset = sgl[0].offset;
-		cur_sgl = sgl;
-		for (i = 0; i < sg_count; i++) {
-			payload->range.pfn_array[i] =
-				page_to_pfn(sg_page((cur_sgl)));
-			cur_sgl = sg_next(cur_sgl);
+		if (cmd_request->bounce_count) {
+			payload->range.offset = 0;
+			for (i = 0; i < sg_count; i++)
+				payload->range.pfn_array[i] = page_to_pfn(
+					cmd_request->bounce_pages[i]);
+		} else {
+			payload->range.offset = sgl[0].offset;
+			storvsc_fill_pfns(payload->range.pfn_array, sgl,
+					  sg_count);
 		}
 	}
 
@@ -2103,13 +2371,10 @@ static int storvsc_queuecommand(struct Scsi_Host *host, struct scsi_cmnd *scmnd)
 	put_cpu();
 
 	if (ret == -EAGAIN) {
-		if (payload_sz > sizeof(cmd_request->mpb))
-			kfree(payload);
 		/* no more space */
 
-		if (cmd_request->bounce_sgl_count)
-			destroy_bounce_buffer(cmd_request->bounce_sgl,
-					cmd_request->bounce_sgl_count);
+		if (cmd_request->bounce_count)
+			storvsc_bounce_unmap(cmd_request);
 
 		ret = SCSI_MLQUEUE_DEVICE_BUSY;
 		goto queue_error;
@@ -2118,11 +2383,118 @@ static int storvsc_queuecommand(struct Scsi_Host *host, struct scsi_cmnd *scmnd)
 	return 0;
 
 queue_error:
-	mempool_free(cmd_request, memp->request_mempool);
+	storvsc_put_request(stor_device, cmd_request);
 	scmnd->host_scribble = NULL;
 	return ret;
 }
 
+static struct storvsc_device *storvsc_host_to_device(struct device *dev)
+{
+	struct hv_host_device *host_dev = shost_priv(class_to_shost(dev));
+
+	return hv_get_drvdata(host_dev->dev);
+}
+
+static ssize_t bounce_commands_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	u64 commands, bytes, misses;
+
+	storvsc_bounce_stats(storvsc_host_to_device(dev),
+			     &commands, &bytes, &misses);
+	return sprintf(buf, "%llu\n", commands);
+}
+static DEVICE_ATTR(bounce_commands, S_IRUGO, bounce_commands_show, NULL);
+
+static ssize_t bounce_bytes_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	u64 commands, bytes, misses;
+
+	storvsc_bounce_stats(storvsc_host_to_device(dev),
+			     &commands, &bytes, &misses);
+	return sprintf(buf, "%llu\n", bytes);
+}
+static DEVICE_ATTR(bounce_bytes, S_IRUGO, bounce_bytes_show, NULL);
+
+static ssize_t bounce_pool_misses_show(struct device *dev,
+				       struct device_attribute *attr,
+				       char *buf)
+{
+	u64 commands, bytes, misses;
+
+	storvsc_bounce_stats(storvsc_host_to_device(dev),
+			     &commands, &bytes, &misses);
+	return sprintf(buf, "%llu\n", misses);
+}
+static DEVICE_ATTR(bounce_pool_misses, S_IRUGO, bounce_pool_misses_show, NULL);
+
+static ssize_t channel_policy_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct storvsc_device *stor_device = storvsc_host_to_device(dev);
+
+	return sprintf(buf, "%s\n",
+		       storvsc_chn_policy_names[stor_device->chn_policy]);
+}
+
+static ssize_t channel_policy_store(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	struct storvsc_device *stor_device = storvsc_host_to_device(dev);
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(storvsc_chn_policy_names); i++) {
+		if (sysfs_streq(buf, storvsc_chn_policy_names[i])) {
+			WRITE_ONCE(stor_device->chn_policy, i);
+			storvsc_update_og_chns(stor_device);
+			return count;
+		}
+	}
+
+	return -EINVAL;
+}
+static DEVICE_ATTR(channel_policy, S_IRUGO | S_IWUSR, channel_policy_show,
+		   channel_policy_store);
+
+static ssize_t completion_mode_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct storvsc_device *stor_device = storvsc_host_to_device(dev);
+
+	return sprintf(buf, "%s\n",
+		       storvsc_comp_mode_names[stor_device->comp_mode]);
+}
+
+static ssize_t completion_mode_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	struct storvsc_device *stor_device = storvsc_host_to_device(dev);
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(storvsc_comp_mode_names); i++) {
+		if (sysfs_streq(buf, storvsc_comp_mode_names[i])) {
+			WRITE_ONCE(stor_device->comp_mode, i);
+			return count;
+		}
+	}
+
+	return -EINVAL;
+}
+static DEVICE_ATTR(completion_mode, S_IRUGO | S_IWUSR, completion_mode_show,
+		   completion_mode_store);
+
+static struct device_attribute *storvsc_host_attrs[] = {
+	&dev_attr_channel_policy,
+	&dev_attr_completion_mode,
+	&dev_attr_bounce_commands,
+	&dev_attr_bounce_bytes,
+	&dev_attr_bounce_pool_misses,
+	NULL,
+};
+
 #ifdef CONFIG_X86_64
 #define STORVSC_TABLE_SEZE 512
 #else
@@ -2137,8 +2509,8 @@ static struct scsi_host_template scsi_driver = {
 	.eh_host_reset_handler =	storvsc_host_reset_handler,
 	.eh_timed_out =		storvsc_eh_timed_out,
 	.slave_alloc =		storvsc_device_alloc,
-	.slave_destroy =	storvsc_device_destroy,
 	.slave_configure =	storvsc_device_configure,
+	.shost_attrs =		storvsc_host_attrs,
 	.cmd_per_lun =		2048,
 	.this_id =		-1,
 	.sg_tablesize = STORVSC_TABLE_SEZE,
@@ -2240,6 +2612,9 @@ static int storvsc_probe(struct hv_device *device,
 
 	stor_device->destroy = false;
 	stor_device->open_sub_channel = false;
+	spin_lock_init(&stor_device->chns_lock);
+	stor_device->chn_policy = STORVSC_CHN_OTHER_CPU;
+	stor_device->comp_mode = STORVSC_COMP_INLINE;
 	init_waitqueue_head(&stor_device->waiting_to_drain);
 	stor_device->device = device;
 	stor_device->host = host;
@@ -2253,6 +2628,19 @@ static int storvsc_probe(struct hv_device *device,
 	host_dev->path = stor_device->path_id;
 	host_dev->target = stor_device->target_id;
 
+	/* The ring may have been resized through sysfs, see vmbus_open() */
+	host->can_queue = storvsc_max_outstanding(
+				device->channel->outbound.ring_datasize) *
+			  (max_sub_channels + 1);
+
+	ret = storvsc_alloc_requests(stor_device, host->can_queue);
+	if (ret)
+		goto err_out2;
+
+	ret = storvsc_alloc_bounce_pools(stor_device);
+	if (ret)
+		goto err_out2;
+
 	switch (dev_id->driver_data) {
 	case SFC_GUID:
 		host->max_lun = STORVSC_FC_MAX_LUNS_PER_TARGET;
@@ -2285,6 +2673,9 @@ static int storvsc_probe(struct hv_device *device,
 #ifdef CONFIG_X86_64
 	host->sg_tablesize = (stor_device->max_transfer_bytes >> PAGE_SHIFT);
 #endif
+	/* Either the scatterlist or a bounce buffer covering max_sectors */
+	stor_device->max_pfns = max_t(u32, host->sg_tablesize,
+				      host->max_sectors >> (PAGE_SHIFT - 9));
 
 #if (RHEL_RELEASE_CODE > RHEL_RELEASE_VERSION(7,2))
 	/*
@@ -2351,6 +2742,7 @@ err_out2:
 	goto err_out0;
 
 err_out1:
+	kfree(stor_device->og_chns);
 	kfree(stor_device->stor_chns);
 	kfree(stor_device);
 
@@ -2405,17 +2797,11 @@ static int __init storvsc_drv_init(void)
 	int ret;
 
 	/*
-	 * Divide the ring buffer data size (which is 1 page less
-	 * than the ring buffer size since that page is reserved for
-	 * the ring buffer indices) by the max request size (which is
-	 * vmbus_channel_packet_multipage_buffer + struct vstor_packet + u64)
+	 * The ring buffer data size is 1 page less than the ring buffer
+	 * size since that page is reserved for the ring buffer indices.
 	 */
 	max_outstanding_req_per_channel =
-		((storvsc_ringbuffer_size - PAGE_SIZE) /
-		ALIGN(MAX_MULTIPAGE_BUFFER_PACKET +
-		sizeof(struct vstor_packet) + sizeof(u64) -
-		vmscsi_size_delta,
-		sizeof(u64)));
+		storvsc_max_outstanding(storvsc_ringbuffer_size - PAGE_SIZE);
 
 
 #if defined(CONFIG_SCSI_FC_ATTRS) || defined(CONFIG_SCSI_FC_ATTRS_MODULE)
@@ -2430,9 +2816,19 @@ static int __init storvsc_drv_init(void)
 	fc_transport_template->user_scan = NULL;
 #endif
 
+	storvsc_comp_wq = alloc_workqueue("storvsc_comp",
+					  WQ_HIGHPRI | WQ_MEM_RECLAIM, 0);
+	if (!storvsc_comp_wq) {
+		ret = -ENOMEM;
+		goto err_wq;
+	}
+
 	mutex_init(&probe_mutex);
 	ret = vmbus_driver_register(&storvsc_drv);
+	if (ret)
+		destroy_workqueue(storvsc_comp_wq);
 
+err_wq:
 #if defined(CONFIG_SCSI_FC_ATTRS) || defined(CONFIG_SCSI_FC_ATTRS_MODULE)
 	if (ret)
 		fc_release_transport(fc_transport_template);
@@ -2444,6 +2840,7 @@ static int __init storvsc_drv_init(void)
 static void __exit storvsc_drv_exit(void)
 {
 	vmbus_driver_unregister(&storvsc_drv);
+	destroy_workqueue(storvsc_comp_wq);
 #if defined(CONFIG_SCSI_FC_ATTRS) || defined(CONFIG_SCSI_FC_ATTRS_MODULE)
 	fc_release_transport(fc_transport_template);
 #endif
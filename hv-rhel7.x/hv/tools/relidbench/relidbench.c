@@ -0,0 +1,303 @@
+/*
+ * Microbenchmark for VMBus relid to channel lookup.
+ *
+ * Copyright (c) 2018, Microsoft Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * Models the two lookups vmbus_chan_sched() and relid2channel() have used:
+ *
+ *   list:  walk the per-CPU channel list for every pending event bit, and
+ *          walk every primary channel and its sub-channels for relid2channel
+ *   array: index vmbus_connection.channels[] by relid
+ *
+ * Channels are allocated one by one in random order, so list walks take
+ * the cache misses they would take in the kernel. For each channel count
+ * a random quarter of the channels is signaled per round, and the cost per
+ * dispatched event is reported (including the walk over the event page, which
+ * is why small channel counts show a few ns of fixed overhead).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define HV_EVENT_FLAGS_COUNT	(256 * 8)
+#define MAX_CHANNEL_RELIDS	HV_EVENT_FLAGS_COUNT
+#define BITS_PER_LONG		(8 * sizeof(unsigned long))
+
+struct channel {
+	uint32_t child_relid;
+	uint32_t target_cpu;
+	bool rescind;
+	unsigned long events;		/* stands in for the callback */
+	struct channel *percpu_next;	/* old hv_cpu->chan_list */
+	struct channel *list_next;	/* old vmbus_connection.chn_list */
+	struct channel *sc_next;	/* old primary->sc_list */
+	struct channel *sc_head;
+	char pad[512];			/* keep channels on separate lines */
+};
+
+static struct channel *percpu_head[64];
+static struct channel *chn_list;
+static struct channel *channels[MAX_CHANNEL_RELIDS];
+static unsigned long event_page[MAX_CHANNEL_RELIDS / BITS_PER_LONG];
+
+static unsigned int nr_cpus = 8;
+static unsigned int nr_subchannels = 7;
+static unsigned int rounds = 20000;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static struct channel *relid2channel_list(uint32_t relid)
+{
+	struct channel *channel, *sc;
+
+	for (channel = chn_list; channel; channel = channel->list_next) {
+		if (channel->child_relid == relid)
+			return channel;
+		for (sc = channel->sc_head; sc; sc = sc->sc_next)
+			if (sc->child_relid == relid)
+				return sc;
+	}
+	return NULL;
+}
+
+static struct channel *relid2channel_array(uint32_t relid)
+{
+	if (relid >= MAX_CHANNEL_RELIDS)
+		return NULL;
+	return __atomic_load_n(&channels[relid], __ATOMIC_CONSUME);
+}
+
+/* The old vmbus_chan_sched() loop body */
+static void sched_list(unsigned int cpu, uint32_t relid)
+{
+	struct channel *channel;
+
+	for (channel = percpu_head[cpu]; channel;
+	     channel = channel->percpu_next) {
+		if (channel->child_relid != relid)
+			continue;
+		if (channel->rescind)
+			continue;
+		channel->events++;
+	}
+}
+
+/* The new vmbus_chan_sched() loop body */
+static void sched_array(unsigned int cpu, uint32_t relid)
+{
+	struct channel *channel = relid2channel_array(relid);
+
+	(void)cpu;
+	if (channel == NULL || channel->rescind)
+		return;
+	channel->events++;
+}
+
+static void setup(unsigned int count, struct channel **all)
+{
+	unsigned int i, j, per_primary = nr_subchannels + 1;
+	struct channel *primary = NULL;
+	unsigned int *order;
+
+	memset(percpu_head, 0, sizeof(percpu_head));
+	memset(channels, 0, sizeof(channels));
+	chn_list = NULL;
+
+	/* Allocate in shuffled order so neighbours are not adjacent */
+	order = malloc(count * sizeof(*order));
+	for (i = 0; i < count; i++)
+		order[i] = i;
+	for (i = count - 1; i > 0; i--) {
+		j = rand() % (i + 1);
+		unsigned int t = order[i];
+
+		order[i] = order[j];
+		order[j] = t;
+	}
+	for (i = 0; i < count; i++)
+		all[order[i]] = calloc(1, sizeof(struct channel));
+	free(order);
+
+	for (i = 0; i < count; i++) {
+		struct channel *c = all[i];
+
+		c->child_relid = i + 1;		/* relid 0 is the message SINT */
+		c->target_cpu = i % nr_cpus;
+
+		if (i % per_primary == 0) {
+			c->list_next = chn_list;
+			chn_list = c;
+			primary = c;
+		} else {
+			c->sc_next = primary->sc_head;
+			primary->sc_head = c;
+		}
+
+		c->percpu_next = percpu_head[c->target_cpu];
+		percpu_head[c->target_cpu] = c;
+		channels[c->child_relid] = c;
+	}
+}
+
+static void teardown(unsigned int count, struct channel **all)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		free(all[i]);
+}
+
+/* Set the event bits of a random quarter of the channels */
+static unsigned int raise_events(unsigned int count)
+{
+	unsigned int i, n = count / 4 ? count / 4 : 1;
+
+	for (i = 0; i < n; i++) {
+		uint32_t relid = 1 + rand() % count;
+
+		event_page[relid / BITS_PER_LONG] |= 1ul << (relid % BITS_PER_LONG);
+	}
+	return n;
+}
+
+/* Walk set bits like for_each_set_bit() + sync_test_and_clear_bit() */
+static uint64_t dispatch(struct channel **all,
+			 void (*sched)(unsigned int, uint32_t))
+{
+	unsigned int w;
+	uint64_t n = 0;
+
+	for (w = 0; w < MAX_CHANNEL_RELIDS / BITS_PER_LONG; w++) {
+		unsigned long bits = event_page[w];
+
+		event_page[w] = 0;
+		while (bits) {
+			uint32_t relid = w * BITS_PER_LONG + __builtin_ctzl(bits);
+
+			bits &= bits - 1;
+			sched(all[relid - 1]->target_cpu, relid);
+			n++;
+		}
+	}
+	return n;
+}
+
+static double bench_sched(unsigned int count, struct channel **all,
+			  void (*sched)(unsigned int, uint32_t))
+{
+	static unsigned long saved[MAX_CHANNEL_RELIDS / BITS_PER_LONG];
+	uint64_t start, elapsed = 0, events = 0;
+	unsigned int r, k;
+
+	/* Replay each event pattern a few times to amortize the clock reads */
+	srand(count);
+	for (r = 0; r < rounds / 16; r++) {
+		raise_events(count);
+		memcpy(saved, event_page, sizeof(saved));
+		start = now_ns();
+		for (k = 0; k < 16; k++) {
+			memcpy(event_page, saved, sizeof(saved));
+			events += dispatch(all, sched);
+		}
+		elapsed += now_ns() - start;
+	}
+	return events ? (double)elapsed / events : 0;
+}
+
+static double bench_lookup(unsigned int count,
+			   struct channel *(*lookup)(uint32_t))
+{
+	static uint32_t relids[4096];
+	uint64_t start, n = rounds * 8ull, i;
+	volatile uintptr_t sink = 0;
+
+	srand(count);
+	for (i = 0; i < 4096; i++)
+		relids[i] = 1 + rand() % count;
+
+	start = now_ns();
+	for (i = 0; i < n; i++)
+		sink += (uintptr_t)lookup(relids[i & 4095]);
+	(void)sink;
+	return (double)(now_ns() - start) / n;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -c cpus      CPUs channels are spread over (default 8)\n"
+		"  -s count     sub-channels per primary channel (default 7)\n"
+		"  -r rounds    event rounds per channel count (default 20000)\n",
+		prog);
+}
+
+int main(int argc, char *argv[])
+{
+	static const unsigned int counts[] = {
+		8, 16, 32, 64, 128, 256, 512, 1024
+	};
+	static struct channel *all[MAX_CHANNEL_RELIDS];
+	unsigned int i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:s:r:h")) != -1) {
+		switch (opt) {
+		case 'c':
+			nr_cpus = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			nr_subchannels = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			rounds = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (nr_cpus == 0 || nr_cpus > 64 || rounds == 0) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	printf("cpus=%u subchannels/primary=%u, ns per event / lookup\n",
+	       nr_cpus, nr_subchannels);
+	printf("%-9s %-12s %-12s %-12s %-12s\n", "channels",
+	       "sched_list", "sched_array", "relid_list", "relid_array");
+
+	for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		unsigned int count = counts[i];
+
+		setup(count, all);
+		printf("%-9u %-12.1f %-12.1f %-12.1f %-12.1f\n", count,
+		       bench_sched(count, all, sched_list),
+		       bench_sched(count, all, sched_array),
+		       bench_lookup(count, relid2channel_list),
+		       bench_lookup(count, relid2channel_array));
+		teardown(count, all);
+	}
+
+	return 0;
+}
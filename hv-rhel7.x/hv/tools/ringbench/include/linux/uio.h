@@ -0,0 +1 @@
+/* Provided by ringbench.h */
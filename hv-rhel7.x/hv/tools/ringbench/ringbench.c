@@ -0,0 +1,968 @@
+/*
+ * VMBus ring buffer simulator and throughput benchmark.
+ *
+ * Copyright (c) 2018, Microsoft Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * The guest side runs the driver's ring_buffer.c unmodified. A "host" thread
+ * plays the other end of the double-mapped rings and follows the Hyper-V
+ * rules: it masks interrupts while draining the guest->host ring, signals
+ * the guest only on empty to non-empty transitions of the host->guest ring,
+ * and uses pending_send_sz when the host->guest ring is full.
+ *
+ *   tx: guest sender thread(s) -> hv_ringbuffer_write() -> host consumer
+ *   rx: host producer -> hv_pkt_iter_*(), hv_ringbuffer_read() or
+ *       vmbus_borrow_packet() -> guest
+ *
+ * Every packet carries a timestamp and a per-sender sequence number; the
+ * receiving side checks ordering and payload integrity and records latency.
+ * A doorbell that stays silent for a second while there is data in the ring
+ * is counted as a missed signal. Any error or missed signal makes the run
+ * fail, so "make check" can gate changes to the ring buffer code.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include "ringbench.h"
+
+#define VMBUS_PKT_TRAILER	8
+#define MAX_SENDERS		64
+#define DOORBELL_TIMEOUT_MS	1000
+#define PKT_MAGIC		0x5a5a5a5a5a5a5a5aULL
+
+enum bench_mode {
+	BENCH_TX,
+	BENCH_RX,
+};
+
+/* How the guest takes packets off the host->guest ring */
+enum bench_rx_api {
+	RX_ITER,	/* foreach_vmbus_pkt(), one close per batch */
+	RX_COPY,	/* hv_ringbuffer_read() */
+	RX_BORROW,	/* vmbus_borrow_packet() / vmbus_release_packet() */
+};
+
+static const char * const rx_api_names[] = { "rx", "rc", "rb" };
+
+struct bench_opts {
+	enum bench_mode mode;
+	u32 pkt_size;		/* payload bytes per packet */
+	u32 ring_size;		/* bytes, including the header page */
+	u32 senders;		/* guest threads, tx only */
+	u32 batch;		/* packets per hv_ringbuffer_write_batch() */
+	u64 count;		/* total packets */
+	u32 host_delay;		/* host busy time per packet, ns */
+	enum bench_rx_api rx_api;
+	bool verify;		/* check every payload byte */
+};
+
+/* Leading bytes of every payload */
+struct bench_hdr {
+	u64 tstamp;
+	u32 sender;
+	u32 seq;
+};
+
+struct bench_result {
+	u64 packets;
+	u64 bytes;
+	u64 elapsed;		/* ns */
+	u64 signals;		/* guest->host, vmbus_setevent() */
+	u64 host_signals;	/* host->guest interrupts */
+	u64 eagain;		/* ring full events seen by the writer */
+	u64 missed;		/* doorbell timeouts with data pending */
+	u64 errors;		/* sequence or payload mismatches */
+	u64 lat_p50, lat_p99, lat_p999, lat_max;
+};
+
+static struct bench_opts opts;
+static struct vmbus_channel chan;
+static struct vmbus_channel_stats chan_stats;
+static int host_efd, guest_efd;
+static pthread_barrier_t start_barrier;
+
+static u64 stat_signals, stat_host_signals, stat_eagain;
+static u64 stat_missed, stat_errors;
+static u64 rcv_packets, rcv_bytes;
+static u32 *lat_samples;
+static u32 next_seq[MAX_SENDERS];
+static u64 t_start;
+static volatile bool stop;
+
+static inline u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void spin_ns(u32 ns)
+{
+	u64 end;
+
+	if (!ns)
+		return;
+
+	end = now_ns() + ns;
+	while (now_ns() < end)
+		__builtin_ia32_pause();
+}
+
+/*
+ * Shared memory backing for the rings. vmap() maps the pages described by
+ * the struct page array at consecutive addresses, which gives the same
+ * wraparound mapping the kernel sets up in hv_ringbuffer_init().
+ */
+#define MAX_VMAPS	8
+
+static struct {
+	const void *addr;
+	size_t len;
+} vmaps[MAX_VMAPS];
+
+void *vmap(struct page **pages, unsigned int count,
+	   unsigned long flags, int prot)
+{
+	size_t len = (size_t)count * PAGE_SIZE;
+	unsigned int i;
+	char *base;
+
+	(void)flags;
+	(void)prot;
+
+	base = mmap(NULL, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	for (i = 0; i < count; i++) {
+		if (mmap(base + i * PAGE_SIZE, PAGE_SIZE,
+			 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+			 pages[i]->fd, pages[i]->offset) == MAP_FAILED) {
+			munmap(base, len);
+			return NULL;
+		}
+	}
+
+	for (i = 0; i < MAX_VMAPS; i++) {
+		if (!vmaps[i].addr) {
+			vmaps[i].addr = base;
+			vmaps[i].len = len;
+			break;
+		}
+	}
+
+	return base;
+}
+
+void vunmap(const void *addr)
+{
+	int i;
+
+	for (i = 0; i < MAX_VMAPS; i++) {
+		if (vmaps[i].addr == addr) {
+			munmap((void *)addr, vmaps[i].len);
+			vmaps[i].addr = NULL;
+			return;
+		}
+	}
+}
+
+static int ring_fd = -1;
+
+static int channel_open(u32 ring_size)
+{
+	u32 page_cnt = ring_size >> PAGE_SHIFT;
+	char path[] = "/dev/shm/hv_ringbench.XXXXXX";
+	struct page *pages;
+	u32 i;
+	int ret;
+
+	ring_fd = mkstemp(path);
+	if (ring_fd < 0) {
+		strcpy(path, "/tmp/hv_ringbench.XXXXXX");
+		ring_fd = mkstemp(path);
+	}
+	if (ring_fd < 0)
+		return -errno;
+	unlink(path);
+
+	if (ftruncate(ring_fd, (off_t)page_cnt * 2 * PAGE_SIZE))
+		return -errno;
+
+	pages = calloc(page_cnt * 2, sizeof(*pages));
+	if (!pages)
+		return -ENOMEM;
+
+	for (i = 0; i < page_cnt * 2; i++) {
+		pages[i].fd = ring_fd;
+		pages[i].offset = (long)i * PAGE_SIZE;
+	}
+
+	memset(&chan, 0, sizeof(chan));
+	memset(&chan_stats, 0, sizeof(chan_stats));
+	chan.stats = &chan_stats;
+
+	/* Same split as vmbus_open(): outbound first, then inbound */
+	ret = hv_ringbuffer_init(&chan.outbound, pages, page_cnt);
+	if (!ret)
+		ret = hv_ringbuffer_init(&chan.inbound, &pages[page_cnt],
+					 page_cnt);
+
+	free(pages);
+	return ret;
+}
+
+static void channel_close(void)
+{
+	hv_ringbuffer_cleanup(&chan.outbound);
+	hv_ringbuffer_cleanup(&chan.inbound);
+	close(ring_fd);
+	ring_fd = -1;
+}
+
+/*
+ * Doorbells. vmbus_setevent() is the guest's only way to interrupt the
+ * host; the host interrupts the guest through guest_efd.
+ */
+void vmbus_setevent(struct vmbus_channel *channel)
+{
+	u64 one = 1;
+
+	(void)channel;
+	__atomic_add_fetch(&stat_signals, 1, __ATOMIC_RELAXED);
+	if (write(host_efd, &one, sizeof(one)) != sizeof(one))
+		abort();
+}
+
+static void host_interrupt_guest(void)
+{
+	u64 one = 1;
+
+	stat_host_signals++;
+	if (write(guest_efd, &one, sizeof(one)) != sizeof(one))
+		abort();
+}
+
+/* Returns false if nothing rang within DOORBELL_TIMEOUT_MS. */
+static bool doorbell_wait(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	u64 val;
+
+	if (poll(&pfd, 1, DOORBELL_TIMEOUT_MS) <= 0)
+		return false;
+
+	if (read(fd, &val, sizeof(val)) != sizeof(val))
+		abort();
+	return true;
+}
+
+/* Payload helpers */
+static void payload_fill(u8 *buf, u32 len, u32 sender)
+{
+	u32 i;
+
+	for (i = sizeof(struct bench_hdr); i < len; i++)
+		buf[i] = (u8)(i ^ sender);
+}
+
+static void payload_stamp(u8 *buf, u32 len, u32 sender, u32 seq)
+{
+	struct bench_hdr *hdr = (struct bench_hdr *)buf;
+	u64 tail = PKT_MAGIC ^ seq;
+
+	hdr->sender = sender;
+	hdr->seq = seq;
+	if (len >= sizeof(*hdr) + sizeof(tail))
+		memcpy(buf + len - sizeof(tail), &tail, sizeof(tail));
+	hdr->tstamp = now_ns();
+}
+
+/* Strip the 8 byte alignment padding the sender added */
+static inline u32 payload_len(u32 datalen)
+{
+	u32 packetlen = sizeof(struct vmpacket_descriptor) + opts.pkt_size;
+
+	return datalen - (ALIGN(packetlen, sizeof(u64)) - packetlen);
+}
+
+/* Called once per received packet by whichever side is consuming. */
+static void payload_check(const u8 *buf, u32 len, u64 now)
+{
+	const struct bench_hdr *hdr = (const struct bench_hdr *)buf;
+	u64 tail = PKT_MAGIC ^ hdr->seq;
+	u32 i;
+
+	if (len != opts.pkt_size || hdr->sender >= MAX_SENDERS ||
+	    hdr->seq != next_seq[hdr->sender]) {
+		stat_errors++;
+		return;
+	}
+	next_seq[hdr->sender]++;
+
+	if (len >= sizeof(*hdr) + sizeof(tail) &&
+	    memcmp(buf + len - sizeof(tail), &tail, sizeof(tail)))
+		stat_errors++;
+
+	if (opts.verify) {
+		for (i = sizeof(*hdr); i + sizeof(tail) < len; i++) {
+			if (buf[i] != (u8)(i ^ hdr->sender)) {
+				stat_errors++;
+				break;
+			}
+		}
+	}
+
+	lat_samples[rcv_packets] = now - hdr->tstamp > UINT32_MAX ?
+		UINT32_MAX : (u32)(now - hdr->tstamp);
+	rcv_packets++;
+	rcv_bytes += len;
+}
+
+/* Same packet layout as vmbus_sendpacket() in channel.c */
+static int bench_sendpacket(struct vmbus_channel *channel, void *buffer,
+			    u32 bufferlen, u64 requestid)
+{
+	struct vmpacket_descriptor desc;
+	u32 packetlen = sizeof(struct vmpacket_descriptor) + bufferlen;
+	u32 packetlen_aligned = ALIGN(packetlen, sizeof(u64));
+	struct kvec bufferlist[3];
+	u64 aligned_data = 0;
+
+	desc.type = VM_PKT_DATA_INBAND;
+	desc.flags = 0;
+	desc.offset8 = sizeof(struct vmpacket_descriptor) >> 3;
+	desc.len8 = (u16)(packetlen_aligned >> 3);
+	desc.trans_id = requestid;
+
+	bufferlist[0].iov_base = &desc;
+	bufferlist[0].iov_len = sizeof(struct vmpacket_descriptor);
+	bufferlist[1].iov_base = buffer;
+	bufferlist[1].iov_len = bufferlen;
+	bufferlist[2].iov_base = &aligned_data;
+	bufferlist[2].iov_len = (packetlen_aligned - packetlen);
+
+	return hv_ringbuffer_write(channel, bufferlist, 3);
+}
+
+/* Same packet layout as vmbus_sendpacket_batch() for in-band packets */
+static int bench_sendbatch(struct vmbus_channel *channel,
+			   struct vmbus_batch_packet *pkts, u32 count,
+			   u32 *sent)
+{
+	static const u64 aligned_data;
+	struct vmbus_batch_packet *pkt;
+	u32 packetlen, packetlen_aligned;
+	u32 i;
+
+	for (i = 0; i < count; i++) {
+		pkt = &pkts[i];
+		packetlen = sizeof(struct vmpacket_descriptor) + pkt->bufferlen;
+		packetlen_aligned = ALIGN(packetlen, sizeof(u64));
+
+		pkt->desc.inband.type = VM_PKT_DATA_INBAND;
+		pkt->desc.inband.flags = 0;
+		pkt->desc.inband.offset8 =
+			sizeof(struct vmpacket_descriptor) >> 3;
+		pkt->desc.inband.len8 = (u16)(packetlen_aligned >> 3);
+		pkt->desc.inband.trans_id = pkt->requestid;
+
+		pkt->kv[0].iov_base = &pkt->desc.inband;
+		pkt->kv[0].iov_len = sizeof(struct vmpacket_descriptor);
+		pkt->kv[1].iov_base = pkt->buffer;
+		pkt->kv[1].iov_len = pkt->bufferlen;
+		pkt->kv[2].iov_base = (void *)&aligned_data;
+		pkt->kv[2].iov_len = packetlen_aligned - packetlen;
+		pkt->kv_count = 3;
+	}
+
+	return hv_ringbuffer_write_batch(channel, pkts, count, sent);
+}
+
+/*
+ * tx: guest senders and the host consumer
+ */
+static void *guest_tx_thread(void *arg)
+{
+	u32 sender = (u32)(uintptr_t)arg;
+	u64 n = opts.count / opts.senders;
+	struct vmbus_batch_packet *pkts;
+	u32 count, sent, j;
+	u8 *buf;
+	u64 i;
+	int ret;
+
+	if (sender < opts.count % opts.senders)
+		n++;
+
+	buf = malloc((size_t)opts.pkt_size * opts.batch);
+	pkts = calloc(opts.batch, sizeof(*pkts));
+	if (!buf || !pkts)
+		abort();
+	for (j = 0; j < opts.batch; j++) {
+		payload_fill(buf + j * opts.pkt_size, opts.pkt_size, sender);
+		pkts[j].buffer = buf + j * opts.pkt_size;
+		pkts[j].bufferlen = opts.pkt_size;
+	}
+
+	pthread_barrier_wait(&start_barrier);
+
+	for (i = 0; i < n && !stop; i += count) {
+		count = n - i < opts.batch ? n - i : opts.batch;
+
+		for (j = 0; j < count; j++) {
+			pkts[j].requestid = i + j;
+			payload_stamp(pkts[j].buffer, opts.pkt_size, sender,
+				      (u32)(i + j));
+		}
+
+		if (opts.batch == 1) {
+			while ((ret = bench_sendpacket(&chan, buf,
+						       opts.pkt_size,
+						       i)) == -EAGAIN) {
+				__atomic_add_fetch(&stat_eagain, 1,
+						   __ATOMIC_RELAXED);
+				sched_yield();
+				payload_stamp(buf, opts.pkt_size, sender,
+					      (u32)i);
+			}
+		} else {
+			/* Resend whatever did not fit, in order */
+			for (j = 0; ; j += sent) {
+				ret = bench_sendbatch(&chan, &pkts[j],
+						      count - j, &sent);
+				if (ret != -EAGAIN)
+					break;
+				__atomic_add_fetch(&stat_eagain, 1,
+						   __ATOMIC_RELAXED);
+				sched_yield();
+			}
+		}
+
+		if (ret) {
+			__atomic_add_fetch(&stat_errors, 1, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+
+	free(pkts);
+	free(buf);
+	return NULL;
+}
+
+static void *host_tx_thread(void *arg)
+{
+	struct hv_ring_buffer_info *rbi = &chan.outbound;
+	struct hv_ring_buffer *rb = rbi->ring_buffer;
+	u32 dsize = rbi->ring_datasize;
+	const struct vmpacket_descriptor *desc;
+	u32 read_index, write_index, len;
+
+	(void)arg;
+	pthread_barrier_wait(&start_barrier);
+
+	while (rcv_packets < opts.count && !stop) {
+		/* Tell the guest not to signal while we drain */
+		WRITE_ONCE(rb->interrupt_mask, 1);
+		mb();
+
+		read_index = rb->read_index;
+		while ((write_index = READ_ONCE(rb->write_index)) !=
+		       read_index) {
+			rmb();
+			desc = (void *)(rb->buffer + read_index);
+			len = desc->len8 << 3;
+			if (len < sizeof(*desc) || len > dsize) {
+				stat_errors++;
+				stop = true;
+				break;
+			}
+
+			spin_ns(opts.host_delay);
+			payload_check(hv_pkt_data(desc),
+				      payload_len(hv_pkt_datalen(desc)),
+				      now_ns());
+
+			read_index += len + VMBUS_PKT_TRAILER;
+			if (read_index >= dsize)
+				read_index -= dsize;
+
+			/* Finish reading before giving the space back */
+			mb();
+			WRITE_ONCE(rb->read_index, read_index);
+		}
+
+		WRITE_ONCE(rb->interrupt_mask, 0);
+		mb();
+		if (READ_ONCE(rb->write_index) != rb->read_index)
+			continue;
+
+		if (rcv_packets >= opts.count)
+			break;
+
+		if (!doorbell_wait(host_efd) &&
+		    READ_ONCE(rb->write_index) != rb->read_index)
+			stat_missed++;
+	}
+
+	return NULL;
+}
+
+/*
+ * rx: host producer and the guest consumer
+ */
+static void host_rx_write(const void *pkt, u32 len)
+{
+	struct hv_ring_buffer_info *rbi = &chan.inbound;
+	struct hv_ring_buffer *rb = rbi->ring_buffer;
+	u32 dsize = rbi->ring_datasize;
+	u32 total = len + VMBUS_PKT_TRAILER;
+	u32 old_write, write_index, read_index, avail;
+	u64 prev_indices;
+
+	for (;;) {
+		read_index = READ_ONCE(rb->read_index);
+		write_index = rb->write_index;
+		avail = write_index >= read_index ?
+			dsize - (write_index - read_index) :
+			read_index - write_index;
+		if (avail > total)
+			break;
+
+		/* Ring full: ask the guest to signal once space frees up */
+		stat_eagain++;
+		WRITE_ONCE(rb->pending_send_sz, total + 1);
+		mb();
+		read_index = READ_ONCE(rb->read_index);
+		avail = write_index >= read_index ?
+			dsize - (write_index - read_index) :
+			read_index - write_index;
+		if (avail > total)
+			break;
+
+		if (!doorbell_wait(host_efd)) {
+			read_index = READ_ONCE(rb->read_index);
+			avail = write_index >= read_index ?
+				dsize - (write_index - read_index) :
+				read_index - write_index;
+			if (avail > total)
+				stat_missed++;
+		}
+		if (stop)
+			return;
+	}
+	WRITE_ONCE(rb->pending_send_sz, 0);
+
+	/* Data pages are mapped twice, so one copy handles wraparound */
+	old_write = rb->write_index;
+	memcpy(rb->buffer + old_write, pkt, len);
+	prev_indices = (u64)old_write << 32;
+	memcpy(rb->buffer + old_write + len, &prev_indices, sizeof(u64));
+
+	write_index = old_write + total;
+	if (write_index >= dsize)
+		write_index -= dsize;
+
+	wmb();
+	WRITE_ONCE(rb->write_index, write_index);
+
+	/* Interrupt only on empty to non-empty, and only if unmasked */
+	mb();
+	if (!READ_ONCE(rb->interrupt_mask) &&
+	    old_write == READ_ONCE(rb->read_index))
+		host_interrupt_guest();
+}
+
+static void *host_rx_thread(void *arg)
+{
+	u32 packetlen = sizeof(struct vmpacket_descriptor) + opts.pkt_size;
+	u32 packetlen_aligned = ALIGN(packetlen, sizeof(u64));
+	struct vmpacket_descriptor *desc;
+	u8 *pkt;
+	u64 i;
+
+	(void)arg;
+	pkt = calloc(1, packetlen_aligned);
+	if (!pkt)
+		abort();
+
+	desc = (struct vmpacket_descriptor *)pkt;
+	desc->type = VM_PKT_DATA_INBAND;
+	desc->offset8 = sizeof(*desc) >> 3;
+	desc->len8 = (u16)(packetlen_aligned >> 3);
+	payload_fill(pkt + sizeof(*desc), opts.pkt_size, 0);
+
+	pthread_barrier_wait(&start_barrier);
+
+	for (i = 0; i < opts.count && !stop; i++) {
+		desc->trans_id = i;
+		payload_stamp(pkt + sizeof(*desc), opts.pkt_size, 0, (u32)i);
+		host_rx_write(pkt, packetlen_aligned);
+		spin_ns(opts.host_delay);
+	}
+
+	free(pkt);
+	return NULL;
+}
+
+static void *guest_rx_thread(void *arg)
+{
+	struct hv_ring_buffer_info *rbi = &chan.inbound;
+	const struct vmpacket_descriptor *desc;
+	u32 buflen = ALIGN(opts.pkt_size, sizeof(u64));
+	u32 actual;
+	u64 reqid;
+	u8 *buf;
+	int ret;
+
+	(void)arg;
+	buf = malloc(buflen);
+	if (!buf)
+		abort();
+
+	pthread_barrier_wait(&start_barrier);
+
+	/* Same shape as vmbus_on_event() for HV_CALL_BATCHED channels */
+	while (rcv_packets < opts.count && !stop) {
+		hv_begin_read(rbi);
+
+		if (opts.rx_api == RX_COPY) {
+			for (;;) {
+				ret = hv_ringbuffer_read(&chan, buf, buflen,
+							 &actual, &reqid,
+							 false);
+				if (ret || !actual)
+					break;
+				payload_check(buf, payload_len(actual),
+					      now_ns());
+			}
+			if (ret) {
+				stat_errors++;
+				break;
+			}
+		} else if (opts.rx_api == RX_BORROW) {
+			while ((desc = vmbus_borrow_packet(&chan)) != NULL) {
+				payload_check(hv_pkt_data(desc),
+					      payload_len(hv_pkt_datalen(desc)),
+					      now_ns());
+				vmbus_release_packet(&chan, desc);
+			}
+		} else {
+			foreach_vmbus_pkt(desc, &chan)
+				payload_check(hv_pkt_data(desc),
+					      payload_len(hv_pkt_datalen(desc)),
+					      now_ns());
+		}
+
+		if (hv_end_read(rbi) != 0)
+			continue;
+
+		if (rcv_packets >= opts.count)
+			break;
+
+		if (!doorbell_wait(guest_efd) && hv_get_bytes_to_read(rbi))
+			stat_missed++;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int run_one(const struct bench_opts *o, struct bench_result *res)
+{
+	pthread_t host, guest[MAX_SENDERS];
+	u32 nthreads, i;
+	int ret;
+
+	opts = *o;
+	memset(res, 0, sizeof(*res));
+	memset(next_seq, 0, sizeof(next_seq));
+	stat_signals = stat_host_signals = stat_eagain = 0;
+	stat_missed = stat_errors = 0;
+	rcv_packets = rcv_bytes = 0;
+	stop = false;
+
+	lat_samples = calloc(opts.count, sizeof(*lat_samples));
+	if (!lat_samples)
+		return -ENOMEM;
+
+	host_efd = eventfd(0, 0);
+	guest_efd = eventfd(0, 0);
+	if (host_efd < 0 || guest_efd < 0)
+		return -errno;
+
+	ret = channel_open(opts.ring_size);
+	if (ret)
+		return ret;
+
+	nthreads = opts.mode == BENCH_TX ? opts.senders : 1;
+	pthread_barrier_init(&start_barrier, NULL, nthreads + 2);
+
+	if (opts.mode == BENCH_TX) {
+		pthread_create(&host, NULL, host_tx_thread, NULL);
+		for (i = 0; i < nthreads; i++)
+			pthread_create(&guest[i], NULL, guest_tx_thread,
+				       (void *)(uintptr_t)i);
+	} else {
+		pthread_create(&host, NULL, host_rx_thread, NULL);
+		pthread_create(&guest[0], NULL, guest_rx_thread, NULL);
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	t_start = now_ns();
+
+	if (opts.mode == BENCH_TX) {
+		for (i = 0; i < nthreads; i++)
+			pthread_join(guest[i], NULL);
+		pthread_join(host, NULL);
+	} else {
+		pthread_join(host, NULL);
+		pthread_join(guest[0], NULL);
+	}
+
+	res->elapsed = now_ns() - t_start;
+	res->packets = rcv_packets;
+	res->bytes = rcv_bytes;
+	res->signals = stat_signals;
+	res->host_signals = stat_host_signals;
+	res->eagain = stat_eagain;
+	res->missed = stat_missed;
+	res->errors = stat_errors + (rcv_packets != opts.count);
+
+	/* The channel statistics must agree with what the bench saw */
+	if (chan_stats.signals + chan_stats.pending_send_wakeups !=
+	    stat_signals)
+		res->errors++;
+	if (opts.mode == BENCH_TX ? chan_stats.out_packets != opts.count :
+				    chan_stats.in_packets != opts.count)
+		res->errors++;
+
+	if (rcv_packets) {
+		qsort(lat_samples, rcv_packets, sizeof(*lat_samples), cmp_u32);
+		res->lat_p50 = lat_samples[rcv_packets * 50 / 100];
+		res->lat_p99 = lat_samples[rcv_packets * 99 / 100];
+		res->lat_p999 = lat_samples[rcv_packets * 999 / 1000];
+		res->lat_max = lat_samples[rcv_packets - 1];
+	}
+
+	pthread_barrier_destroy(&start_barrier);
+	channel_close();
+	close(host_efd);
+	close(guest_efd);
+	free(lat_samples);
+	return 0;
+}
+
+static void print_result(const struct bench_opts *o,
+			 const struct bench_result *r)
+{
+	double secs = r->elapsed / 1e9;
+
+	printf("%-2s size=%-5u ring=%-5uK thr=%-2u b=%-2u pkts=%-8llu "
+	       "kpps=%-8.1f MB/s=%-8.1f sig=%-7llu hsig=%-7llu "
+	       "sig/kpkt=%-6.2f eagain=%-7llu "
+	       "lat_ns p50=%-6llu p99=%-7llu p999=%-7llu max=%-8llu "
+	       "missed=%llu err=%llu\n",
+	       o->mode == BENCH_TX ? "tx" : rx_api_names[o->rx_api],
+	       o->pkt_size, o->ring_size >> 10,
+	       o->mode == BENCH_TX ? o->senders : 1,
+	       o->mode == BENCH_TX ? o->batch : 1,
+	       (unsigned long long)r->packets,
+	       secs ? r->packets / secs / 1e3 : 0,
+	       secs ? r->bytes / secs / 1e6 : 0,
+	       (unsigned long long)r->signals,
+	       (unsigned long long)r->host_signals,
+	       r->packets ? (r->signals + r->host_signals) * 1e3 / r->packets
+			  : 0,
+	       (unsigned long long)r->eagain,
+	       (unsigned long long)r->lat_p50,
+	       (unsigned long long)r->lat_p99,
+	       (unsigned long long)r->lat_p999,
+	       (unsigned long long)r->lat_max,
+	       (unsigned long long)r->missed,
+	       (unsigned long long)r->errors);
+	fflush(stdout);
+}
+
+/*
+ * Regression matrix: a spread of packet sizes around the netvsc and
+ * storvsc request sizes, the ring sizes the drivers use, and enough
+ * senders to make the outbound ring lock contended.
+ */
+static const u32 matrix_sizes[] = { 16, 64, 256, 1500, 4096 };
+static const u32 matrix_rings[] = { 16, 128, 1024 };	/* KB */
+static const u32 matrix_senders[] = { 1, 4 };
+static const u32 matrix_batch[] = { 1, 8 };
+
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+
+static int run_matrix(const struct bench_opts *base)
+{
+	struct bench_opts o = *base;
+	struct bench_result r;
+	unsigned int s, g, t, b, a;
+	int failed = 0;
+
+	for (g = 0; g < ARRAY_SIZE(matrix_rings); g++) {
+		for (s = 0; s < ARRAY_SIZE(matrix_sizes); s++) {
+			o.ring_size = matrix_rings[g] << 10;
+			o.pkt_size = matrix_sizes[s];
+			if (o.pkt_size + 64 > o.ring_size / 4)
+				continue;
+
+			o.mode = BENCH_TX;
+			for (t = 0; t < ARRAY_SIZE(matrix_senders); t++) {
+				for (b = 0; b < ARRAY_SIZE(matrix_batch); b++) {
+					o.senders = matrix_senders[t];
+					o.batch = matrix_batch[b];
+					if (run_one(&o, &r))
+						return 1;
+					print_result(&o, &r);
+					failed |= r.errors || r.missed;
+				}
+			}
+
+			o.mode = BENCH_RX;
+			for (a = 0; a < ARRAY_SIZE(rx_api_names); a++) {
+				o.rx_api = a;
+				if (run_one(&o, &r))
+					return 1;
+				print_result(&o, &r);
+				failed |= r.errors || r.missed;
+			}
+			o.rx_api = RX_ITER;
+		}
+	}
+
+	printf("%s\n", failed ? "FAIL" : "PASS");
+	return failed;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -m tx|rx|rc|rb  direction; rc is rx through hv_ringbuffer_read(),\n"
+		"               rb through vmbus_borrow_packet()\n"
+		"  -s bytes     payload size per packet (default 256)\n"
+		"  -r KB        ring size incl. header page (default 512)\n"
+		"  -t threads   guest sender threads for tx (default 1)\n"
+		"  -b packets   tx packets per batched ring write (default 1)\n"
+		"  -n packets   packets per run (default 1000000)\n"
+		"  -d ns        host busy time per packet (default 0)\n"
+		"  -v           verify every payload byte\n"
+		"  -M           run the regression matrix, exit 1 on failure\n",
+		prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_opts o = {
+		.mode = BENCH_TX,
+		.pkt_size = 256,
+		.ring_size = 512 << 10,
+		.senders = 1,
+		.batch = 1,
+		.count = 1000000,
+	};
+	struct bench_result r;
+	bool matrix = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:s:r:t:b:n:d:vMh")) != -1) {
+		switch (opt) {
+		case 'm':
+			if (!strcmp(optarg, "tx")) {
+				o.mode = BENCH_TX;
+			} else if (!strcmp(optarg, "rx")) {
+				o.mode = BENCH_RX;
+			} else if (!strcmp(optarg, "rc")) {
+				o.mode = BENCH_RX;
+				o.rx_api = RX_COPY;
+			} else if (!strcmp(optarg, "rb")) {
+				o.mode = BENCH_RX;
+				o.rx_api = RX_BORROW;
+			} else {
+				usage(argv[0]);
+				return 2;
+			}
+			break;
+		case 's':
+			o.pkt_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			o.ring_size = strtoul(optarg, NULL, 0) << 10;
+			break;
+		case 't':
+			o.senders = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			o.batch = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			o.count = strtoull(optarg, NULL, 0);
+			break;
+		case 'd':
+			o.host_delay = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			o.verify = true;
+			break;
+		case 'M':
+			matrix = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if (o.pkt_size < sizeof(struct bench_hdr) ||
+	    o.ring_size < 2 * PAGE_SIZE || o.ring_size % PAGE_SIZE ||
+	    o.pkt_size + 64 > o.ring_size - PAGE_SIZE ||
+	    !o.senders || o.senders > MAX_SENDERS || !o.count || !o.batch ||
+	    o.count > UINT32_MAX) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	if (matrix)
+		return run_matrix(&o);
+
+	if (run_one(&o, &r)) {
+		fprintf(stderr, "failed to set up the channel\n");
+		return 1;
+	}
+	print_result(&o, &r);
+
+	return r.errors || r.missed;
+}
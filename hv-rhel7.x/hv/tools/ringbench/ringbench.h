@@ -0,0 +1,352 @@
+/*
+ * Userspace shim for building the VMBus ring buffer code outside the kernel.
+ *
+ * Copyright (c) 2018, Microsoft Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * This header is force-included (gcc -include) ahead of ../../ring_buffer.c.
+ * It provides the handful of kernel primitives the ring buffer code uses and
+ * a trimmed-down struct vmbus_channel, and it pre-defines the include guards
+ * of hyperv.h and hyperv_vmbus.h so that the driver headers are skipped.
+ *
+ * Keep the ring buffer structures below in sync with include/linux/hyperv.h.
+ */
+
+#ifndef _RINGBENCH_H
+#define _RINGBENCH_H
+
+#define _HYPERV_H
+#define _HYPERV_VMBUS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+#ifndef KBUILD_MODNAME
+#define KBUILD_MODNAME "hv_vmbus"
+#endif
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t s32;
+typedef int64_t s64;
+
+#define __packed		__attribute__((packed))
+#define likely(x)		__builtin_expect(!!(x), 1)
+#define unlikely(x)		__builtin_expect(!!(x), 0)
+#define BUILD_BUG_ON(cond)	((void)sizeof(char[1 - 2 * !!(cond)]))
+#define WARN_ON(cond)		unlikely(cond)
+#define EXPORT_SYMBOL(sym)
+#define EXPORT_SYMBOL_GPL(sym)
+
+#define ALIGN(x, a)		(((x) + (a) - 1) & ~((typeof(x))(a) - 1))
+
+#define PAGE_SHIFT		12
+#define PAGE_SIZE		(1UL << PAGE_SHIFT)
+
+/* Barriers: the ring is shared with another thread, not another VM. */
+#define mb()			__sync_synchronize()
+#define rmb()			__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define wmb()			__atomic_thread_fence(__ATOMIC_RELEASE)
+#define virt_mb()		mb()
+#define READ_ONCE(x)		(*(const volatile typeof(x) *)&(x))
+#define WRITE_ONCE(x, v)	(*(volatile typeof(x) *)&(x) = (v))
+#define prefetch(p)		__builtin_prefetch(p)
+/*
+ * Userspace threads cannot disable preemption between reserving and
+ * publishing ring space, so a writer waiting on a preempted one yields
+ * instead of spinning out its time slice.
+ */
+#define cpu_relax()		sched_yield()
+
+/* Memory */
+#define GFP_KERNEL		0
+#define GFP_ATOMIC		1
+#define kzalloc(sz, gfp)	calloc(1, (sz))
+#define kfree(p)		free(p)
+
+/*
+ * A ring page is a page-sized window into a shared memory file, so that
+ * vmap() can map the data pages twice back to back like the kernel does.
+ */
+struct page {
+	int fd;
+	long offset;
+};
+
+#define VM_MAP			0
+#define PAGE_KERNEL		0
+void *vmap(struct page **pages, unsigned int count,
+	   unsigned long flags, int prot);
+void vunmap(const void *addr);
+
+/* Locking */
+#define local_irq_save(f)	((f) = 0)
+#define local_irq_restore(f)	((void)(f))
+#define cmpxchg(p, o, n)	__sync_val_compare_and_swap((p), (o), (n))
+
+/* One set of channel statistics shared by all threads */
+#define __percpu
+#define this_cpu_add(pcp, v)	__atomic_fetch_add(&(pcp), (v), __ATOMIC_RELAXED)
+#define this_cpu_inc(pcp)	this_cpu_add(pcp, 1)
+#define min_t(type, x, y)	((type)(x) < (type)(y) ? (type)(x) : (type)(y))
+
+typedef pthread_spinlock_t spinlock_t;
+#define spin_lock_init(l)	pthread_spin_init((l), PTHREAD_PROCESS_PRIVATE)
+#define spin_lock(l)		pthread_spin_lock(l)
+#define spin_unlock(l)		pthread_spin_unlock(l)
+#define spin_lock_irqsave(l, f)	do { (void)(f); pthread_spin_lock(l); } while (0)
+#define spin_unlock_irqrestore(l, f) \
+	do { (void)(f); pthread_spin_unlock(l); } while (0)
+
+struct kvec {
+	void *iov_base;
+	size_t iov_len;
+};
+
+/* From include/linux/hyperv.h */
+struct vmpacket_descriptor {
+	u16 type;
+	u16 offset8;
+	u16 len8;
+	u16 flags;
+	u64 trans_id;
+} __packed;
+
+enum vmbus_packet_type {
+	VM_PKT_INVALID				= 0x0,
+	VM_PKT_DATA_INBAND			= 0x6,
+	VM_PKT_COMP				= 0xb,
+};
+
+#define VMBUS_DATA_PACKET_FLAG_COMPLETION_REQUESTED	1
+
+struct hv_page_buffer {
+	u32 len;
+	u32 offset;
+	u64 pfn;
+} __packed;
+
+#define VMBUS_BATCH_KVEC_MAX	4
+
+struct vmbus_batch_packet {
+	void *buffer;
+	u32 bufferlen;
+	u64 requestid;
+	enum vmbus_packet_type type;
+	u32 flags;
+	struct hv_page_buffer *pagebuffers;
+	u32 pagecount;
+
+	union {
+		struct vmpacket_descriptor inband;
+		struct {
+			u16 type;
+			u16 dataoffset8;
+			u16 length8;
+			u16 flags;
+			u64 transactionid;
+			u32 reserved;
+			u32 rangecount;
+		} __packed gpa_direct;
+	} desc;
+	struct kvec kv[VMBUS_BATCH_KVEC_MAX];
+	u32 kv_count;
+	u32 ring_len;
+};
+
+struct hv_ring_buffer {
+	u32 write_index;
+	u32 read_index;
+	u32 interrupt_mask;
+	u32 pending_send_sz;
+	u32 reserved1[12];
+	union {
+		struct {
+			u32 feat_pending_send_sz:1;
+		};
+		u32 value;
+	} feature_bits;
+	u8	reserved2[4028];
+	u8 buffer[0];
+} __packed;
+
+struct hv_ring_buffer_info {
+	struct hv_ring_buffer *ring_buffer;
+	u32 ring_size;
+	spinlock_t ring_lock;
+
+	u32 ring_datasize;
+	u32 priv_read_index;
+	u32 priv_write_index;
+};
+
+struct hv_ring_buffer_debug_info {
+	u32 current_interrupt_mask;
+	u32 current_read_index;
+	u32 current_write_index;
+	u32 bytes_avail_toread;
+	u32 bytes_avail_towrite;
+};
+
+#define VMBUS_OCCUPANCY_BUCKETS	8
+
+struct vmbus_channel_stats {
+	u64 interrupts;
+	u64 callbacks;
+	u64 polls;
+	u64 in_packets;
+	u64 in_bytes;
+	u64 out_packets;
+	u64 out_bytes;
+	u64 signals;
+	u64 signals_suppressed;
+	u64 ring_full;
+	u64 pending_send_wakeups;
+	u64 in_occupancy[VMBUS_OCCUPANCY_BUCKETS];
+	u64 out_occupancy[VMBUS_OCCUPANCY_BUCKETS];
+};
+
+struct vmbus_channel {
+	bool rescind;
+	struct hv_ring_buffer_info outbound;	/* send to parent */
+	struct hv_ring_buffer_info inbound;	/* receive from parent */
+	struct vmbus_channel_stats __percpu *stats;
+};
+
+#define vmbus_chan_stat_inc(c, field)	this_cpu_inc((c)->stats->field)
+#define vmbus_chan_stat_add(c, field, v) this_cpu_add((c)->stats->field, (v))
+
+static inline u32 hv_ring_occupancy_bucket(const struct hv_ring_buffer_info *rbi,
+					   u32 used)
+{
+	u32 bucket;
+
+	if (unlikely(!rbi->ring_datasize))
+		return 0;
+
+	bucket = (u64)used * VMBUS_OCCUPANCY_BUCKETS / rbi->ring_datasize;
+	return min_t(u32, bucket, VMBUS_OCCUPANCY_BUCKETS - 1);
+}
+
+static inline u32 hv_get_bytes_to_read(const struct hv_ring_buffer_info *rbi)
+{
+	u32 read_loc, write_loc, dsize, read;
+
+	dsize = rbi->ring_datasize;
+	read_loc = rbi->ring_buffer->read_index;
+	write_loc = READ_ONCE(rbi->ring_buffer->write_index);
+
+	read = write_loc >= read_loc ? (write_loc - read_loc) :
+		(dsize - read_loc) + write_loc;
+
+	return read;
+}
+
+static inline u32 hv_get_bytes_to_write(const struct hv_ring_buffer_info *rbi)
+{
+	u32 read_loc, write_loc, dsize, write;
+
+	dsize = rbi->ring_datasize;
+	read_loc = READ_ONCE(rbi->ring_buffer->read_index);
+	write_loc = rbi->ring_buffer->write_index;
+
+	write = write_loc >= read_loc ? dsize - (write_loc - read_loc) :
+		read_loc - write_loc;
+	return write;
+}
+
+static inline void *
+hv_get_ring_buffer(const struct hv_ring_buffer_info *ring_info)
+{
+	return ring_info->ring_buffer->buffer;
+}
+
+static inline void hv_begin_read(struct hv_ring_buffer_info *rbi)
+{
+	rbi->ring_buffer->interrupt_mask = 1;
+	mb();
+}
+
+static inline u32 hv_end_read(struct hv_ring_buffer_info *rbi)
+{
+	rbi->ring_buffer->interrupt_mask = 0;
+	mb();
+	return hv_get_bytes_to_read(rbi);
+}
+
+static inline void *hv_pkt_data(const struct vmpacket_descriptor *desc)
+{
+	return (void *)((unsigned long)desc + (desc->offset8 << 3));
+}
+
+static inline u32 hv_pkt_datalen(const struct vmpacket_descriptor *desc)
+{
+	return (desc->len8 << 3) - (desc->offset8 << 3);
+}
+
+/* From hv_trace.h, which needs the kernel tracing headers */
+#define trace_vmbus_ringbuffer_write(...)	do { } while (0)
+#define trace_vmbus_pkt_iter_begin(...)		do { } while (0)
+#define trace_vmbus_pkt_iter_close(...)		do { } while (0)
+
+/* Provided by the simulated host in ringbench.c */
+void vmbus_setevent(struct vmbus_channel *channel);
+
+/* From hyperv_vmbus.h and include/linux/hyperv.h */
+int hv_ringbuffer_init(struct hv_ring_buffer_info *ring_info,
+		       struct page *pages, u32 pagecnt);
+void hv_ringbuffer_cleanup(struct hv_ring_buffer_info *ring_info);
+int hv_ringbuffer_write(struct vmbus_channel *channel,
+			const struct kvec *kv_list, u32 kv_count);
+int hv_ringbuffer_write_batch(struct vmbus_channel *channel,
+			      struct vmbus_batch_packet *pkts, u32 count,
+			      u32 *written);
+int hv_ringbuffer_read(struct vmbus_channel *channel,
+		       void *buffer, u32 buflen, u32 *buffer_actual_len,
+		       u64 *requestid, bool raw);
+void hv_ringbuffer_get_debuginfo(const struct hv_ring_buffer_info *ring_info,
+				 struct hv_ring_buffer_debug_info *debug_info);
+
+struct vmpacket_descriptor *hv_pkt_iter_first(struct vmbus_channel *channel);
+struct vmpacket_descriptor *
+__hv_pkt_iter_next(struct vmbus_channel *channel,
+		   const struct vmpacket_descriptor *pkt);
+void hv_pkt_iter_close(struct vmbus_channel *channel);
+struct vmpacket_descriptor *vmbus_borrow_packet(struct vmbus_channel *channel);
+void vmbus_release_packet(struct vmbus_channel *channel,
+			  const struct vmpacket_descriptor *desc);
+
+static inline struct vmpacket_descriptor *
+hv_pkt_iter_next(struct vmbus_channel *channel,
+		 const struct vmpacket_descriptor *pkt)
+{
+	struct vmpacket_descriptor *nxt;
+
+	nxt = __hv_pkt_iter_next(channel, pkt);
+	if (!nxt)
+		hv_pkt_iter_close(channel);
+
+	return nxt;
+}
+
+#define foreach_vmbus_pkt(pkt, channel) \
+	for (pkt = hv_pkt_iter_first(channel); pkt; \
+	    pkt = hv_pkt_iter_next(channel, pkt))
+
+#endif /* _RINGBENCH_H */
@@ -0,0 +1 @@
+/* Provided by toeplitz.h */
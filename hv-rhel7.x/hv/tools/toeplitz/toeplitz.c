@@ -0,0 +1,239 @@
+/*
+ * Conformance test and microbenchmark for the netvsc Toeplitz hash.
+ *
+ * Copyright (c) 2018, Microsoft Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * Links the driver's netvsc_hash.c and checks it against
+ *
+ *   - the "Verifying the RSS Hash Calculation" vectors published by
+ *     Microsoft for the default key, IPv4/IPv6 with and without TCP ports
+ *   - the bit by bit implementation netvsc_drv.c used before, for random
+ *     keys and inputs of every length the driver hashes
+ *
+ * and then reports ns per hash for both implementations.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "../../netvsc_hash.h"
+
+#define KEYLEN	40
+
+static const u8 default_key[KEYLEN] = {
+	0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+	0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+	0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+	0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+	0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa
+};
+
+static const struct {
+	int family;
+	const char *src, *dst;
+	uint16_t sport, dport;
+	u32 hash_ip, hash_tcp;
+} vectors[] = {
+	{ AF_INET, "66.9.149.187", "161.142.100.80", 2794, 1766,
+	  0x323e8fc2, 0x51ccc178 },
+	{ AF_INET, "199.92.111.2", "65.69.140.83", 14230, 4739,
+	  0xd718262a, 0xc626b0ea },
+	{ AF_INET, "24.19.198.95", "12.22.207.184", 12898, 38024,
+	  0xd2d0a5de, 0x5c2b394a },
+	{ AF_INET, "38.27.205.30", "209.142.163.6", 48228, 2217,
+	  0x82989176, 0xafc7327f },
+	{ AF_INET, "153.39.163.191", "202.188.127.2", 44251, 1303,
+	  0x5d1809c5, 0x10e828a2 },
+	{ AF_INET6, "3ffe:2501:200:1fff::7", "3ffe:2501:200:3::1", 2794, 1766,
+	  0x2cc18cd5, 0x40207d3d },
+	{ AF_INET6, "3ffe:501:8::260:97ff:fe40:efab", "ff02::1", 14230, 4739,
+	  0x0f0c461c, 0xdde51bbf },
+	{ AF_INET6, "3ffe:1900:4545:3:200:f8ff:fe21:67cf",
+	  "fe80::200:f8ff:fe21:67cf", 44251, 38024,
+	  0x4b61e985, 0x02d1feef },
+};
+
+/* The implementation netvsc_drv.c used before the lookup tables */
+static u32 comp_hash(const u8 *key, int klen, const void *data, int dlen)
+{
+	u64 k = (u64)key[0] << 24 | key[1] << 16 | key[2] << 8 | key[3];
+	int k_next = 4;
+	u32 ret = 0;
+	int i, j;
+	u8 dt;
+
+	for (i = 0; i < dlen; i++) {
+		k = k << 8 | key[k_next];
+		k_next = (k_next + 1) % klen;
+		dt = ((const u8 *)data)[i];
+		for (j = 0; j < 8; j++) {
+			if (dt & 0x80)
+				ret ^= (u32)(k >> (8 - j));
+			dt <<= 1;
+		}
+	}
+
+	return ret;
+}
+
+/* Lay out the input the way netvsc_set_hash() does */
+static int build_input(int i, u8 *buf, int with_ports)
+{
+	int alen = vectors[i].family == AF_INET ? 4 : 16;
+	uint16_t ports[2] = { htons(vectors[i].sport), htons(vectors[i].dport) };
+
+	inet_pton(vectors[i].family, vectors[i].src, buf);
+	inet_pton(vectors[i].family, vectors[i].dst, buf + alen);
+	if (!with_ports)
+		return 2 * alen;
+	memcpy(buf + 2 * alen, ports, sizeof(ports));
+	return 2 * alen + 4;
+}
+
+static int check_vectors(const struct netvsc_toeplitz *t)
+{
+	unsigned int i;
+	int fail = 0, p;
+
+	for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+		for (p = 0; p <= 1; p++) {
+			u32 want = p ? vectors[i].hash_tcp : vectors[i].hash_ip;
+			u8 buf[NETVSC_HASH_INPUT_MAX];
+			int len = build_input(i, buf, p);
+			u32 tbl = netvsc_toeplitz_hash(t, buf, len);
+			u32 ref = comp_hash(default_key, KEYLEN, buf, len);
+
+			if (tbl != want || ref != want) {
+				printf("FAIL %s -> %s%s: want %08x table %08x bitwise %08x\n",
+				       vectors[i].src, vectors[i].dst,
+				       p ? " tcp" : "", want, tbl, ref);
+				fail++;
+			}
+		}
+	}
+	return fail;
+}
+
+static int check_random(unsigned int rounds)
+{
+	static struct netvsc_toeplitz t;
+	unsigned int r, n;
+	int fail = 0;
+
+	srand(1);
+	for (r = 0; r < rounds; r++) {
+		u8 key[KEYLEN], buf[NETVSC_HASH_INPUT_MAX];
+		int len;
+
+		for (n = 0; n < KEYLEN; n++)
+			key[n] = rand();
+		netvsc_toeplitz_init(&t, key);
+
+		for (len = 0; len <= NETVSC_HASH_INPUT_MAX; len++) {
+			for (n = 0; n < (unsigned int)len; n++)
+				buf[n] = rand();
+			if (netvsc_toeplitz_hash(&t, buf, len) !=
+			    comp_hash(key, KEYLEN, buf, len)) {
+				printf("FAIL random key round %u len %d\n",
+				       r, len);
+				fail++;
+			}
+		}
+	}
+	return fail;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void bench(const struct netvsc_toeplitz *t, unsigned int n)
+{
+	static const int lens[] = { 8, 12, 32, 36 };
+	static u8 inputs[1024][NETVSC_HASH_INPUT_MAX];
+	volatile u32 sink = 0;
+	unsigned int i, l;
+	uint64_t start;
+
+	for (i = 0; i < 1024; i++)
+		for (l = 0; l < NETVSC_HASH_INPUT_MAX; l++)
+			inputs[i][l] = rand();
+
+	printf("%-6s %-12s %-12s\n", "bytes", "bitwise_ns", "table_ns");
+	for (l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+		double ref, tbl;
+
+		start = now_ns();
+		for (i = 0; i < n; i++)
+			sink ^= comp_hash(default_key, KEYLEN,
+					  inputs[i & 1023], lens[l]);
+		ref = (double)(now_ns() - start) / n;
+
+		start = now_ns();
+		for (i = 0; i < n; i++)
+			sink ^= netvsc_toeplitz_hash(t, inputs[i & 1023],
+						     lens[l]);
+		tbl = (double)(now_ns() - start) / n;
+
+		printf("%-6d %-12.1f %-12.1f\n", lens[l], ref, tbl);
+	}
+	(void)sink;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -c           conformance checks only\n"
+		"  -n count     hashes per measurement (default 10000000)\n",
+		prog);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct netvsc_toeplitz t;
+	unsigned int n = 10000000;
+	int check_only = 0, fail;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "cn:h")) != -1) {
+		switch (opt) {
+		case 'c':
+			check_only = 1;
+			break;
+		case 'n':
+			n = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	netvsc_toeplitz_init(&t, default_key);
+	fail = check_vectors(&t) + check_random(200);
+	printf("%s\n", fail ? "FAIL" : "PASS");
+	if (fail || check_only)
+		return fail ? 1 : 0;
+
+	bench(&t, n);
+	return 0;
+}
@@ -0,0 +1,30 @@
+/*
+ * Userspace shim for building the netvsc Toeplitz hash outside the kernel.
+ *
+ * Copyright (c) 2018, Microsoft Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * This header is force-included (gcc -include) ahead of ../../netvsc_hash.c
+ * and provides the kernel types and helpers the hash code uses.
+ */
+
+#ifndef _TOEPLITZ_H
+#define _TOEPLITZ_H
+
+#include <stdint.h>
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define __ffs(x)	((unsigned long)__builtin_ctzl(x))
+
+#endif /* _TOEPLITZ_H */
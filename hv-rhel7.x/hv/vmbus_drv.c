@@ -57,6 +57,27 @@ int affinity_mode = HV_KEEP_HT_CPU;
 module_param(affinity_mode, int, S_IRUGO);
 MODULE_PARM_DESC(affinity_mode, "vmbus channel cpu affinity mode: 0, 1");
 
+unsigned int rebalance_interval_ms;
+
+static int rebalance_interval_set(const char *val,
+				  const struct kernel_param *kp)
+{
+	int ret = param_set_uint(val, kp);
+
+	if (ret == 0)
+		vmbus_rebalance_update();
+	return ret;
+}
+
+static const struct kernel_param_ops rebalance_interval_ops = {
+	.set = rebalance_interval_set,
+	.get = param_get_uint,
+};
+module_param_cb(rebalance_interval_ms, &rebalance_interval_ops,
+		&rebalance_interval_ms, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(rebalance_interval_ms,
+		 "vmbus channel cpu rebalancing interval in ms, 0 to disable");
+
 static struct completion probe_event;
 #if (RHEL_RELEASE_CODE < RHEL_RELEASE_VERSION(7,2))
 static int irq;
@@ -555,6 +576,109 @@ static ssize_t channel_vp_mapping_show(struct device *dev,
 }
 static DEVICE_ATTR_RO(channel_vp_mapping);
 
+/*
+ * Ring buffer sizes of the device's channels: "<out bytes> <in bytes>".
+ *
+ * Writing one size (for both rings) or two overrides what the driver asks
+ * for in vmbus_open(), for the primary channel and all sub-channels, and
+ * closes and reopens the device so that it takes effect. 0 goes back to the
+ * driver's default.
+ */
+#define VMBUS_RING_SIZE_MIN	(2 * PAGE_SIZE)
+/* Both rings come from one allocation, see vmbus_open() */
+#define VMBUS_RING_SIZE_MAX	(PAGE_SIZE << (MAX_ORDER - 2))
+
+static bool vmbus_ring_size_valid(u32 size)
+{
+	if (size == 0)
+		return true;
+
+	return size % PAGE_SIZE == 0 && size >= VMBUS_RING_SIZE_MIN &&
+	       size <= VMBUS_RING_SIZE_MAX;
+}
+
+/*
+ * Close and reopen the channels of a bound device, through the driver's
+ * reopen() if it has one, or else by unbinding and rebinding it.
+ */
+static int vmbus_reopen_device(struct hv_device *hv_dev)
+{
+	struct device *dev = &hv_dev->device;
+	struct hv_driver *drv = NULL;
+	int ret = 0;
+
+	device_lock(dev);
+	if (dev->driver) {
+		drv = drv_to_hv_drv(dev->driver);
+		if (drv->reopen)
+			ret = drv->reopen(hv_dev);
+	}
+	device_unlock(dev);
+
+	if (drv && !drv->reopen)
+		ret = device_reprobe(dev);
+
+	return ret;
+}
+
+static ssize_t ring_size_show(struct device *dev,
+			      struct device_attribute *dev_attr, char *buf)
+{
+	struct hv_device *hv_dev = device_to_hv_device(dev);
+	struct vmbus_channel *channel = hv_dev->channel;
+
+	if (!channel)
+		return -ENODEV;
+
+	return sprintf(buf, "%u %u\n", channel->outbound.ring_size,
+		       channel->inbound.ring_size);
+}
+
+static ssize_t ring_size_store(struct device *dev,
+			       struct device_attribute *dev_attr,
+			       const char *buf, size_t count)
+{
+	struct hv_device *hv_dev = device_to_hv_device(dev);
+	struct vmbus_channel *channel = hv_dev->channel;
+	u32 out, in, old_out, old_in;
+	int ret;
+
+	if (!channel)
+		return -ENODEV;
+
+	/* hvsock channels are opened as soon as they are offered */
+	if (is_hvsock_channel(channel))
+		return -EOPNOTSUPP;
+
+	ret = sscanf(buf, "%u %u", &out, &in);
+	if (ret == 1)
+		in = out;
+	else if (ret != 2)
+		return -EINVAL;
+
+	if (!vmbus_ring_size_valid(out) || !vmbus_ring_size_valid(in))
+		return -EINVAL;
+
+	old_out = channel->ring_size_out;
+	old_in = channel->ring_size_in;
+	WRITE_ONCE(channel->ring_size_out, out);
+	WRITE_ONCE(channel->ring_size_in, in);
+
+	ret = vmbus_reopen_device(hv_dev);
+	if (ret) {
+		dev_err(dev, "reopen with ring size %u/%u failed: %d\n",
+			out, in, ret);
+		WRITE_ONCE(channel->ring_size_out, old_out);
+		WRITE_ONCE(channel->ring_size_in, old_in);
+		if (vmbus_reopen_device(hv_dev))
+			dev_err(dev, "restoring ring size failed\n");
+		return ret;
+	}
+
+	return count;
+}
+static DEVICE_ATTR_RW(ring_size);
+
 /*
  * Divergence from upstream.
  * Vendor and device attributes needed for RDMA.
@@ -610,6 +734,7 @@ static struct attribute *vmbus_attrs[] = {
 	&dev_attr_in_read_bytes_avail.attr,
 	&dev_attr_in_write_bytes_avail.attr,
 	&dev_attr_channel_vp_mapping.attr,
+	&dev_attr_ring_size.attr,
 	&dev_attr_vendor.attr,
 	&dev_attr_device.attr,
 	NULL,
@@ -1070,8 +1195,10 @@ static void vmbus_channel_isr(struct vmbus_channel *channel)
 	void (*callback_fn)(void *);
 
 	callback_fn = READ_ONCE(channel->onchannel_callback);
-	if (likely(callback_fn != NULL))
+	if (likely(callback_fn != NULL)) {
+		vmbus_chan_stat_inc(channel, callbacks);
 		(*callback_fn)(channel->channel_callback_context);
+	}
 }
 
 /*
@@ -1116,28 +1243,40 @@ static void vmbus_chan_sched(struct hv_per_cpu_context *hv_cpu)
 		rcu_read_lock();
 
 		/* Find channel based on relid */
-		list_for_each_entry_rcu(channel, &hv_cpu->chan_list, percpu_list) {
-			if (channel->offermsg.child_relid != relid)
-				continue;
+		channel = relid2channel(relid);
+		if (channel == NULL || channel->rescind)
+			goto sched_unlock;
 
-			if (channel->rescind)
-				continue;
+		trace_vmbus_chan_sched(channel);
 
-			trace_vmbus_chan_sched(channel);
+		vmbus_chan_stat_inc(channel, interrupts);
 
-			switch (channel->callback_mode) {
-			case HV_CALL_ISR:
-				vmbus_channel_isr(channel);
-				break;
+		/*
+		 * The channel is findable from the time it is offered and may
+		 * be closing; only look at its ring while it is open.
+		 */
+		if (channel->state == CHANNEL_OPENED_STATE &&
+		    READ_ONCE(channel->onchannel_callback))
+			vmbus_chan_stat_inc(channel, in_occupancy[
+				hv_ring_occupancy_bucket(&channel->inbound,
+					hv_get_bytes_to_read(&channel->inbound))]);
+
+		switch (channel->callback_mode) {
+		case HV_CALL_ISR:
+			spin_lock(&channel->sched_lock);
+			vmbus_channel_isr(channel);
+			spin_unlock(&channel->sched_lock);
+			break;
 
-			case HV_CALL_BATCHED:
-				hv_begin_read(&channel->inbound);
-				/* fallthrough */
-			case HV_CALL_DIRECT:
-				tasklet_schedule(&channel->callback_event);
-			}
+		case HV_CALL_BATCHED:
+		case HV_CALL_ADAPTIVE:
+			hv_begin_read(&channel->inbound);
+			/* fallthrough */
+		case HV_CALL_DIRECT:
+			tasklet_schedule(&channel->callback_event);
 		}
 
+sched_unlock:
 		rcu_read_unlock();
 	}
 }
@@ -1419,6 +1558,7 @@ static int vmbus_bus_init(int irq)
 	hv_cpu_hotplug_quirk(true);
 #endif
 	vmbus_request_offers();
+	vmbus_rebalance_start();
 
 	return 0;
 
@@ -1511,6 +1651,15 @@ void vmbus_driver_unregister(struct hv_driver *hv_driver)
 EXPORT_SYMBOL_GPL(vmbus_driver_unregister);
 
 
+static void vmbus_chan_free_rcu(struct rcu_head *head)
+{
+	struct vmbus_channel *channel
+		= container_of(head, struct vmbus_channel, rcu);
+
+	free_percpu(channel->stats);
+	kfree(channel);
+}
+
 /*
  * Called when last reference to channel is gone.
  */
@@ -1519,7 +1668,7 @@ static void vmbus_chan_release(struct kobject *kobj)
 	struct vmbus_channel *channel
 		= container_of(kobj, struct vmbus_channel, kobj);
 
-	kfree_rcu(channel, rcu);
+	call_rcu(&channel->rcu, vmbus_chan_free_rcu);
 }
 
 struct vmbus_chan_attribute {
@@ -1555,8 +1704,24 @@ static ssize_t vmbus_chan_attr_show(struct kobject *kobj,
 	return attribute->show(chan, buf);
 }
 
+static ssize_t vmbus_chan_attr_store(struct kobject *kobj,
+				     struct attribute *attr, const char *buf,
+				     size_t count)
+{
+	const struct vmbus_chan_attribute *attribute
+		= container_of(attr, struct vmbus_chan_attribute, attr);
+	struct vmbus_channel *chan
+		= container_of(kobj, struct vmbus_channel, kobj);
+
+	if (!attribute->store)
+		return -EIO;
+
+	return attribute->store(chan, buf, count);
+}
+
 static const struct sysfs_ops vmbus_chan_sysfs_ops = {
 	.show = vmbus_chan_attr_show,
+	.store = vmbus_chan_attr_store,
 };
 
 static ssize_t out_mask_show(const struct vmbus_channel *channel, char *buf)
@@ -1595,7 +1760,35 @@ static ssize_t show_target_cpu(const struct vmbus_channel *channel, char *buf)
 {
 	return sprintf(buf, "%u\n", channel->target_cpu);
 }
-static VMBUS_CHAN_ATTR(cpu, S_IRUGO, show_target_cpu, NULL);
+
+static ssize_t store_target_cpu(struct vmbus_channel *channel,
+				const char *buf, size_t count)
+{
+	u32 target_cpu;
+	int ret;
+
+	if (kstrtou32(buf, 0, &target_cpu))
+		return -EINVAL;
+
+	get_online_cpus();
+	/*
+	 * Channel removal holds channel_mutex while it tears down this
+	 * attribute, so don't block on the mutex here.
+	 */
+	if (!mutex_trylock(&vmbus_connection.channel_mutex)) {
+		put_online_cpus();
+		return restart_syscall();
+	}
+
+	ret = vmbus_channel_retarget(channel, target_cpu);
+
+	mutex_unlock(&vmbus_connection.channel_mutex);
+	put_online_cpus();
+
+	return ret ? ret : count;
+}
+static VMBUS_CHAN_ATTR(cpu, S_IRUGO | S_IWUSR, show_target_cpu,
+		       store_target_cpu);
 
 static ssize_t channel_pending_show(const struct vmbus_channel *channel,
 				    char *buf)
@@ -1630,6 +1823,152 @@ static ssize_t subchannel_id_show(const struct vmbus_channel *channel,
 }
 static VMBUS_CHAN_ATTR_RO(subchannel_id);
 
+static const char * const callback_mode_names[] = {
+	[HV_CALL_BATCHED]	= "batched",
+	[HV_CALL_DIRECT]	= "direct",
+	[HV_CALL_ISR]		= "isr",
+	[HV_CALL_ADAPTIVE]	= "adaptive",
+};
+
+static ssize_t read_mode_show(const struct vmbus_channel *channel, char *buf)
+{
+	return sprintf(buf, "%s%s\n",
+		       callback_mode_names[channel->callback_mode],
+		       channel->polling ? " polling" : "");
+}
+
+/*
+ * Only batched and adaptive can be swapped at run time: the other modes
+ * change the context the driver's callback runs in.
+ */
+static ssize_t read_mode_store(struct vmbus_channel *channel,
+			       const char *buf, size_t count)
+{
+	enum hv_callback_mode mode;
+
+	if (sysfs_streq(buf, "batched"))
+		mode = HV_CALL_BATCHED;
+	else if (sysfs_streq(buf, "adaptive"))
+		mode = HV_CALL_ADAPTIVE;
+	else
+		return -EINVAL;
+
+	if (channel->callback_mode != HV_CALL_BATCHED &&
+	    channel->callback_mode != HV_CALL_ADAPTIVE)
+		return -EPERM;
+
+	WRITE_ONCE(channel->callback_mode, mode);
+	return count;
+}
+static VMBUS_CHAN_ATTR_RW(read_mode);
+
+static ssize_t poll_enter_rate_show(const struct vmbus_channel *channel,
+				    char *buf)
+{
+	return sprintf(buf, "%u\n", channel->poll_enter_rate);
+}
+
+static ssize_t poll_enter_rate_store(struct vmbus_channel *channel,
+				     const char *buf, size_t count)
+{
+	u32 val;
+
+	if (kstrtou32(buf, 0, &val))
+		return -EINVAL;
+
+	WRITE_ONCE(channel->poll_enter_rate, val);
+	return count;
+}
+static VMBUS_CHAN_ATTR_RW(poll_enter_rate);
+
+static ssize_t poll_idle_us_show(const struct vmbus_channel *channel,
+				 char *buf)
+{
+	return sprintf(buf, "%u\n", channel->poll_idle_us);
+}
+
+static ssize_t poll_idle_us_store(struct vmbus_channel *channel,
+				  const char *buf, size_t count)
+{
+	u32 val;
+
+	if (kstrtou32(buf, 0, &val) || val > USEC_PER_SEC)
+		return -EINVAL;
+
+	WRITE_ONCE(channel->poll_idle_us, val);
+	return count;
+}
+static VMBUS_CHAN_ATTR_RW(poll_idle_us);
+
+/* Sum one u64 of the per-CPU channel statistics */
+static u64 vmbus_chan_stat_sum(const struct vmbus_channel *channel,
+			       size_t offset)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += *(u64 *)((char *)per_cpu_ptr(channel->stats, cpu) +
+				offset);
+
+	return sum;
+}
+
+#define VMBUS_CHAN_STAT_ATTR(_name)					\
+static ssize_t _name##_show(const struct vmbus_channel *channel,	\
+			    char *buf)					\
+{									\
+	return sprintf(buf, "%llu\n",					\
+		       vmbus_chan_stat_sum(channel,			\
+			    offsetof(struct vmbus_channel_stats, _name))); \
+}									\
+static VMBUS_CHAN_ATTR_RO(_name)
+
+VMBUS_CHAN_STAT_ATTR(interrupts);
+VMBUS_CHAN_STAT_ATTR(callbacks);
+VMBUS_CHAN_STAT_ATTR(polls);
+VMBUS_CHAN_STAT_ATTR(in_packets);
+VMBUS_CHAN_STAT_ATTR(in_bytes);
+VMBUS_CHAN_STAT_ATTR(out_packets);
+VMBUS_CHAN_STAT_ATTR(out_bytes);
+VMBUS_CHAN_STAT_ATTR(signals);
+VMBUS_CHAN_STAT_ATTR(signals_suppressed);
+VMBUS_CHAN_STAT_ATTR(ring_full);
+VMBUS_CHAN_STAT_ATTR(pending_send_wakeups);
+
+static ssize_t vmbus_chan_occupancy_show(const struct vmbus_channel *channel,
+					 size_t offset, char *buf)
+{
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < VMBUS_OCCUPANCY_BUCKETS; i++)
+		len += sprintf(buf + len, "%llu%c",
+			       vmbus_chan_stat_sum(channel,
+					offset + i * sizeof(u64)),
+			       i == VMBUS_OCCUPANCY_BUCKETS - 1 ? '\n' : ' ');
+
+	return len;
+}
+
+static ssize_t in_occupancy_show(const struct vmbus_channel *channel,
+				 char *buf)
+{
+	return vmbus_chan_occupancy_show(channel,
+			offsetof(struct vmbus_channel_stats, in_occupancy),
+			buf);
+}
+static VMBUS_CHAN_ATTR_RO(in_occupancy);
+
+static ssize_t out_occupancy_show(const struct vmbus_channel *channel,
+				  char *buf)
+{
+	return vmbus_chan_occupancy_show(channel,
+			offsetof(struct vmbus_channel_stats, out_occupancy),
+			buf);
+}
+static VMBUS_CHAN_ATTR_RO(out_occupancy);
+
 static struct attribute *vmbus_chan_attrs[] = {
 	&chan_attr_out_mask.attr,
 	&chan_attr_in_mask.attr,
@@ -1640,6 +1979,22 @@ static struct attribute *vmbus_chan_attrs[] = {
 	&chan_attr_latency.attr,
 	&chan_attr_monitor_id.attr,
 	&chan_attr_subchannel_id.attr,
+	&chan_attr_read_mode.attr,
+	&chan_attr_poll_enter_rate.attr,
+	&chan_attr_poll_idle_us.attr,
+	&chan_attr_interrupts.attr,
+	&chan_attr_callbacks.attr,
+	&chan_attr_polls.attr,
+	&chan_attr_in_packets.attr,
+	&chan_attr_in_bytes.attr,
+	&chan_attr_out_packets.attr,
+	&chan_attr_out_bytes.attr,
+	&chan_attr_signals.attr,
+	&chan_attr_signals_suppressed.attr,
+	&chan_attr_ring_full.attr,
+	&chan_attr_pending_send_wakeups.attr,
+	&chan_attr_in_occupancy.attr,
+	&chan_attr_out_occupancy.attr,
 	NULL
 };
 
@@ -2176,6 +2531,7 @@ static void __exit vmbus_exit(void)
 	hv_remove_kexec_handler();
 	hv_remove_crash_handler();
 #endif
+	vmbus_rebalance_stop();
 	vmbus_connection.conn_state = DISCONNECTED;
 //	hv_synic_clockevents_cleanup();  will comment this for time being till clockevents_unbind showed up in distro code
 	vmbus_disconnect();